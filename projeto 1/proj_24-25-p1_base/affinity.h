@@ -0,0 +1,28 @@
+#ifndef KVS_AFFINITY_H
+#define KVS_AFFINITY_H
+
+// Groups of threads/processes that can be pinned to their own CPUs
+typedef enum {
+  AFFINITY_JOBS,     // threads running .job files
+  AFFINITY_BACKUPS,  // backup children
+  AFFINITY_ROLES
+} affinity_role;
+
+/// Sets the CPUs a role is pinned to.
+/// @param role Role to configure.
+/// @param spec A CPU list such as "0-3,8" or a NUMA node such as "node1".
+/// @return 0 on success, 1 if the spec is invalid or names no online CPU.
+int affinity_set_role(affinity_role role, const char *spec);
+
+/// Pins the calling thread to the CPUs of its role and reports the resulting
+/// placement on stdout. Does nothing if the role was not configured.
+/// @param role Role of the calling thread.
+/// @param name Name of the thread used in the report.
+void affinity_apply(affinity_role role, const char *name);
+
+/// Pins the calling process to the CPUs of its role, without reporting.
+/// Only uses async signal safe calls, so it can run in a forked child.
+/// @param role Role of the calling process.
+void affinity_apply_process(affinity_role role);
+
+#endif  // KVS_AFFINITY_H
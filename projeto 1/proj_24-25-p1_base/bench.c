@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "constants.h"
+#include "operations.h"
+
+// Load driver for the job engine. It runs the same calls a .job file
+// would, from several threads of this process, on a generated workload.
+
+// Kinds of operation timed separately
+enum { BENCH_READ, BENCH_WRITE, BENCH_DELETE, BENCH_BACKUP, BENCH_OPS };
+
+static const char *const op_names[BENCH_OPS] = {"READ", "WRITE", "DELETE", "BACKUP"};
+
+struct bench_config {
+  size_t keys;
+  double skew;
+  unsigned int mix[3];  // percentage of reads, writes and deletes
+  size_t batch;
+  int threads;
+  size_t ops;            // per thread
+  size_t backup_every;   // operations of a thread between backups, 0 for none
+  int max_backups;
+  char backup_dir[PATH_MAX / 2];
+};
+
+struct bench_thread {
+  int id;
+  const struct bench_config *config;
+  const zipf_dist *dist;
+  int out_fd;
+  latency_log logs[BENCH_OPS];
+};
+
+// Writes every key once so reads find them.
+static void preload(const struct bench_config *config) {
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+
+  for (size_t first = 0; first < config->keys; first += MAX_WRITE_SIZE) {
+    size_t n = config->keys - first < MAX_WRITE_SIZE ? config->keys - first : MAX_WRITE_SIZE;
+    for (size_t i = 0; i < n; i++) {
+      bench_key_name(first + i, keys[i], MAX_STRING_SIZE);
+      snprintf(values[i], MAX_STRING_SIZE, "v%zu", first + i);
+    }
+    kvs_write(n, keys, values);
+  }
+}
+
+static void *bench_thread_function(void *arg) {
+  struct bench_thread *thread = (struct bench_thread *)arg;
+  const struct bench_config *config = thread->config;
+  uint64_t state = UINT64_C(0x9E3779B97F4A7C15) * (uint64_t)(thread->id + 1);
+  int num_backups = 1;
+
+  char jobs_path[PATH_MAX];
+  snprintf(jobs_path, PATH_MAX, "%s/bench-%d.job", config->backup_dir, thread->id);
+  size_t path_len = strlen(jobs_path) + 1;
+
+  for (size_t op = 0; op < config->ops; op++) {
+    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    uint64_t start;
+
+    if (config->backup_every > 0 && op > 0 && op % config->backup_every == 0) {
+      start = bench_now_ns();
+      backup_handler(num_backups++, jobs_path, path_len);
+      latency_add(&thread->logs[BENCH_BACKUP], bench_now_ns() - start);
+    }
+
+    for (size_t i = 0; i < config->batch; i++) {
+      size_t rank = zipf_next(thread->dist, &state);
+      bench_key_name(rank, keys[i], MAX_STRING_SIZE);
+      snprintf(values[i], MAX_STRING_SIZE, "v%zu", op);
+    }
+
+    unsigned int pick = (unsigned int)(bench_random(&state) * 100);
+    int kind = pick < config->mix[0]                    ? BENCH_READ
+               : pick < config->mix[0] + config->mix[1] ? BENCH_WRITE
+                                                        : BENCH_DELETE;
+
+    start = bench_now_ns();
+    switch (kind) {
+      case BENCH_READ:
+        kvs_read(config->batch, keys, thread->out_fd);
+        break;
+      case BENCH_WRITE:
+        kvs_write(config->batch, keys, values);
+        break;
+      default:
+        kvs_delete(config->batch, keys, thread->out_fd);
+        break;
+    }
+    latency_add(&thread->logs[kind], bench_now_ns() - start);
+  }
+  return NULL;
+}
+
+// Parses the read, write and delete percentages, e.g. "60,30,10".
+static int parse_mix(const char *arg, unsigned int mix[3]) {
+  if (sscanf(arg, "%u,%u,%u", &mix[0], &mix[1], &mix[2]) != 3 ||
+      mix[0] + mix[1] + mix[2] != 100) {
+    fprintf(stderr, "The mix must be three percentages adding up to 100\n");
+    return 1;
+  }
+  return 0;
+}
+
+static void report(const struct bench_config *config, latency_log logs[BENCH_OPS],
+                   uint64_t elapsed_ns) {
+  double seconds = (double)elapsed_ns / 1e9;
+  size_t total = 0;
+
+  printf("Workload: %zu keys, zipf %.2f, mix %u/%u/%u, batch %zu, %d threads, "
+         "%zu ops per thread, backup every %zu ops\n",
+         config->keys, config->skew, config->mix[0], config->mix[1], config->mix[2],
+         config->batch, config->threads, config->ops, config->backup_every);
+  printf("%-8s %10s %12s %10s %10s %10s\n", "op", "count", "ops/s", "p50(us)", "p99(us)",
+         "p999(us)");
+  for (int kind = 0; kind < BENCH_OPS; kind++) {
+    latency_log *log = &logs[kind];
+    if (log->count == 0) {
+      continue;
+    }
+    total += log->count;
+    printf("%-8s %10zu %12.0f %10.2f %10.2f %10.2f\n", op_names[kind], log->count,
+           (double)log->count / seconds, (double)latency_percentile(log, 50) / 1e3,
+           (double)latency_percentile(log, 99) / 1e3, (double)latency_percentile(log, 99.9) / 1e3);
+  }
+  printf("%-8s %10zu %12.0f   in %.3f s\n", "total", total, (double)total / seconds, seconds);
+}
+
+int main(int argc, char *argv[]) {
+  struct bench_config config = {.keys = 1000, .skew = 0.99, .mix = {60, 30, 10}, .batch = 4,
+                                .threads = 4, .ops = 100000, .backup_every = 0,
+                                .max_backups = 1, .backup_dir = "/tmp"};
+  int opt;
+
+  while ((opt = getopt(argc, argv, "k:z:m:s:t:n:B:M:o:")) != -1) {
+    switch (opt) {
+      case 'k':
+        if (bench_parse_count(optarg, 0, &config.keys) != 0) {
+          fprintf(stderr, "Invalid count for -k: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'z':
+        config.skew = strtod(optarg, NULL);
+        break;
+      case 'm':
+        if (parse_mix(optarg, config.mix) != 0) {
+          return 1;
+        }
+        break;
+      case 's':
+        if (bench_parse_count(optarg, 0, &config.batch) != 0) {
+          fprintf(stderr, "Invalid count for -s: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 't':
+        config.threads = atoi(optarg);
+        break;
+      case 'n':
+        if (bench_parse_count(optarg, 0, &config.ops) != 0) {
+          fprintf(stderr, "Invalid count for -n: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'B':
+        if (bench_parse_count(optarg, 1, &config.backup_every) != 0) {
+          fprintf(stderr, "Invalid count for -B: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'M':
+        config.max_backups = atoi(optarg);
+        break;
+      case 'o':
+        snprintf(config.backup_dir, sizeof(config.backup_dir), "%s", optarg);
+        break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-k keys] [-z skew] [-m read,write,delete] [-s batch] [-t threads]\n"
+                "          [-n ops_per_thread] [-B backup_every] [-M max_backups] [-o backup_dir]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  if (config.keys == 0 || config.skew < 0 || config.batch == 0 ||
+      config.batch > MAX_WRITE_SIZE || config.threads <= 0 || config.max_backups <= 0) {
+    fprintf(stderr, "Invalid workload: keys and threads must be positive, the batch from 1 "
+                    "to %d and the skew not negative\n", MAX_WRITE_SIZE);
+    return 1;
+  }
+
+  zipf_dist dist;
+  if (kvs_init() || zipf_init(&dist, config.keys, config.skew)) {
+    fprintf(stderr, "Failed to initialize the benchmark\n");
+    return 1;
+  }
+  set_max_backups(config.max_backups);
+  preload(&config);
+
+  // Reads and deletes write their output like in a job, but nobody reads it
+  int out_fd = open("/dev/null", O_WRONLY);
+  if (out_fd == -1) {
+    fprintf(stderr, "Failed to open /dev/null\n");
+    return 1;
+  }
+
+  struct bench_thread *threads = safe_malloc((size_t)config.threads * sizeof(struct bench_thread));
+  pthread_t *ids = safe_malloc((size_t)config.threads * sizeof(pthread_t));
+  for (int i = 0; i < config.threads; i++) {
+    threads[i].id = i;
+    threads[i].config = &config;
+    threads[i].dist = &dist;
+    threads[i].out_fd = out_fd;
+    for (int kind = 0; kind < BENCH_OPS; kind++) {
+      if (latency_init(&threads[i].logs[kind], kind == BENCH_BACKUP ? 16 : config.ops) != 0) {
+        return 1;
+      }
+    }
+  }
+
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < config.threads; i++) {
+    if (pthread_create(&ids[i], NULL, bench_thread_function, &threads[i]) != 0) {
+      fprintf(stderr, "Failed to create thread\n");
+      return 1;
+    }
+  }
+  for (int i = 0; i < config.threads; i++) {
+    pthread_join(ids[i], NULL);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  // Backups still running are not part of the measurement
+  while (wait(NULL) != -1 || errno != ECHILD) {}
+
+  latency_log totals[BENCH_OPS];
+  for (int kind = 0; kind < BENCH_OPS; kind++) {
+    if (latency_init(&totals[kind], 16) != 0) {
+      return 1;
+    }
+    for (int i = 0; i < config.threads; i++) {
+      latency_merge(&totals[kind], &threads[i].logs[kind]);
+      latency_free(&threads[i].logs[kind]);
+    }
+  }
+  report(&config, totals, elapsed);
+
+  for (int kind = 0; kind < BENCH_OPS; kind++) {
+    latency_free(&totals[kind]);
+  }
+  free(threads);
+  free(ids);
+  zipf_free(&dist);
+  close(out_fd);
+  kvs_terminate();
+  return 0;
+}
@@ -0,0 +1,151 @@
+#include "bench_util.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+uint64_t bench_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * UINT64_C(1000000000) + (uint64_t)now.tv_nsec;
+}
+
+double bench_random(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  // The top 53 bits fill the mantissa of a double
+  return (double)((x * UINT64_C(0x2545F4914F6CDD1D)) >> 11) / 9007199254740992.0;
+}
+
+void bench_key_name(size_t rank, char *key, size_t size) {
+  snprintf(key, size, "%c%zu", 'a' + (int)(rank % 26), rank);
+}
+
+int bench_parse_count(const char *arg, int allow_zero, size_t *value) {
+  // strtoul takes leading spaces and signs, so check the first digit here
+  if (!isdigit((unsigned char)arg[0])) {
+    return 1;
+  }
+  char *end;
+  errno = 0;
+  unsigned long count = strtoul(arg, &end, 10);
+  if (errno != 0 || *end != '\0' || (count == 0 && !allow_zero)) {
+    return 1;
+  }
+  *value = count;
+  return 0;
+}
+
+int zipf_init(zipf_dist *dist, size_t n, double skew) {
+  dist->n = n;
+  dist->cdf = malloc(n * sizeof(double));
+  if (dist->cdf == NULL) {
+    fprintf(stderr, "Failed to allocate the Zipf table\n");
+    return 1;
+  }
+
+  double sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += 1.0 / pow((double)(i + 1), skew);
+    dist->cdf[i] = sum;
+  }
+  for (size_t i = 0; i < n; i++) {
+    dist->cdf[i] /= sum;
+  }
+  return 0;
+}
+
+size_t zipf_next(const zipf_dist *dist, uint64_t *state) {
+  double u = bench_random(state);
+
+  // First rank whose cumulative probability exceeds u
+  size_t low = 0, high = dist->n - 1;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (dist->cdf[mid] > u) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  return low;
+}
+
+void zipf_free(zipf_dist *dist) {
+  free(dist->cdf);
+  dist->cdf = NULL;
+}
+
+int latency_init(latency_log *log, size_t capacity) {
+  log->count = 0;
+  log->capacity = capacity > 0 ? capacity : 1;
+  log->sorted = 1;
+  log->samples = malloc(log->capacity * sizeof(uint64_t));
+  if (log->samples == NULL) {
+    fprintf(stderr, "Failed to allocate the latency log\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Makes room for more samples, exiting if there is no memory left as the
+// results would be meaningless.
+static void latency_reserve(latency_log *log, size_t count) {
+  if (log->count + count <= log->capacity) {
+    return;
+  }
+  while (log->count + count > log->capacity) {
+    log->capacity *= 2;
+  }
+  uint64_t *samples = realloc(log->samples, log->capacity * sizeof(uint64_t));
+  if (samples == NULL) {
+    fprintf(stderr, "Failed to grow the latency log\n");
+    exit(1);
+  }
+  log->samples = samples;
+}
+
+void latency_add(latency_log *log, uint64_t ns) {
+  latency_reserve(log, 1);
+  log->samples[log->count++] = ns;
+  log->sorted = 0;
+}
+
+void latency_merge(latency_log *into, const latency_log *from) {
+  latency_reserve(into, from->count);
+  memcpy(into->samples + into->count, from->samples, from->count * sizeof(uint64_t));
+  into->count += from->count;
+  into->sorted = 0;
+}
+
+static int compare_samples(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+uint64_t latency_percentile(latency_log *log, double percentile) {
+  if (log->count == 0) {
+    return 0;
+  }
+  if (!log->sorted) {
+    qsort(log->samples, log->count, sizeof(uint64_t), compare_samples);
+    log->sorted = 1;
+  }
+
+  // Nearest rank
+  size_t rank = (size_t)ceil(percentile / 100.0 * (double)log->count);
+  return log->samples[rank > 0 ? rank - 1 : 0];
+}
+
+void latency_free(latency_log *log) {
+  free(log->samples);
+  log->samples = NULL;
+  log->count = 0;
+}
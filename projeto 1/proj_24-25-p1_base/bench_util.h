@@ -0,0 +1,87 @@
+#ifndef KVS_BENCH_UTIL_H
+#define KVS_BENCH_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Ranks drawn with probability proportional to 1 / rank^skew
+typedef struct {
+  size_t n;
+  double *cdf;  // cdf[i] is the probability of a rank <= i
+} zipf_dist;
+
+// Latencies of one kind of operation, in nanoseconds
+typedef struct {
+  uint64_t *samples;
+  size_t count;
+  size_t capacity;
+  int sorted;
+} latency_log;
+
+/// Returns a monotonic timestamp.
+/// @return Nanoseconds since an arbitrary point.
+uint64_t bench_now_ns(void);
+
+/// Draws a uniform number from a per thread generator (xorshift64*).
+/// @param state Generator state, any value but 0.
+/// @return A number in [0, 1).
+double bench_random(uint64_t *state);
+
+/// Names the key of a rank. Keys start with a letter so they spread over
+/// the buckets of the table, whose hash is the first character.
+/// @param rank Rank of the key.
+/// @param key Where to write the name.
+/// @param size Size of key.
+void bench_key_name(size_t rank, char *key, size_t size);
+
+/// Parses a count given on the command line.
+/// @param arg Argument to parse, only decimal digits.
+/// @param allow_zero Whether 0 is a valid count.
+/// @param value Where to store the count.
+/// @return 0 on success, 1 if the argument is not a valid count.
+int bench_parse_count(const char *arg, int allow_zero, size_t *value);
+
+/// Builds a Zipf distribution over n ranks.
+/// @param dist Distribution to initialize.
+/// @param n Number of ranks, at least 1.
+/// @param skew Zipf exponent, 0 for a uniform distribution.
+/// @return 0 on success, 1 otherwise.
+int zipf_init(zipf_dist *dist, size_t n, double skew);
+
+/// Draws a rank, 0 being the most likely.
+/// @param dist Distribution to draw from.
+/// @param state Generator state, see bench_random.
+/// @return A rank in [0, n).
+size_t zipf_next(const zipf_dist *dist, uint64_t *state);
+
+/// Frees a distribution.
+/// @param dist Distribution to free.
+void zipf_free(zipf_dist *dist);
+
+/// Initializes an empty log.
+/// @param log Log to initialize.
+/// @param capacity Number of samples to reserve, the log grows past it.
+/// @return 0 on success, 1 otherwise.
+int latency_init(latency_log *log, size_t capacity);
+
+/// Records a sample.
+/// @param log Log to add to.
+/// @param ns Latency in nanoseconds.
+void latency_add(latency_log *log, uint64_t ns);
+
+/// Appends the samples of a log to another.
+/// @param into Log to add to.
+/// @param from Log to copy the samples of.
+void latency_merge(latency_log *into, const latency_log *from);
+
+/// Returns a percentile of the samples, sorting them if needed.
+/// @param log Log to query.
+/// @param percentile Percentile, from 0 to 100.
+/// @return The latency in nanoseconds, 0 if the log is empty.
+uint64_t latency_percentile(latency_log *log, double percentile);
+
+/// Frees a log.
+/// @param log Log to free.
+void latency_free(latency_log *log);
+
+#endif  // KVS_BENCH_UTIL_H
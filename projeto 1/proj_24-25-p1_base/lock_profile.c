@@ -0,0 +1,213 @@
+#ifdef LOCK_PROFILE
+
+#define LOCK_PROFILE_IMPL
+#include "lock_profile.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct {
+  const void *lock;  // NULL while the slot is free
+  char name[LOCK_PROFILE_NAME_SIZE];
+  uint64_t acquired;
+  uint64_t contended;
+  uint64_t wait_ns;
+  uint64_t hold_ns;
+} lock_slot;
+
+typedef struct {
+  const void *lock;
+  uint64_t since;
+} held_lock;
+
+// Open addressing on the lock address, slots are never freed
+static lock_slot slots[LOCK_PROFILE_SLOTS];
+
+// Locks held by the calling thread, to measure how long they are held
+static _Thread_local held_lock held[LOCK_PROFILE_HELD];
+static _Thread_local int held_count = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * UINT64_C(1000000000) + (uint64_t)now.tv_nsec;
+}
+
+// Finds the slot of a lock, claiming a free one the first time.
+// @return The slot, NULL once every slot is taken.
+static lock_slot *find_slot(const void *lock) {
+  size_t start = (size_t)(((uintptr_t)lock >> 4) % LOCK_PROFILE_SLOTS);
+
+  for (size_t i = 0; i < LOCK_PROFILE_SLOTS; i++) {
+    lock_slot *slot = &slots[(start + i) % LOCK_PROFILE_SLOTS];
+    const void *owner = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+    if (owner == NULL) {
+      // Another thread may claim it first, for the same lock or not
+      __atomic_compare_exchange_n(&slot->lock, &owner, lock, 0, __ATOMIC_ACQ_REL,
+                                  __ATOMIC_ACQUIRE);
+      if (owner == NULL) {
+        return slot;
+      }
+    }
+    if (owner == lock) {
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+void lock_profile_name(const void *lock, const char *name, int index) {
+  lock_slot *slot = find_slot(lock);
+  if (slot == NULL) {
+    return;
+  }
+  if (index < 0) {
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+  } else {
+    snprintf(slot->name, sizeof(slot->name), "%s[%d]", name, index);
+  }
+}
+
+static void acquired(const void *lock, int contended, uint64_t wait_ns) {
+  lock_slot *slot = find_slot(lock);
+  if (slot != NULL) {
+    __atomic_fetch_add(&slot->acquired, 1, __ATOMIC_RELAXED);
+    if (contended) {
+      __atomic_fetch_add(&slot->contended, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&slot->wait_ns, wait_ns, __ATOMIC_RELAXED);
+    }
+  }
+
+  if (held_count < LOCK_PROFILE_HELD) {
+    held[held_count].lock = lock;
+    held[held_count].since = now_ns();
+    held_count++;
+  }
+}
+
+static void released(const void *lock) {
+  // Locks are mostly released in the reverse order they were taken
+  for (int i = held_count - 1; i >= 0; i--) {
+    if (held[i].lock != lock) {
+      continue;
+    }
+    lock_slot *slot = find_slot(lock);
+    if (slot != NULL) {
+      __atomic_fetch_add(&slot->hold_ns, now_ns() - held[i].since, __ATOMIC_RELAXED);
+    }
+    held[i] = held[--held_count];
+    return;
+  }
+}
+
+int profiled_mutex_lock(pthread_mutex_t *mutex) {
+  int result = pthread_mutex_trylock(mutex);
+  if (result == EBUSY) {
+    uint64_t start = now_ns();
+    result = pthread_mutex_lock(mutex);
+    if (result == 0) {
+      acquired(mutex, 1, now_ns() - start);
+    }
+  } else if (result == 0) {
+    acquired(mutex, 0, 0);
+  }
+  return result;
+}
+
+int profiled_mutex_unlock(pthread_mutex_t *mutex) {
+  released(mutex);
+  return pthread_mutex_unlock(mutex);
+}
+
+int profiled_rwlock_tryrdlock(pthread_rwlock_t *rwlock) {
+  int result = pthread_rwlock_tryrdlock(rwlock);
+  if (result == 0) {
+    acquired(rwlock, 0, 0);
+  }
+  return result;
+}
+
+int profiled_rwlock_rdlock_busy(pthread_rwlock_t *rwlock) {
+  uint64_t start = now_ns();
+  int result = pthread_rwlock_rdlock(rwlock);
+  if (result == 0) {
+    acquired(rwlock, 1, now_ns() - start);
+  }
+  return result;
+}
+
+int profiled_rwlock_rdlock(pthread_rwlock_t *rwlock) {
+  int result = profiled_rwlock_tryrdlock(rwlock);
+  return result == EBUSY ? profiled_rwlock_rdlock_busy(rwlock) : result;
+}
+
+int profiled_rwlock_trywrlock(pthread_rwlock_t *rwlock) {
+  int result = pthread_rwlock_trywrlock(rwlock);
+  if (result == 0) {
+    acquired(rwlock, 0, 0);
+  }
+  return result;
+}
+
+int profiled_rwlock_wrlock_busy(pthread_rwlock_t *rwlock) {
+  uint64_t start = now_ns();
+  int result = pthread_rwlock_wrlock(rwlock);
+  if (result == 0) {
+    acquired(rwlock, 1, now_ns() - start);
+  }
+  return result;
+}
+
+int profiled_rwlock_wrlock(pthread_rwlock_t *rwlock) {
+  int result = profiled_rwlock_trywrlock(rwlock);
+  return result == EBUSY ? profiled_rwlock_wrlock_busy(rwlock) : result;
+}
+
+int profiled_rwlock_unlock(pthread_rwlock_t *rwlock) {
+  released(rwlock);
+  return pthread_rwlock_unlock(rwlock);
+}
+
+static int compare_wait(const void *a, const void *b) {
+  const lock_slot *x = *(const lock_slot *const *)a, *y = *(const lock_slot *const *)b;
+  if (x->wait_ns != y->wait_ns) {
+    return x->wait_ns < y->wait_ns ? 1 : -1;
+  }
+  return (x->hold_ns < y->hold_ns) - (x->hold_ns > y->hold_ns);
+}
+
+void lock_profile_report(void) {
+  lock_slot *ranked[LOCK_PROFILE_SLOTS];
+  size_t count = 0;
+
+  for (size_t i = 0; i < LOCK_PROFILE_SLOTS; i++) {
+    if (__atomic_load_n(&slots[i].lock, __ATOMIC_ACQUIRE) != NULL && slots[i].acquired > 0) {
+      ranked[count++] = &slots[i];
+    }
+  }
+  qsort(ranked, count, sizeof(lock_slot *), compare_wait);
+
+  fprintf(stderr, "%-24s %10s %10s %8s %10s %12s %10s %12s\n", "lock", "acquired", "contended",
+          "cont(%)", "wait(ms)", "avg wait(us)", "hold(ms)", "avg hold(us)");
+  for (size_t i = 0; i < count; i++) {
+    lock_slot *slot = ranked[i];
+    char address[LOCK_PROFILE_NAME_SIZE];
+    const char *name = slot->name;
+    if (name[0] == '\0') {
+      snprintf(address, sizeof(address), "%p", slot->lock);
+      name = address;
+    }
+
+    fprintf(stderr, "%-24s %10llu %10llu %8.2f %10.3f %12.3f %10.3f %12.3f\n", name,
+            (unsigned long long)slot->acquired, (unsigned long long)slot->contended,
+            100.0 * (double)slot->contended / (double)slot->acquired,
+            (double)slot->wait_ns / 1e6,
+            slot->contended > 0 ? (double)slot->wait_ns / (double)slot->contended / 1e3 : 0.0,
+            (double)slot->hold_ns / 1e6, (double)slot->hold_ns / (double)slot->acquired / 1e3);
+  }
+}
+
+#endif  // LOCK_PROFILE
@@ -10,9 +10,11 @@
 #include <sys/stat.h>   
 #include <unistd.h>  
 
+#include "affinity.h"
 #include "parser.h"
 #include "operations.h"
 #include "constants.h"
+#include "trace.h"
 
 
 int MAX_THREADS;
@@ -20,10 +22,34 @@ int CURRENT_THREADS = 0;
 
 int main(int argc, char *argv[]) {
 
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s <dir_path> <MAX_BACKUPS> <MAX_THREADS>\n", argv[0]);
+  int opt;
+  while ((opt = getopt(argc, argv, "j:b:T:")) != -1) {
+    switch (opt) {
+      case 'j':
+        if (affinity_set_role(AFFINITY_JOBS, optarg) != 0) {
+          return 1;
+        }
+        break;
+      case 'b':
+        if (affinity_set_role(AFFINITY_BACKUPS, optarg) != 0) {
+          return 1;
+        }
+        break;
+      case 'T':
+        trace_enable(optarg);
+        break;
+      default:
+        fprintf(stderr, "Invalid option\n");
+        return 1;
+    }
+  }
+
+  if (argc - optind != 3) {
+    fprintf(stderr, "Usage: %s [-j job_cpus] [-b backup_cpus] [-T trace_file] <dir_path> <MAX_BACKUPS> <MAX_THREADS>\n", argv[0]);
     return 1;
   }
+  // Options come first, the positional arguments follow them
+  argv += optind - 1;
 
   if (kvs_init()) {
     fprintf(stderr, "Failed to initialize KVS\n");
@@ -98,7 +124,10 @@ int main(int argc, char *argv[]) {
     }  
   }
 
-  while(wait(NULL) != -1 || errno != ECHILD) {}
+  pid_t child;
+  while((child = wait(NULL)) != -1 || errno != ECHILD) {
+    trace_child_exit(child);
+  }
   
   for (int i = 0; i < CURRENT_THREADS; i++) {
     if (threads[i] == 0) {
@@ -117,5 +146,7 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  trace_write();
+
   kvs_terminate();
 }
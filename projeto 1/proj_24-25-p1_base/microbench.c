@@ -0,0 +1,411 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "bench_util.h"
+#include "constants.h"
+#include "kvs.h"
+#include "parser.h"
+
+// Microbenchmarks of the hash table primitives and of the job parsers,
+// single threaded, reported as JSON on stdout so runs of different
+// implementations can be compared by a script.
+
+#define MAX_SIZES 8
+#define PARSE_BATCH 8  // pairs or keys per synthetic command
+
+// How the keys of the table are picked
+typedef enum { DIST_UNIFORM, DIST_ZIPF, DIST_ONE_BUCKET, DISTS } key_dist;
+
+static const char *const dist_names[DISTS] = {"uniform", "zipf", "one_bucket"};
+
+// Synthetic job texts
+typedef enum { TEXT_WRITE, TEXT_READ, TEXT_MIXED, TEXTS } job_text;
+
+static const char *const text_names[TEXTS] = {"write", "read", "mixed"};
+
+struct micro_config {
+  int reps;
+  int warmup;
+  size_t ops;
+  size_t sizes[MAX_SIZES];
+  size_t num_sizes;
+  size_t text_bytes;
+  double skew;
+};
+
+// Keys of a table and the order the timed operations use them in
+struct key_set {
+  size_t n;
+  char (*keys)[MAX_STRING_SIZE];
+  size_t *sequence;  // ops indexes into keys, drawn from the distribution
+  size_t *shuffled;  // every index once, for deletes
+};
+
+static int first_result = 1;
+
+// For one_bucket the keys all start with the same letter, so they collide.
+static void key_name(key_dist dist, size_t rank, char *key) {
+  if (dist == DIST_ONE_BUCKET) {
+    snprintf(key, MAX_STRING_SIZE, "a%zu", rank);
+  } else {
+    bench_key_name(rank, key, MAX_STRING_SIZE);
+  }
+}
+
+static int key_set_init(struct key_set *set, const struct micro_config *config, size_t n,
+                        key_dist dist) {
+  zipf_dist zipf;
+  uint64_t state = UINT64_C(0x9E3779B97F4A7C15) + n;
+
+  if (zipf_init(&zipf, n, dist == DIST_ZIPF ? config->skew : 0) != 0) {
+    return 1;
+  }
+  set->n = n;
+  set->keys = malloc(n * sizeof(*set->keys));
+  set->sequence = malloc(config->ops * sizeof(size_t));
+  set->shuffled = malloc(n * sizeof(size_t));
+  if (set->keys == NULL || set->sequence == NULL || set->shuffled == NULL) {
+    fprintf(stderr, "Failed to allocate the keys\n");
+    zipf_free(&zipf);
+    return 1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    key_name(dist, i, set->keys[i]);
+    set->shuffled[i] = i;
+  }
+  for (size_t i = 0; i < config->ops; i++) {
+    set->sequence[i] = zipf_next(&zipf, &state);
+  }
+  // Fisher-Yates
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = (size_t)(bench_random(&state) * (double)(i + 1));
+    size_t aux = set->shuffled[i];
+    set->shuffled[i] = set->shuffled[j];
+    set->shuffled[j] = aux;
+  }
+  zipf_free(&zipf);
+  return 0;
+}
+
+static void key_set_free(struct key_set *set) {
+  free(set->keys);
+  free(set->sequence);
+  free(set->shuffled);
+}
+
+static HashTable *filled_table(const struct key_set *set) {
+  HashTable *ht = create_hash_table();
+  if (ht == NULL) {
+    fprintf(stderr, "Failed to create the hash table\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < set->n; i++) {
+    write_pair(ht, set->keys[i], "value");
+  }
+  return ht;
+}
+
+// One repetition of each primitive.
+// @return Nanoseconds per operation.
+
+static double time_write(const struct key_set *set, size_t ops) {
+  HashTable *ht = filled_table(set);
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < ops; i++) {
+    write_pair(ht, set->keys[set->sequence[i]], "other");
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  free_table(ht);
+  return (double)elapsed / (double)ops;
+}
+
+static double time_read(const struct key_set *set, size_t ops) {
+  HashTable *ht = filled_table(set);
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < ops; i++) {
+    free(read_pair(ht, set->keys[set->sequence[i]]));
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  free_table(ht);
+  return (double)elapsed / (double)ops;
+}
+
+static double time_delete(const struct key_set *set, size_t ops) {
+  (void)ops;  // every key is deleted once
+  HashTable *ht = filled_table(set);
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < set->n; i++) {
+    delete_pair(ht, set->keys[set->shuffled[i]]);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  free_table(ht);
+  return (double)elapsed / (double)set->n;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Writes min, median and max of the repetitions, sorting them.
+static void print_summary(const char *name, double *samples, int reps) {
+  qsort(samples, (size_t)reps, sizeof(double), compare_doubles);
+  printf("\"%s\": {\"min\": %.3f, \"median\": %.3f, \"max\": %.3f}", name, samples[0],
+         samples[reps / 2], samples[reps - 1]);
+}
+
+static void begin_result(void) {
+  printf("%s\n    {", first_result ? "" : ",");
+  first_result = 0;
+}
+
+static void bench_table(const struct micro_config *config) {
+  static const char *const names[] = {"write_pair", "read_pair", "delete_pair"};
+  double (*const functions[])(const struct key_set *, size_t) = {time_write, time_read,
+                                                                 time_delete};
+  double *samples = malloc((size_t)config->reps * sizeof(double));
+  if (samples == NULL) {
+    fprintf(stderr, "Failed to allocate the samples\n");
+    exit(1);
+  }
+
+  for (size_t s = 0; s < config->num_sizes; s++) {
+    for (int dist = 0; dist < DISTS; dist++) {
+      struct key_set set;
+      if (key_set_init(&set, config, config->sizes[s], (key_dist)dist) != 0) {
+        exit(1);
+      }
+
+      for (size_t f = 0; f < sizeof(names) / sizeof(names[0]); f++) {
+        for (int rep = 0; rep < config->warmup; rep++) {
+          functions[f](&set, config->ops);
+        }
+        for (int rep = 0; rep < config->reps; rep++) {
+          samples[rep] = functions[f](&set, config->ops);
+        }
+
+        begin_result();
+        printf("\"bench\": \"%s\", \"keys\": %zu, \"dist\": \"%s\", \"ops\": %zu, ", names[f],
+               set.n, dist_names[dist], f == 2 ? set.n : config->ops);
+        print_summary("ns_per_op", samples, config->reps);
+        printf("}");
+      }
+      key_set_free(&set);
+    }
+  }
+  free(samples);
+}
+
+// Appends one command of the text to the file.
+// @return Number of bytes written.
+static size_t write_command(FILE *file, job_text text, size_t line, uint64_t *state) {
+  int kind = text == TEXT_WRITE  ? 0
+             : text == TEXT_READ ? 1
+                                 : (int)(bench_random(state) * 4);
+  int written;
+
+  switch (kind) {
+    case 0:
+      written = fprintf(file, "WRITE [");
+      for (size_t i = 0; i < PARSE_BATCH; i++) {
+        written += fprintf(file, "(%c%zu,value%zu)", 'a' + (int)((line + i) % 26), line + i, i);
+      }
+      written += fprintf(file, "]\n");
+      break;
+    case 1:
+    case 2:
+      written = fprintf(file, "%s [", kind == 1 ? "READ" : "DELETE");
+      for (size_t i = 0; i < PARSE_BATCH; i++) {
+        written += fprintf(file, "%s%c%zu", i > 0 ? "," : "", 'a' + (int)((line + i) % 26),
+                           line + i);
+      }
+      written += fprintf(file, "]\n");
+      break;
+    default:
+      written = fprintf(file, line % 2 ? "SHOW\n" : "# a comment\n");
+      break;
+  }
+  return written > 0 ? (size_t)written : 0;
+}
+
+// Creates an unlinked file holding about text_bytes of commands.
+// @return The file descriptor, -1 on failure.
+static int make_text(job_text text, size_t text_bytes, size_t *size) {
+  char path[] = "/tmp/kvs_microbench_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create the job text\n");
+    return -1;
+  }
+  unlink(path);
+
+  FILE *file = fdopen(dup(fd), "w");
+  if (file == NULL) {
+    close(fd);
+    return -1;
+  }
+  uint64_t state = UINT64_C(0x2545F4914F6CDD1D);
+  *size = 0;
+  for (size_t line = 0; *size < text_bytes; line++) {
+    *size += write_command(file, text, line, &state);
+  }
+  fclose(file);
+  return fd;
+}
+
+// Parses the whole text the way the jobs do.
+// @return Nanoseconds taken.
+static uint64_t time_parse(int fd) {
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  enum Command command;
+
+  lseek(fd, 0, SEEK_SET);
+  uint64_t start = bench_now_ns();
+  while ((command = get_next(fd)) != EOC) {
+    switch (command) {
+      case CMD_WRITE:
+        parse_write(fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+        break;
+      case CMD_READ:
+      case CMD_DELETE:
+        parse_read_delete(fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+        break;
+      case CMD_SHOW:
+      case CMD_WAIT:
+      case CMD_BACKUP:
+      case CMD_HELP:
+      case CMD_EMPTY:
+      case CMD_INVALID:
+      case EOC:
+        break;
+    }
+  }
+  return bench_now_ns() - start;
+}
+
+static void bench_parser(const struct micro_config *config) {
+  double *samples = malloc((size_t)config->reps * sizeof(double));
+  if (samples == NULL) {
+    fprintf(stderr, "Failed to allocate the samples\n");
+    exit(1);
+  }
+
+  for (int text = 0; text < TEXTS; text++) {
+    size_t size;
+    int fd = make_text((job_text)text, config->text_bytes, &size);
+    if (fd == -1) {
+      exit(1);
+    }
+
+    for (int rep = 0; rep < config->warmup; rep++) {
+      time_parse(fd);
+    }
+    for (int rep = 0; rep < config->reps; rep++) {
+      samples[rep] = (double)size / 1e6 / ((double)time_parse(fd) / 1e9);
+    }
+
+    begin_result();
+    printf("\"bench\": \"parse\", \"text\": \"%s\", \"bytes\": %zu, ", text_names[text], size);
+    print_summary("mb_per_s", samples, config->reps);
+    printf("}");
+    close(fd);
+  }
+  free(samples);
+}
+
+// Parses a comma separated list of key counts, e.g. "64,1024,16384".
+static int parse_sizes(const char *arg, struct micro_config *config) {
+  const char *ptr = arg;
+  config->num_sizes = 0;
+
+  while (*ptr != '\0') {
+    char *end;
+    unsigned long size = strtoul(ptr, &end, 10);
+    if (end == ptr || size == 0 || config->num_sizes == MAX_SIZES) {
+      fprintf(stderr, "The key counts must be up to %d positive numbers\n", MAX_SIZES);
+      return 1;
+    }
+    config->sizes[config->num_sizes++] = size;
+    ptr = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0') {
+      fprintf(stderr, "The key counts must be separated by commas\n");
+      return 1;
+    }
+  }
+  return config->num_sizes == 0;
+}
+
+int main(int argc, char *argv[]) {
+  struct micro_config config = {.reps = 5, .warmup = 1, .ops = 20000,
+                                .sizes = {64, 1024, 16384}, .num_sizes = 3,
+                                .text_bytes = 256 * 1024, .skew = 0.99};
+  const char *cpus = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "r:w:n:k:b:z:c:")) != -1) {
+    switch (opt) {
+      case 'r':
+        config.reps = atoi(optarg);
+        break;
+      case 'w':
+        config.warmup = atoi(optarg);
+        break;
+      case 'n':
+        if (bench_parse_count(optarg, 0, &config.ops) != 0) {
+          fprintf(stderr, "Invalid count for -n: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'k':
+        if (parse_sizes(optarg, &config) != 0) {
+          return 1;
+        }
+        break;
+      case 'b':
+        if (bench_parse_count(optarg, 0, &config.text_bytes) != 0) {
+          fprintf(stderr, "Invalid count for -b: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'z':
+        config.skew = strtod(optarg, NULL);
+        break;
+      case 'c':
+        cpus = optarg;
+        if (affinity_set_role(AFFINITY_JOBS, optarg) != 0) {
+          return 1;
+        }
+        break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-r reps] [-w warmup_reps] [-n ops] [-k key_counts] "
+                "[-b text_bytes]\n          [-z skew] [-c cpus]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  if (config.reps <= 0 || config.warmup < 0 || config.ops == 0 || config.text_bytes == 0 ||
+      config.skew < 0) {
+    fprintf(stderr, "Invalid options: reps, ops and text bytes must be positive\n");
+    return 1;
+  }
+
+  // Pinned so the repetitions do not migrate between CPUs
+  affinity_apply_process(AFFINITY_JOBS);
+
+  printf("{\n  \"config\": {\"reps\": %d, \"warmup\": %d, \"ops\": %zu, \"skew\": %.2f, "
+         "\"table_size\": %d, \"cpus\": \"%s\"},\n  \"results\": [",
+         config.reps, config.warmup, config.ops, config.skew, TABLE_SIZE,
+         cpus != NULL ? cpus : "any");
+  bench_table(&config);
+  bench_parser(&config);
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,9 +8,12 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "affinity.h"
 #include "kvs.h"
+#include "lock_profile.h"
 #include "operations.h"
 #include "parser.h"
+#include "trace.h"
 
 int MAX_BACKUPS;
 int current_backups = 0;
@@ -34,6 +38,11 @@ int kvs_init() {
   safe_rwlock_init(&(kvs_table->table_lock));
   for (int i = 0; i < TABLE_SIZE; i++)
     safe_rwlock_init(&(kvs_table->cell_locks[i]));
+
+  LOCK_PROFILE_NAME(&global_lock, "global_lock", -1);
+  LOCK_PROFILE_NAME(&kvs_table->table_lock, "table_lock", -1);
+  for (int i = 0; i < TABLE_SIZE; i++)
+    LOCK_PROFILE_NAME(&kvs_table->cell_locks[i], "cell_locks", i);
   return kvs_table == NULL;
 }
 
@@ -45,6 +54,8 @@ int kvs_terminate() {
   safe_rwlock_destroy(&(kvs_table->table_lock));
   for (int i = 0; i < TABLE_SIZE; i++)
     safe_rwlock_destroy(&(kvs_table->cell_locks[i]));
+
+  LOCK_PROFILE_REPORT();
   return 0;
 }
 
@@ -256,17 +267,24 @@ int backup_handler(int num_backups, char *jobs_path, size_t len) {
   strcat(backup_path, suffix);
 
   pid_t pid;
+  uint64_t start;
 
   safe_rwlock_wrlock(&global_lock);
   safe_rwlock_wrlock(&kvs_table->table_lock);
   if (current_backups >= MAX_BACKUPS) {
     safe_rwlock_unlock(&global_lock);
     safe_rwlock_unlock(&kvs_table->table_lock);
-    wait(NULL);
+    start = trace_begin();
+    trace_child_exit(wait(NULL));
+    trace_end("backup slot wait", "backup", start);
+    start = trace_begin();
     pid = fork();
+    trace_fork(pid, start);
   }
   else {
+    start = trace_begin();
     pid = fork();
+    trace_fork(pid, start);
     current_backups++;
     safe_rwlock_unlock(&global_lock);
     safe_rwlock_unlock(&kvs_table->table_lock);
@@ -274,6 +292,7 @@ int backup_handler(int num_backups, char *jobs_path, size_t len) {
 
   if (pid == 0) {
     // Child process
+    affinity_apply_process(AFFINITY_BACKUPS);
     int backup_fd = open(backup_path, open_flags, file_perms);
     if (backup_fd == -1) {
         fprintf(stderr, "Failed to open backup file\n");
@@ -357,6 +376,11 @@ void *thread_function(void *args) {
   mode_t file_perms = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH | S_IWGRP | S_IWOTH;
   int num_backups = 1;
 
+  affinity_apply(AFFINITY_JOBS, "job thread");
+  trace_thread_name(strrchr(jobs_path, '/') != NULL ? strrchr(jobs_path, '/') + 1 : jobs_path);
+  uint64_t job_start = trace_begin();
+  uint64_t start = job_start;
+
   int jobs_fd = open(jobs_path, O_RDONLY);
   if (jobs_fd == -1) {
     fprintf(stderr, "Failed to open job file\n");
@@ -375,6 +399,7 @@ void *thread_function(void *args) {
     free(t_args);
     return ret;
   }
+  trace_end("job open", "job", start);
 
   while (!exit_flag) {
     char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
@@ -382,9 +407,14 @@ void *thread_function(void *args) {
     unsigned int delay;
     size_t num_pairs;
 
+    // Each command is a span, parsing included, the parsing a span within
+    start = trace_begin();
+    uint64_t parse_start = start;
+
     switch (get_next(jobs_fd)) {
       case CMD_WRITE:
         num_pairs = parse_write(jobs_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+        trace_end("parse", "parse", parse_start);
         if (num_pairs == 0) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
           continue;
@@ -393,11 +423,13 @@ void *thread_function(void *args) {
         if (kvs_write(num_pairs, keys, values)) {
           fprintf(stderr, "Failed to write pair\n");
         }
+        trace_end("WRITE", "command", start);
 
         break;
 
       case CMD_READ:
         num_pairs = parse_read_delete(jobs_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+        trace_end("parse", "parse", parse_start);
 
         if (num_pairs == 0) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
@@ -407,10 +439,12 @@ void *thread_function(void *args) {
         if (kvs_read(num_pairs, keys, out_fd)) {
           fprintf(stderr, "Failed to read pair\n");
         }
+        trace_end("READ", "command", start);
         break;
 
       case CMD_DELETE:
         num_pairs = parse_read_delete(jobs_fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+        trace_end("parse", "parse", parse_start);
 
         if (num_pairs == 0) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
@@ -420,12 +454,14 @@ void *thread_function(void *args) {
         if (kvs_delete(num_pairs, keys, out_fd)) {
           fprintf(stderr, "Failed to delete pair\n");
         }
+        trace_end("DELETE", "command", start);
         break;
 
       case CMD_SHOW:
         if (kvs_show(out_fd)) {
           fprintf(stderr, "Failed to show KVS\n");
         }
+        trace_end("SHOW", "command", start);
         break;
 
       case CMD_WAIT:
@@ -438,11 +474,13 @@ void *thread_function(void *args) {
           write_to_file(out_fd, "Waiting...\n");
           kvs_wait(delay);
         }
+        trace_end("WAIT", "command", start);
         break;
 
       case CMD_BACKUP:
         backup_handler(num_backups, jobs_path, t_args->path_len);
         num_backups++;
+        trace_end("BACKUP", "command", start);
         break;
       case CMD_INVALID:
         fprintf(stderr, "Invalid command. See HELP for usage\n");
@@ -468,6 +506,7 @@ void *thread_function(void *args) {
       case EOC:
         *ret = 0;
         exit_flag = 1;
+        trace_end("job", "job", job_start);
 
     }
     if (exit_flag) {
@@ -536,6 +575,9 @@ void *safe_malloc(size_t size) {
   return ptr;
 }
 
+// The lock wrappers below are profiled when built with LOCK_PROFILE, see
+// lock_profile.h.
+
 void safe_mutex_init(pthread_mutex_t *mutex) {
   if (pthread_mutex_init(mutex, NULL) != 0) {
     fprintf(stderr, "Failed to initialize mutex\n");
@@ -571,15 +613,34 @@ void safe_rwlock_init(pthread_rwlock_t *rwlock) {
   }
 }
 
+// Locks a rwlock, tracing the time spent waiting when it was taken. The
+// trylock and the wait after it both go through the lock profiler, so the
+// lock is never tried twice.
+// @param write Whether to take it for writing.
+// @return The result of the pthread call.
+static int traced_lock(pthread_rwlock_t *rwlock, int write) {
+  if (!trace_enabled()) {
+    return write ? pthread_rwlock_wrlock(rwlock) : pthread_rwlock_rdlock(rwlock);
+  }
+  int result = write ? pthread_rwlock_trywrlock(rwlock) : pthread_rwlock_tryrdlock(rwlock);
+  if (result != EBUSY) {
+    return result;
+  }
+  uint64_t start = trace_begin();
+  result = write ? LOCK_PROFILE_WRLOCK_BUSY(rwlock) : LOCK_PROFILE_RDLOCK_BUSY(rwlock);
+  trace_end("lock wait", "lock", start);
+  return result;
+}
+
 void safe_rwlock_rdlock(pthread_rwlock_t *rwlock) {
-  if (pthread_rwlock_rdlock(rwlock) != 0) {
+  if (traced_lock(rwlock, 0) != 0) {
     fprintf(stderr, "Failed to lock rw_rdlock\n");
     exit(EXIT_FAILURE);
   }
 }
 
 void safe_rwlock_wrlock(pthread_rwlock_t *rwlock) {
-  if (pthread_rwlock_wrlock(rwlock) != 0) {
+  if (traced_lock(rwlock, 1) != 0) {
     fprintf(stderr, "Failed to lock rw_wrlock\n");
     exit(EXIT_FAILURE);
   }
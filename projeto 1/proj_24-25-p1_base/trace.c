@@ -0,0 +1,269 @@
+#include "trace.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_NAME_SIZE 64
+
+typedef struct {
+  const char *name;
+  const char *category;
+  uint64_t start;
+  uint64_t duration;
+  pid_t child;  // backup child the span belongs to, 0 for the thread itself
+} trace_event;
+
+// Only ever written by the thread that owns it
+typedef struct trace_buffer {
+  struct trace_buffer *next;
+  int tid;
+  char name[TRACE_NAME_SIZE];
+  size_t count;
+  size_t dropped;
+  trace_event events[TRACE_BUFFER_EVENTS];
+} trace_buffer;
+
+typedef struct {
+  pid_t pid;  // 0 while the slot is free
+  uint64_t start;
+} traced_child;
+
+static int trace_on = 0;
+static char trace_path[PATH_MAX];
+static uint64_t trace_origin;
+
+// Buffers of every thread that recorded a span, pushed with a CAS
+static trace_buffer *buffers = NULL;
+static int next_tid = 1;
+static _Thread_local trace_buffer *own_buffer = NULL;
+
+static traced_child children[TRACE_MAX_CHILDREN];
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * UINT64_C(1000000000) + (uint64_t)now.tv_nsec;
+}
+
+void trace_enable(const char *path) {
+  snprintf(trace_path, sizeof(trace_path), "%s", path);
+  trace_origin = now_ns();
+  trace_on = 1;
+}
+
+// Returns the buffer of the calling thread, creating it on its first span.
+// @return The buffer, NULL if there is no memory for it.
+static trace_buffer *thread_buffer(void) {
+  if (own_buffer != NULL) {
+    return own_buffer;
+  }
+
+  trace_buffer *buffer = malloc(sizeof(trace_buffer));
+  if (buffer == NULL) {
+    return NULL;
+  }
+  buffer->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+  snprintf(buffer->name, sizeof(buffer->name), "thread %d", buffer->tid);
+  buffer->count = 0;
+  buffer->dropped = 0;
+
+  buffer->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&buffers, &buffer->next, buffer, 1, __ATOMIC_RELEASE,
+                                      __ATOMIC_RELAXED)) {
+  }
+  own_buffer = buffer;
+  return buffer;
+}
+
+static void record(const char *name, const char *category, uint64_t start, pid_t child) {
+  trace_buffer *buffer = thread_buffer();
+  if (buffer == NULL) {
+    return;
+  }
+  if (buffer->count == TRACE_BUFFER_EVENTS) {
+    buffer->dropped++;
+    return;
+  }
+
+  trace_event *event = &buffer->events[buffer->count++];
+  event->name = name;
+  event->category = category;
+  event->start = start;
+  event->duration = now_ns() - start;
+  event->child = child;
+}
+
+int trace_enabled(void) {
+  return trace_on;
+}
+
+uint64_t trace_begin(void) {
+  return trace_on ? now_ns() : 0;
+}
+
+void trace_end(const char *name, const char *category, uint64_t start) {
+  if (start == 0) {
+    return;
+  }
+  record(name, category, start, 0);
+}
+
+void trace_thread_name(const char *name) {
+  if (!trace_on) {
+    return;
+  }
+  trace_buffer *buffer = thread_buffer();
+  if (buffer != NULL) {
+    snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+  }
+}
+
+void trace_fork(pid_t pid, uint64_t start) {
+  if (start == 0 || pid <= 0) {
+    return;
+  }
+  record("backup fork", "backup", start, 0);
+
+  for (size_t i = 0; i < TRACE_MAX_CHILDREN; i++) {
+    pid_t free_slot = 0;
+    // Claimed with -1, the pid is only published once start is set
+    if (__atomic_compare_exchange_n(&children[i].pid, &free_slot, -1, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      children[i].start = start;
+      __atomic_store_n(&children[i].pid, pid, __ATOMIC_RELEASE);
+      return;
+    }
+  }
+}
+
+void trace_child_exit(pid_t pid) {
+  if (!trace_on || pid <= 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < TRACE_MAX_CHILDREN; i++) {
+    if (__atomic_load_n(&children[i].pid, __ATOMIC_ACQUIRE) == pid) {
+      record("backup child", "backup", children[i].start, pid);
+      __atomic_store_n(&children[i].pid, 0, __ATOMIC_RELEASE);
+      return;
+    }
+  }
+}
+
+// Writes a string as a JSON string, escaping what needs to be.
+static void write_json_string(FILE *file, const char *str) {
+  fputc('"', file);
+  for (; *str != '\0'; str++) {
+    if (*str == '"' || *str == '\\') {
+      fputc('\\', file);
+    }
+    if ((unsigned char)*str >= ' ') {
+      fputc(*str, file);
+    }
+  }
+  fputc('"', file);
+}
+
+static int compare_pids(const void *a, const void *b) {
+  pid_t x = *(const pid_t *)a, y = *(const pid_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Names the process track of every backup child, once per pid even if it
+// was reused. Tracks are left unnamed if there is no memory to sort them.
+static void write_child_names(FILE *file, trace_buffer *first) {
+  size_t count = 0;
+  for (trace_buffer *buffer = first; buffer != NULL; buffer = buffer->next) {
+    for (size_t i = 0; i < buffer->count; i++) {
+      count += buffer->events[i].child != 0;
+    }
+  }
+  pid_t *pids = malloc(count * sizeof(pid_t));
+  if (count == 0 || pids == NULL) {
+    free(pids);
+    return;
+  }
+
+  size_t n = 0;
+  for (trace_buffer *buffer = first; buffer != NULL; buffer = buffer->next) {
+    for (size_t i = 0; i < buffer->count; i++) {
+      if (buffer->events[i].child != 0) {
+        pids[n++] = buffer->events[i].child;
+      }
+    }
+  }
+  qsort(pids, n, sizeof(pid_t), compare_pids);
+  for (size_t i = 0; i < n; i++) {
+    if (i == 0 || pids[i] != pids[i - 1]) {
+      fprintf(file, ",\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+                    "\"args\": {\"name\": \"backup %d\"}}", (int)pids[i], (int)pids[i]);
+    }
+  }
+  free(pids);
+}
+
+// Frees the buffers of every thread and stops tracing, the run is over.
+static void free_buffers(void) {
+  trace_buffer *buffer = __atomic_exchange_n(&buffers, NULL, __ATOMIC_ACQUIRE);
+  while (buffer != NULL) {
+    trace_buffer *next = buffer->next;
+    free(buffer);
+    buffer = next;
+  }
+  own_buffer = NULL;
+  trace_on = 0;
+}
+
+int trace_write(void) {
+  if (!trace_on) {
+    return 0;
+  }
+
+  FILE *file = fopen(trace_path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Failed to open trace file\n");
+    free_buffers();
+    return 1;
+  }
+
+  int pid = (int)getpid();
+  size_t dropped = 0;
+  fprintf(file, "{\"traceEvents\": [\n");
+  fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": "
+                "{\"name\": \"kvs\"}}", pid);
+  trace_buffer *first = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+  write_child_names(file, first);
+
+  for (trace_buffer *buffer = first; buffer != NULL; buffer = buffer->next) {
+    fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                  "\"args\": {\"name\": ", pid, buffer->tid);
+    write_json_string(file, buffer->name);
+    fprintf(file, "}}");
+
+    for (size_t i = 0; i < buffer->count; i++) {
+      trace_event *event = &buffer->events[i];
+      // Backup children get a process track of their own
+      int event_pid = event->child != 0 ? (int)event->child : pid;
+      int event_tid = event->child != 0 ? (int)event->child : buffer->tid;
+      fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, "
+                    "\"dur\": %.3f, \"pid\": %d, \"tid\": %d}",
+              event->name, event->category, (double)(event->start - trace_origin) / 1e3,
+              (double)event->duration / 1e3, event_pid, event_tid);
+    }
+    dropped += buffer->dropped;
+  }
+  fprintf(file, "\n],\n\"displayTimeUnit\": \"ms\"}\n");
+
+  if (dropped > 0) {
+    fprintf(stderr, "Trace buffers full, %zu spans dropped\n", dropped);
+  }
+  free_buffers();
+  if (fclose(file) != 0) {
+    fprintf(stderr, "Failed to write trace file\n");
+    return 1;
+  }
+  return 0;
+}
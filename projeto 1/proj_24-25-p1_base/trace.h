@@ -0,0 +1,53 @@
+#ifndef KVS_TRACE_H
+#define KVS_TRACE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Timeline of a run in the Chrome trace_event format, for Perfetto or
+// chrome://tracing. Every thread records its spans in a buffer of its own,
+// without locks, and the buffers are written out once at the end of the run.
+// While tracing is off each call only tests a flag.
+
+#define TRACE_BUFFER_EVENTS 65536  // per thread, later events are dropped
+#define TRACE_MAX_CHILDREN 256     // backup children in flight at once
+
+/// Turns tracing on. Must be called before any thread is created.
+/// @param path File the trace is written to by trace_write.
+void trace_enable(const char *path);
+
+/// Tells whether tracing is on, to skip work done only for the trace.
+/// @return 1 if it is, 0 otherwise.
+int trace_enabled(void);
+
+/// Returns the start of a span, to pass to trace_end.
+/// @return Monotonic time in nanoseconds, 0 while tracing is off.
+uint64_t trace_begin(void);
+
+/// Records a span of the calling thread, from start until now.
+/// @param name Name of the span, must outlive the run (a literal).
+/// @param category Category of the span, must outlive the run as well.
+/// @param start Timestamp returned by trace_begin.
+void trace_end(const char *name, const char *category, uint64_t start);
+
+/// Names the calling thread in the timeline.
+/// @param name Name, copied.
+void trace_thread_name(const char *name);
+
+/// Records the fork of a backup child. Its life is drawn on a track of its
+/// own until trace_child_exit.
+/// @param pid Value returned by fork, ignored unless positive.
+/// @param start Timestamp taken by trace_begin before the fork.
+void trace_fork(pid_t pid, uint64_t start);
+
+/// Records that a backup child was reaped.
+/// @param pid Value returned by wait, ignored unless positive.
+void trace_child_exit(pid_t pid);
+
+/// Writes every recorded span to the file given to trace_enable and frees
+/// the buffers, tracing is off afterwards. Must be called once the other
+/// threads have finished.
+/// @return 0 on success or while tracing is off, 1 otherwise.
+int trace_write(void);
+
+#endif  // KVS_TRACE_H
@@ -0,0 +1,477 @@
+// Notification latency benchmark. For each client count it starts a
+// server, connects the clients through the FIFO protocol with the
+// asynchronous API, subscribes each of them to the same keys and feeds
+// WRITE commands to the server through a .job file. The job file is a
+// FIFO, so the time each WRITE is handed to the server is known and the
+// latency is measured from there to each client's notification.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../client/async_api.h"
+#include "../common/constants.h"
+#include "../common/io.h"
+
+#define MAX_ROUNDS 32
+#define MAX_BENCH_KEYS 256
+#define MAX_SERVER_ARGS 32
+#define SERVER_START_TIMEOUT_MS 5000
+#define DRAIN_TIMEOUT_MS 2000  // after the last write, for late notifications
+
+struct bench_config {
+  size_t clients[MAX_ROUNDS];
+  size_t rounds;
+  size_t keys;    // subscribed by every client
+  size_t writes;
+  unsigned int rate;  // writes per second, 0 for as fast as possible
+  const char *server_path;
+  char *server_opts;
+};
+
+// State of a round, shared with the notification callbacks and the writer.
+// The writer thread only touches sent and writer_done while the round runs.
+struct bench_round {
+  const struct bench_config *config;
+  int job_fd;
+  _Atomic uint64_t *sent;  // when each write was handed to the server
+  uint64_t *latencies;    // one per notification received
+  size_t received;
+  size_t expected;
+  size_t subscribed;
+  uint64_t first_sent;
+  uint64_t last_received;
+  atomic_int writer_done;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * UINT64_C(1000000000) + (uint64_t)now.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns) {
+  struct timespec delay = {(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+  nanosleep(&delay, NULL);
+}
+
+static void key_name(size_t index, char *key) {
+  snprintf(key, MAX_STRING_SIZE, "bk%zu", index);
+}
+
+// Parses a comma separated list of client counts, e.g. "1,2,4".
+static int parse_clients(const char *arg, struct bench_config *config) {
+  config->rounds = 0;
+  while (*arg != '\0' && config->rounds < MAX_ROUNDS) {
+    char *end;
+    unsigned long count = strtoul(arg, &end, 10);
+    if (end == arg || count == 0 || (*end != ',' && *end != '\0')) {
+      fprintf(stderr, "Invalid client counts: %s\n", arg);
+      return 1;
+    }
+    config->clients[config->rounds++] = count;
+    arg = *end == ',' ? end + 1 : end;
+  }
+  return 0;
+}
+
+// Starts the server on a jobs directory, silencing its output.
+// @return The pid of the server, -1 on failure.
+static pid_t start_server(const struct bench_config *config, const char *jobs_dir,
+                          const char *name) {
+  char opts[PATH_MAX];
+  char *args[MAX_SERVER_ARGS + 5];
+  size_t argc = 0;
+
+  args[argc++] = (char *)config->server_path;
+  snprintf(opts, sizeof(opts), "%s", config->server_opts != NULL ? config->server_opts : "");
+  for (char *opt = strtok(opts, " "); opt != NULL && argc < MAX_SERVER_ARGS;
+       opt = strtok(NULL, " ")) {
+    args[argc++] = opt;
+  }
+  args[argc++] = (char *)jobs_dir;
+  args[argc++] = "1";  // job threads, the only job is the benchmark's
+  args[argc++] = "1";  // backups
+  args[argc++] = (char *)name;
+  args[argc] = NULL;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    execv(config->server_path, args);
+    _exit(127);
+  }
+  if (pid == -1) {
+    perror("fork");
+  }
+  return pid;
+}
+
+// Waits for the register pipe of the server to appear.
+// @return 0 once it exists, 1 on timeout.
+static int wait_for_server(const char *name) {
+  char reg_path[PATH_MAX];
+  snprintf(reg_path, sizeof(reg_path), "/tmp/al97_reg_%s", name);
+
+  for (int waited = 0; waited < SERVER_START_TIMEOUT_MS; waited += 10) {
+    struct stat st;
+    if (stat(reg_path, &st) == 0 && S_ISFIFO(st.st_mode)) {
+      return 0;
+    }
+    sleep_ns(10000000);
+  }
+  fprintf(stderr, "The server did not start, see %s\n", reg_path);
+  return 1;
+}
+
+static void on_notification(kvs_session *session, const char *key, const char *value,
+                            void *arg) {
+  struct bench_round *round = (struct bench_round *)arg;
+  (void)session;
+  (void)key;
+
+  // The initial values are not numbers and are not timed
+  char *end;
+  unsigned long index = strtoul(value, &end, 10);
+  if (end == value || *end != '\0' || index >= round->config->writes ||
+      round->received == round->expected) {
+    return;
+  }
+  uint64_t now = now_ns();
+  round->latencies[round->received++] =
+      now - atomic_load_explicit(&round->sent[index], memory_order_acquire);
+  round->last_received = now;
+}
+
+static void on_subscribed(kvs_session *session, const kvs_reply *reply, void *arg) {
+  struct bench_round *round = (struct bench_round *)arg;
+  (void)session;
+  for (size_t i = 0; i < reply->count; i++) {
+    round->subscribed += reply->results[i] == 1;
+  }
+}
+
+// Writes a whole line to the job file.
+static int write_line(int fd, const char *line) {
+  return write_all(fd, line, strlen(line)) == -1;
+}
+
+// Feeds the timed writes to the job file at the configured rate.
+static void *writer_thread(void *arg) {
+  struct bench_round *round = (struct bench_round *)arg;
+  const struct bench_config *config = round->config;
+  uint64_t interval = config->rate > 0 ? 1000000000 / config->rate : 0;
+  uint64_t start = now_ns();
+  round->first_sent = start;
+
+  for (size_t i = 0; i < config->writes; i++) {
+    char line[2 * MAX_STRING_SIZE + 16];
+    char key[MAX_STRING_SIZE];
+    key_name(i % config->keys, key);
+    snprintf(line, sizeof(line), "WRITE [(%s,%zu)]\n", key, i);
+
+    uint64_t due = start + i * interval;
+    uint64_t now = now_ns();
+    if (due > now) {
+      sleep_ns(due - now);
+    }
+    atomic_store_explicit(&round->sent[i], now_ns(), memory_order_release);
+    if (write_line(round->job_fd, line) != 0) {
+      fprintf(stderr, "Failed to write to the job file\n");
+      break;
+    }
+  }
+  atomic_store(&round->writer_done, 1);
+  return NULL;
+}
+
+// Lets every session do its work, waiting up to timeout_ms for some.
+static int process_sessions(kvs_session **sessions, size_t count, int timeout_ms) {
+  struct pollfd fds[MAX_SESSION_COUNT];
+  for (size_t i = 0; i < count; i++) {
+    fds[i].fd = kvs_session_fd(sessions[i]);
+    fds[i].events = POLLIN;
+  }
+  if (poll(fds, (nfds_t)count, timeout_ms) == -1 && errno != EINTR) {
+    return 1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (kvs_session_process(sessions[i]) != 0) {
+      fprintf(stderr, "The server closed session %zu\n", i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, size_t count, double percentile) {
+  size_t rank = (size_t)((percentile / 100.0) * (double)count);
+  return count == 0 ? 0 : (double)sorted[rank < count ? rank : count - 1] / 1e3;
+}
+
+static void report(const struct bench_round *round, size_t clients) {
+  qsort(round->latencies, round->received, sizeof(uint64_t), compare_latencies);
+  double seconds = (double)(round->last_received - round->first_sent) / 1e9;
+
+  printf("%7zu %10zu/%-10zu %12.0f %10.1f %10.1f %10.1f %10.1f\n", clients, round->received,
+         round->expected, seconds > 0 ? (double)round->received / seconds : 0,
+         percentile_us(round->latencies, round->received, 50),
+         percentile_us(round->latencies, round->received, 99),
+         percentile_us(round->latencies, round->received, 99.9),
+         percentile_us(round->latencies, round->received, 100));
+}
+
+static void on_read(kvs_session *session, const kvs_reply *reply, void *arg) {
+  size_t *found = (size_t *)arg;
+  (void)session;
+  for (size_t i = 0; i < reply->count; i++) {
+    *found += reply->results[i] == 0;
+  }
+}
+
+// Sends a request for every MAX_NUMBER_SUB benchmark keys.
+static void request_keys(kvs_session *session, int subscribe, kvs_reply_cb cb, void *arg,
+                         size_t count) {
+  char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE];
+
+  for (size_t first = 0; first < count; first += MAX_NUMBER_SUB) {
+    size_t n = count - first < MAX_NUMBER_SUB ? count - first : MAX_NUMBER_SUB;
+    for (size_t i = 0; i < n; i++) {
+      key_name(first + i, keys[i]);
+    }
+    if (subscribe) {
+      kvs_async_subscribe(session, (const char (*)[MAX_STRING_SIZE])keys, n, cb, arg);
+    } else {
+      kvs_async_read(session, (const char (*)[MAX_STRING_SIZE])keys, n, cb, arg);
+    }
+  }
+}
+
+// Subscribes every session to the benchmark keys once the initial writes
+// of the job have created them. Subscribing twice would notify twice.
+static int subscribe_all(kvs_session **sessions, size_t count, struct bench_round *round) {
+  size_t keys = round->config->keys;
+  size_t found = 0;
+
+  for (int attempt = 0; attempt < 100 && found < keys; attempt++) {
+    found = 0;
+    request_keys(sessions[0], 0, on_read, &found, keys);
+    for (int i = 0; i < 10; i++) {
+      if (process_sessions(sessions, count, 10) != 0) {
+        return 1;
+      }
+    }
+  }
+
+  for (size_t s = 0; s < count; s++) {
+    request_keys(sessions[s], 1, on_subscribed, round, keys);
+  }
+  for (int i = 0; i < 100 && round->subscribed < count * keys; i++) {
+    if (process_sessions(sessions, count, 10) != 0) {
+      return 1;
+    }
+  }
+  return round->subscribed < count * keys;
+}
+
+// Runs the benchmark with a number of clients.
+static int run_round(const struct bench_config *config, size_t clients) {
+  char jobs_dir[] = "/tmp/al97_bench_XXXXXX";
+  char job_path[PATH_MAX], out_path[PATH_MAX], name[32];
+  kvs_session *sessions[MAX_SESSION_COUNT];
+  size_t connected = 0;
+  int ret = 1;
+
+  if (mkdtemp(jobs_dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  snprintf(job_path, sizeof(job_path), "%s/bench.job", jobs_dir);
+  snprintf(out_path, sizeof(out_path), "%s/bench.out", jobs_dir);
+  snprintf(name, sizeof(name), "bench%d_%zu", getpid(), clients);
+  if (mkfifo(job_path, PIPE_PERMS) != 0) {
+    perror("mkfifo");
+    rmdir(jobs_dir);
+    return 1;
+  }
+
+  struct bench_round round;
+  memset(&round, 0, sizeof(round));
+  round.config = config;
+  atomic_init(&round.writer_done, 0);
+  round.expected = config->writes * clients;
+  round.sent = calloc(config->writes, sizeof(*round.sent));
+  round.latencies = calloc(round.expected, sizeof(uint64_t));
+  round.job_fd = -1;
+
+  pid_t server = start_server(config, jobs_dir, name);
+  if (round.sent == NULL || round.latencies == NULL || server == -1 || wait_for_server(name)) {
+    goto cleanup;
+  }
+
+  for (; connected < clients; connected++) {
+    char client_id[64];
+    snprintf(client_id, sizeof(client_id), "%s_%zu", name, connected);
+    sessions[connected] = kvs_session_open(client_id, name, on_notification, &round);
+    if (sessions[connected] == NULL) {
+      goto cleanup;
+    }
+  }
+
+  // The server opens the job when it starts, the keys are created first
+  round.job_fd = open(job_path, O_WRONLY);
+  if (round.job_fd == -1) {
+    perror("Failed to open the job file");
+    goto cleanup;
+  }
+  for (size_t i = 0; i < config->keys; i++) {
+    char key[MAX_STRING_SIZE], line[MAX_STRING_SIZE + 32];
+    key_name(i, key);
+    snprintf(line, sizeof(line), "WRITE [(%s,init)]\n", key);
+    if (write_line(round.job_fd, line) != 0) {
+      goto cleanup;
+    }
+  }
+  if (subscribe_all(sessions, connected, &round) != 0) {
+    fprintf(stderr, "Failed to subscribe the clients\n");
+    goto cleanup;
+  }
+  // The notifications of the initial values are not timed
+  for (int i = 0; i < 10; i++) {
+    process_sessions(sessions, connected, 10);
+  }
+
+  pthread_t writer;
+  if (pthread_create(&writer, NULL, writer_thread, &round) != 0) {
+    fprintf(stderr, "Failed to create the writer thread\n");
+    goto cleanup;
+  }
+  uint64_t idle_since = 0;
+  while (round.received < round.expected) {
+    size_t before = round.received;
+    if (process_sessions(sessions, connected, 10) != 0) {
+      break;
+    }
+    if (!atomic_load(&round.writer_done) || round.received != before) {
+      idle_since = now_ns();
+    } else if (now_ns() - idle_since > (uint64_t)DRAIN_TIMEOUT_MS * 1000000) {
+      break;  // some notifications were dropped or coalesced
+    }
+  }
+  pthread_join(writer, NULL);
+  report(&round, clients);
+  ret = 0;
+
+cleanup:
+  for (size_t i = 0; i < connected; i++) {
+    kvs_session_close(sessions[i]);
+  }
+  if (round.job_fd != -1) {
+    close(round.job_fd);
+  }
+  if (server > 0) {
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+  }
+  char server_path[PATH_MAX];
+  snprintf(server_path, sizeof(server_path), "/tmp/al97_reg_%s", name);
+  unlink(server_path);
+  snprintf(server_path, sizeof(server_path), "%s%s", "/tmp/al97_sock_", name);
+  unlink(server_path);
+  unlink(job_path);
+  unlink(out_path);
+  rmdir(jobs_dir);
+  free(round.sent);
+  free(round.latencies);
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  struct bench_config config = {.keys = 4, .writes = 2000, .rate = 2000,
+                                .server_path = "server/kvs", .server_opts = NULL};
+  int opt;
+
+  // By default the client count doubles up to what the server accepts
+  for (size_t clients = 1; clients <= MAX_SESSION_COUNT && config.rounds < MAX_ROUNDS;
+       clients *= 2) {
+    config.clients[config.rounds++] = clients;
+  }
+
+  while ((opt = getopt(argc, argv, "c:k:w:r:S:o:")) != -1) {
+    switch (opt) {
+      case 'c':
+        if (parse_clients(optarg, &config) != 0) {
+          return 1;
+        }
+        break;
+      case 'k':
+        config.keys = strtoul(optarg, NULL, 10);
+        break;
+      case 'w':
+        config.writes = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        config.rate = (unsigned int)strtoul(optarg, NULL, 10);
+        break;
+      case 'S':
+        config.server_path = optarg;
+        break;
+      case 'o':
+        config.server_opts = optarg;
+        break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-c clients,...] [-k keys] [-w writes] [-r writes_per_second]\n"
+                "          [-S server_binary] [-o \"server options\"]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+
+  if (config.keys == 0 || config.keys > MAX_BENCH_KEYS || config.writes == 0) {
+    fprintf(stderr, "Invalid workload: from 1 to %d keys and at least one write\n",
+            MAX_BENCH_KEYS);
+    return 1;
+  }
+  for (size_t i = 0; i < config.rounds; i++) {
+    if (config.clients[i] > MAX_SESSION_COUNT) {
+      fprintf(stderr, "At most %d clients, build with make MAX_SESSIONS=n for more\n",
+              MAX_SESSION_COUNT);
+      return 1;
+    }
+  }
+
+  // A server that dies must not kill the benchmark while it feeds the job
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("%zu keys per client, %zu writes at %u/s\n", config.keys, config.writes, config.rate);
+  printf("%7s %21s %12s %10s %10s %10s %10s\n", "clients", "notifications", "notif/s",
+         "p50(us)", "p99(us)", "p999(us)", "max(us)");
+  for (size_t i = 0; i < config.rounds; i++) {
+    if (run_round(&config, config.clients[i]) != 0) {
+      fprintf(stderr, "Round with %zu clients failed\n", config.clients[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -6,11 +6,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "../common/constants.h"
 #include "../common/io.h"
+#include "../common/notif_ring.h"
 #include "../common/protocol.h"
+#include "../common/wire.h"
+#include "socket_transport.h"
 
 int req_pipe_fd;
 int resp_pipe_fd;
@@ -18,13 +22,43 @@ int notif_pipe_fd;
 char const* req_pipe;
 char const* resp_pipe;
 char const* notif_pipe;
+int protocol_version = PROTOCOL_V1;  // set by the server on connect
+notif_ring* notifications_ring = NULL;
+change_seq_t last_sequence = 0;  // of the last notification read
+int use_socket = 0;  // the three descriptors are one socket, see kvs_use_socket
 
-int kvs_connect(char const* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path,
-                char const* notif_pipe_path, int* notifications_fd) {
-  req_pipe = req_pipe_path;
-  resp_pipe = resp_pipe_path;
-  notif_pipe = notif_pipe_path;
+void kvs_use_socket(int enabled) {
+  use_socket = enabled;
+}
 
+// Reads the next bytes of the replies, from the pipe or the socket.
+static int read_reply(void* buf, size_t size) {
+  if (use_socket) {
+    return socket_read_reply(resp_pipe_fd, buf, size);
+  }
+  return read_all(resp_pipe_fd, buf, size, NULL);
+}
+
+// Opens a session on the socket of the server instead of the pipes.
+static int connect_socket(char const* server_pipe_path, int* notifications_fd) {
+  fprintf(stdout, "Connecting to server socket: %s%s\n", SOCKET_PATH_PREFIX, server_pipe_path);
+
+  int fd = socket_connect(server_pipe_path);
+  if (fd == -1) {
+    return 1;
+  }
+  req_pipe_fd = fd;
+  resp_pipe_fd = fd;
+  notif_pipe_fd = fd;
+  *notifications_fd = fd;
+  return 0;
+}
+
+// Sends the connect request through the register pipe and opens the
+// session pipes.
+static int connect_pipes(char const* req_pipe_path, char const* resp_pipe_path,
+                         char const* server_pipe_path, char const* notif_pipe_path,
+                         int* notifications_fd) {
   //Creates the server path to pipe to connect to server, it should be in /tmp/al97_reg_server_name_
   char reg_pipe_path[PATH_MAX];
 
@@ -36,15 +70,14 @@ int kvs_connect(char const* req_pipe_path, char const* resp_pipe_path, char cons
 
   int server_fd = safe_open(reg_pipe_path, O_WRONLY);
 
-  char message[1 + 3 * MAX_PIPE_PATH_LENGTH];
-  message[0] = OP_CONNECT;
-  strncpy(message + 1, req_pipe_path, MAX_PIPE_PATH_LENGTH);
-  strncpy(message + 1 + MAX_PIPE_PATH_LENGTH, resp_pipe_path, MAX_PIPE_PATH_LENGTH);
-  strncpy(message + 1 + 2 * MAX_PIPE_PATH_LENGTH, notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+  // Asks for the newest protocol version
+  char message[CONNECT_FRAME_SIZE];
+  char const* const paths[] = {req_pipe_path, resp_pipe_path, notif_pipe_path};
+  size_t message_len = wire_put_connect(message, paths);
   
-  fprintf(stdout, "Sending message to server: %s\n", message);
+  fprintf(stdout, "Sending message to server: %s\n", req_pipe_path);
   
-  int ret = write_all(server_fd, message, 1 + 3 * MAX_PIPE_PATH_LENGTH);
+  int ret = write_all(server_fd, message, message_len);
   if (ret == -1) {
     fprintf(stderr, "Failed to write to server\n");
     return 1;
@@ -57,23 +90,52 @@ int kvs_connect(char const* req_pipe_path, char const* resp_pipe_path, char cons
   notif_pipe_fd = safe_open(notif_pipe_path, O_RDONLY);
 
   *notifications_fd = notif_pipe_fd;
+  return 0;
+}
+
+int kvs_connect(char const* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path,
+                char const* notif_pipe_path, int* notifications_fd) {
+  req_pipe = req_pipe_path;
+  resp_pipe = resp_pipe_path;
+  notif_pipe = notif_pipe_path;
+
+  int ret;
+  if (use_socket) {
+    ret = connect_socket(server_pipe_path, notifications_fd);
+  } else {
+    ret = connect_pipes(req_pipe_path, resp_pipe_path, server_pipe_path, notif_pipe_path,
+                        notifications_fd);
+  }
+  if (ret != 0) {
+    return 1;
+  }
 
   char code, res;
-  ret = read_all(resp_pipe_fd, &code, sizeof(char), NULL);
+  ret = read_reply(&code, sizeof(char));
   if (ret == -1) {
     fprintf(stderr, "Failed to read from server\n");
     return 1;
   }
 
-  ret = read_all(resp_pipe_fd, &res, sizeof(char), NULL);
+  ret = read_reply(&res, sizeof(char));
   if (ret == -1) {
     fprintf(stderr, "Failed to read from server\n");
     return 1;
   }
 
+  // Servers that only speak version 1 answer with OP_CONNECT
+  if (code == OP_CONNECT_V2) {
+    char version;
+    if (read_reply(&version, sizeof(char)) != 1) {
+      fprintf(stderr, "Failed to read from server\n");
+      return 1;
+    }
+    protocol_version = version;
+  }
+
   fprintf(stdout, "Server returned %d for operation: connect\n", res);
 
-  if (code != OP_CONNECT || res != 0) {
+  if ((code != OP_CONNECT && code != OP_CONNECT_V2) || res != 0) {
     fprintf(stderr, "Error connecting to server\n"); 
     return 1;
   }
@@ -92,13 +154,13 @@ int kvs_disconnect(void) {
 
   code = '\0';
   char res;
-  ret = read_all(resp_pipe_fd, &code, sizeof(char), NULL);
+  ret = read_reply(&code, sizeof(char));
   if (ret == -1) {
     fprintf(stderr, "Failed to read from server\n");
     return 1;
   }
 
-  ret = read_all(resp_pipe_fd, &res, sizeof(char), NULL);
+  ret = read_reply(&res, sizeof(char));
   if (ret == -1) {
     fprintf(stderr, "Failed to read from server\n");
     return 1;
@@ -111,27 +173,25 @@ int kvs_disconnect(void) {
     return 1;
   }
 
-  safe_close(req_pipe_fd);
-  safe_close(resp_pipe_fd);
+  // The socket is closed with the notifications descriptor
+  if (!use_socket) {
+    safe_close(req_pipe_fd);
+    safe_close(resp_pipe_fd);
 
-  safe_unlink(req_pipe);
-  safe_unlink(resp_pipe);
+    safe_unlink(req_pipe);
+    safe_unlink(resp_pipe);
+  }
 
   return 0;
 }
 
 int kvs_subscribe(const char* key) {
   char code = OP_SUBSCRIBE;
-  char subs_key[MAX_STRING_SIZE + 1] = {'\0'};
-  strncpy(subs_key, key, MAX_STRING_SIZE);
-
-  int ret = write_all(req_pipe_fd, &code, sizeof(code));
-  if (ret == -1) {
-    fprintf(stderr, "Failed to write to server\n");
-    return 1;
-  }
+  char request[1 + MAX_WIRE_STRING_SIZE];
+  request[0] = code;
+  size_t request_len = 1 + wire_put_string(request + 1, key, protocol_version);
 
-  ret = write_all(req_pipe_fd, subs_key, MAX_STRING_SIZE + 1);
+  int ret = write_all(req_pipe_fd, request, request_len);
   if (ret == -1) {
     fprintf(stderr, "Failed to write to server\n");
     return 1;
@@ -139,13 +199,13 @@ int kvs_subscribe(const char* key) {
 
   code = '\0';
   char res;
-  ret = read_all(resp_pipe_fd, &code, sizeof(char), NULL);
+  ret = read_reply(&code, sizeof(char));
   if (ret == -1) {
     fprintf(stderr, "Failed to read from server\n");
     return 1;
   }
 
-  ret = read_all(resp_pipe_fd, &res, sizeof(char), NULL);
+  ret = read_reply(&res, sizeof(char));
   if (ret == -1) {
     fprintf(stderr, "Failed to read from server\n");
     return 1;
@@ -158,16 +218,11 @@ int kvs_subscribe(const char* key) {
 
 int kvs_unsubscribe(const char* key) {
   char code = OP_UNSUBSCRIBE;
-  char unsubs_key[MAX_STRING_SIZE + 1] = {'\0'};
-  strncpy(unsubs_key, key, MAX_STRING_SIZE);
+  char request[1 + MAX_WIRE_STRING_SIZE];
+  request[0] = code;
+  size_t request_len = 1 + wire_put_string(request + 1, key, protocol_version);
 
-  int ret = write_all(req_pipe_fd, &code, sizeof(code));
-  if (ret == -1) {
-    fprintf(stderr, "Failed to write to server\n");
-    return 1;
-  }
-
-  ret = write_all(req_pipe_fd, unsubs_key, MAX_STRING_SIZE + 1);
+  int ret = write_all(req_pipe_fd, request, request_len);
   if (ret == -1) {
     fprintf(stderr, "Failed to write to server\n");
     return 1;
@@ -176,13 +231,13 @@ int kvs_unsubscribe(const char* key) {
 
   code = '\0';
   char res;
-  ret = read_all(resp_pipe_fd, &code, sizeof(char), NULL);
+  ret = read_reply(&code, sizeof(char));
   if (ret == -1) {
     fprintf(stderr, "Failed to read from server\n");
     return 1;
   }
 
-  ret = read_all(resp_pipe_fd, &res, sizeof(char), NULL);
+  ret = read_reply(&res, sizeof(char));
   if (ret == -1) {
     fprintf(stderr, "Failed to read from server\n");
     return 1;
@@ -193,6 +248,360 @@ int kvs_unsubscribe(const char* key) {
   return 0;
 }
 
+// Sends all keys in one batch request and reads the result vector.
+static int send_batch(char code, const char keys[][MAX_STRING_SIZE], size_t n, char* results) {
+  char request[1 + MAX_BATCH_FRAME_SIZE(MAX_NUMBER_SUB)];
+  char reply[1 + 1 + MAX_NUMBER_SUB];
+  size_t request_len = 2;
+
+  if (n == 0 || n > MAX_NUMBER_SUB) {
+    return 1;
+  }
+
+  request[0] = code;
+  request[1] = (char)n;
+  for (size_t i = 0; i < n; i++) {
+    request_len += wire_put_string(request + request_len, keys[i], protocol_version);
+  }
+
+  if (write_all(req_pipe_fd, request, request_len) == -1) {
+    fprintf(stderr, "Failed to write to server\n");
+    return 1;
+  }
+
+  if (read_reply(reply, 2) != 1) {
+    fprintf(stderr, "Failed to read from server\n");
+    return 1;
+  }
+  if (reply[0] != code || (size_t)(unsigned char)reply[1] != n) {
+    fprintf(stderr, "Unexpected reply from server\n");
+    return 1;
+  }
+  if (read_reply(results, n) != 1) {
+    fprintf(stderr, "Failed to read from server\n");
+    return 1;
+  }
+  return 0;
+}
+
+int kvs_subscribe_batch(const char keys[][MAX_STRING_SIZE], size_t n, char* results) {
+  if (send_batch(OP_SUBSCRIBE_BATCH, keys, n, results) != 0) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    fprintf(stdout, "Server returned %d for operation: subscribe\n", results[i]);
+  }
+  return 0;
+}
+
+int kvs_unsubscribe_batch(const char keys[][MAX_STRING_SIZE], size_t n, char* results) {
+  if (send_batch(OP_UNSUBSCRIBE_BATCH, keys, n, results) != 0) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    fprintf(stdout, "Server returned %d for operation: unsubscribe\n", results[i]);
+  }
+  return 0;
+}
+
+// Sends the keys as tagged batches of up to MAX_NUMBER_SUB keys, all of them
+// before reading any reply, then collects the replies. The id of a batch is
+// its index, which tells where its results go.
+static int send_pipelined(char code, const char keys[][MAX_STRING_SIZE], size_t n, char* results) {
+  char requests[MAX_SOCKET_RECORD_SIZE];
+  size_t requests_len = 0;
+  size_t batches = (n + MAX_NUMBER_SUB - 1) / MAX_NUMBER_SUB;
+  char tagged = (char)(code | OP_FLAG_TAGGED);
+
+  if (n == 0 || batches > UINT32_MAX) {
+    return 1;
+  }
+
+  for (size_t b = 0; b < batches; b++) {
+    size_t first = b * MAX_NUMBER_SUB;
+    size_t count = n - first < MAX_NUMBER_SUB ? n - first : MAX_NUMBER_SUB;
+    request_id_t id = (request_id_t)b;
+
+    // A socket record must hold whole frames, so a frame is never split
+    // across two writes
+    if (sizeof(requests) - requests_len < 1 + REQUEST_ID_SIZE + MAX_BATCH_FRAME_SIZE(count)) {
+      if (write_all(req_pipe_fd, requests, requests_len) == -1) {
+        fprintf(stderr, "Failed to write to server\n");
+        return 1;
+      }
+      requests_len = 0;
+    }
+
+    requests[requests_len++] = tagged;
+    memcpy(requests + requests_len, &id, REQUEST_ID_SIZE);
+    requests_len += REQUEST_ID_SIZE;
+    requests[requests_len++] = (char)count;
+    for (size_t i = first; i < first + count; i++) {
+      requests_len += wire_put_string(requests + requests_len, keys[i], protocol_version);
+    }
+  }
+
+  if (write_all(req_pipe_fd, requests, requests_len) == -1) {
+    fprintf(stderr, "Failed to write to server\n");
+    return 1;
+  }
+
+  char* answered = calloc(batches, sizeof(char));
+  if (answered == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    return 1;
+  }
+
+  int ret = 0;
+  for (size_t b = 0; b < batches && ret == 0; b++) {
+    char reply[1 + REQUEST_ID_SIZE + 1];
+    request_id_t id;
+    if (read_reply(reply, sizeof(reply)) != 1) {
+      fprintf(stderr, "Failed to read from server\n");
+      ret = 1;
+      break;
+    }
+
+    memcpy(&id, reply + 1, REQUEST_ID_SIZE);
+    size_t first = (size_t)id * MAX_NUMBER_SUB;
+    size_t count = (size_t)(unsigned char)reply[1 + REQUEST_ID_SIZE];
+    if (reply[0] != tagged || id >= batches || answered[id] ||
+        count != (n - first < MAX_NUMBER_SUB ? n - first : MAX_NUMBER_SUB)) {
+      fprintf(stderr, "Unexpected reply from server\n");
+      ret = 1;
+      break;
+    }
+    answered[id] = 1;
+
+    if (read_reply(results + first, count) != 1) {
+      fprintf(stderr, "Failed to read from server\n");
+      ret = 1;
+    }
+  }
+
+  free(answered);
+  return ret;
+}
+
+int kvs_subscribe_pipelined(const char keys[][MAX_STRING_SIZE], size_t n, char* results) {
+  if (send_pipelined(OP_SUBSCRIBE_BATCH, keys, n, results) != 0) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    fprintf(stdout, "Server returned %d for operation: subscribe\n", results[i]);
+  }
+  return 0;
+}
+
+int kvs_unsubscribe_pipelined(const char keys[][MAX_STRING_SIZE], size_t n, char* results) {
+  if (send_pipelined(OP_UNSUBSCRIBE_BATCH, keys, n, results) != 0) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    fprintf(stdout, "Server returned %d for operation: unsubscribe\n", results[i]);
+  }
+  return 0;
+}
+
+static int read_fifo(void* source, void* buf, size_t size) {
+  return read_all(*(int*)source, buf, size, NULL);
+}
+
+static int read_replies(void* source, void* buf, size_t size) {
+  (void)source;
+  return read_reply(buf, size);
+}
+
+int kvs_resume(const char keys[][MAX_STRING_SIZE], size_t n, change_seq_t since, char* results) {
+  char request[1 + MAX_RESUME_FRAME_SIZE(MAX_NUMBER_SUB)];
+  char reply[3];
+  size_t request_len = 1;
+
+  if (n == 0 || n > MAX_NUMBER_SUB) {
+    return 1;
+  }
+
+  request[0] = OP_RESUME;
+  memcpy(request + request_len, &since, SEQUENCE_SIZE);
+  request_len += SEQUENCE_SIZE;
+  request[request_len++] = (char)n;
+  for (size_t i = 0; i < n; i++) {
+    request_len += wire_put_string(request + request_len, keys[i], protocol_version);
+  }
+
+  if (write_all(req_pipe_fd, request, request_len) == -1) {
+    fprintf(stderr, "Failed to write to server\n");
+    return 1;
+  }
+
+  if (read_reply(reply, sizeof(reply)) != 1) {
+    fprintf(stderr, "Failed to read from server\n");
+    return 1;
+  }
+  if (reply[0] != OP_RESUME || (size_t)(unsigned char)reply[2] != n) {
+    fprintf(stderr, "Unexpected reply from server\n");
+    return 1;
+  }
+  if (read_reply(results, n) != 1) {
+    fprintf(stderr, "Failed to read from server\n");
+    return 1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    fprintf(stdout, "Server returned %d for operation: subscribe\n", results[i]);
+  }
+  fprintf(stdout, "Resumed from sequence %llu with a %s\n", (unsigned long long)since,
+          reply[1] == RESUME_SNAPSHOT ? "snapshot" : "replay");
+  return 0;
+}
+
+// Sends a READ, WRITE or DELETE request and reads the start of its reply.
+// @param values Value of each key for a WRITE, NULL otherwise.
+// @return 0 if the server answered for every key, 1 otherwise.
+static int send_data_request(char code, const char keys[][MAX_STRING_SIZE],
+                             const char values[][MAX_STRING_SIZE], size_t n) {
+  char request[1 + MAX_WRITE_FRAME_SIZE(MAX_NUMBER_SUB)];
+  char reply[2];
+  size_t request_len = 2;
+
+  if (n == 0 || n > MAX_NUMBER_SUB) {
+    return 1;
+  }
+
+  request[0] = code;
+  request[1] = (char)n;
+  for (size_t i = 0; i < n; i++) {
+    request_len += wire_put_string(request + request_len, keys[i], protocol_version);
+    if (values != NULL) {
+      request_len += wire_put_string(request + request_len, values[i], protocol_version);
+    }
+  }
+
+  if (write_all(req_pipe_fd, request, request_len) == -1) {
+    fprintf(stderr, "Failed to write to server\n");
+    return 1;
+  }
+
+  if (read_reply(reply, sizeof(reply)) != 1) {
+    fprintf(stderr, "Failed to read from server\n");
+    return 1;
+  }
+  if (reply[0] != code || (size_t)(unsigned char)reply[1] != n) {
+    fprintf(stderr, "Unexpected reply from server\n");
+    return 1;
+  }
+  return 0;
+}
+
+int kvs_read(const char keys[][MAX_STRING_SIZE], size_t n, char values[][MAX_STRING_SIZE + 1],
+             char* found) {
+  if (send_data_request(OP_READ, keys, NULL, n) != 0) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    char missing;
+    if (read_reply(&missing, sizeof(char)) != 1 ||
+        (!missing && wire_read_string(read_replies, NULL, values[i], protocol_version) != 1)) {
+      fprintf(stderr, "Failed to read from server\n");
+      return 1;
+    }
+    found[i] = !missing;
+  }
+  return 0;
+}
+
+int kvs_write(const char keys[][MAX_STRING_SIZE], const char values[][MAX_STRING_SIZE], size_t n,
+              char* results) {
+  if (send_data_request(OP_WRITE, keys, values, n) != 0 ||
+      read_reply(results, n) != 1) {
+    fprintf(stderr, "Command write failed\n");
+    return 1;
+  }
+  return 0;
+}
+
+int kvs_delete(const char keys[][MAX_STRING_SIZE], size_t n, char* results) {
+  if (send_data_request(OP_DELETE, keys, NULL, n) != 0 ||
+      read_reply(results, n) != 1) {
+    fprintf(stderr, "Command delete failed\n");
+    return 1;
+  }
+  return 0;
+}
+
+int kvs_use_shared_notifications(char const* shm_name) {
+  notif_ring* ring = notif_ring_create(shm_name);
+  if (ring == NULL) {
+    fprintf(stderr, "Failed to create the notifications ring\n");
+    return 1;
+  }
+
+  char request[1 + MAX_WIRE_STRING_SIZE];
+  request[0] = OP_NOTIF_SHM;
+  size_t request_len = 1 + wire_put_string(request + 1, shm_name, protocol_version);
+
+  char reply[2] = {0, 1};
+  if (write_all(req_pipe_fd, request, request_len) == -1 ||
+      read_reply(reply, sizeof(reply)) != 1) {
+    fprintf(stderr, "Failed to communicate with server\n");
+    reply[1] = 1;
+  }
+
+  // Both sides have it mapped by now, the name is no longer needed
+  shm_unlink(shm_name);
+  if (reply[0] != OP_NOTIF_SHM || reply[1] != 0) {
+    notif_ring_detach(ring);
+    return 1;
+  }
+
+  notifications_ring = ring;
+  return 0;
+}
+
+static int read_ring(void* source, void* buf, size_t size) {
+  return notif_ring_read((notif_ring*)source, buf, size, notif_pipe_fd);
+}
+
+static int read_socket(void* source, void* buf, size_t size) {
+  return socket_read_notification(*(int*)source, buf, size);
+}
+
+int kvs_read_notification(int notif_fd, char* key, char* value) {
+  wire_reader reader = read_fifo;
+  void* source = &notif_fd;
+  if (notifications_ring != NULL) {
+    reader = read_ring;
+    source = notifications_ring;
+  } else if (use_socket) {
+    reader = read_socket;
+  }
+
+  change_seq_t seq = 0;
+  int ret = 1;
+  if (protocol_version >= PROTOCOL_V3) {
+    ret = reader(source, &seq, SEQUENCE_SIZE);
+  }
+  if (ret == 1) {
+    ret = wire_read_string(reader, source, key, protocol_version);
+  }
+  if (ret == 1) {
+    ret = wire_read_string(reader, source, value, protocol_version);
+  }
+  if (ret == 1 && seq > last_sequence) {
+    last_sequence = seq;
+  }
+  return ret;
+}
+
+change_seq_t kvs_last_sequence(void) {
+  return last_sequence;
+}
+
 void server_disconnected_gracefully() {
   safe_close(req_pipe_fd);
   fprintf(stderr, "Server disconnected\n");
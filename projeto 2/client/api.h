@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include "../common/constants.h"
+#include "../common/protocol.h"
 
 /// Connects to a kvs server.
 /// @param req_pipe_path Path to the name pipe to be created for requests.
@@ -11,13 +12,21 @@
 /// @return 0 if the connection was established successfully, 1 otherwise.
 int kvs_connect(char const* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path,
                 char const* notif_pipe_path, int* notif_pipe);
+/// Makes kvs_connect open a single socket to the server instead of the
+/// three pipes, see SOCKET_PATH_PREFIX. The pipe paths are then unused and
+/// the notifications descriptor is the socket, which replies also use, so
+/// notifications must be read with kvs_read_notification.
+/// @param enabled Whether to use the socket.
+void kvs_use_socket(int enabled);
+
 /// Disconnects from an KVS server.
 /// @return 0 in case of success, 1 otherwise.
 int kvs_disconnect(void);
 
-/// Requests a subscription for a key
+/// Requests a subscription for a key. A key ending in '*' subscribes to
+/// every key with that prefix, including keys written later.
 /// @param key Key to be subscribed
-/// @return 1 if the key was subscribed successfully (key existing), 0 otherwise.
+/// @return 1 if the key was subscribed successfully (key existing or pattern), 0 otherwise.
 
 int kvs_subscribe(const char* key);
 
@@ -27,6 +36,94 @@ int kvs_subscribe(const char* key);
 
 int kvs_unsubscribe(const char* key);
 
+/// Requests subscriptions for several keys in a single message.
+/// @param keys Keys to be subscribed
+/// @param n Number of keys, at most MAX_NUMBER_SUB
+/// @param results Set to the server result for each key
+/// @return 0 if the server answered for every key, 1 otherwise.
+int kvs_subscribe_batch(const char keys[][MAX_STRING_SIZE], size_t n, char* results);
+
+/// Removes subscriptions for several keys in a single message.
+/// @param keys Keys to be unsubscribed
+/// @param n Number of keys, at most MAX_NUMBER_SUB
+/// @param results Set to the server result for each key
+/// @return 0 if the server answered for every key, 1 otherwise.
+int kvs_unsubscribe_batch(const char keys[][MAX_STRING_SIZE], size_t n, char* results);
+
+/// Requests subscriptions for any number of keys in one round trip. The
+/// keys go out as tagged batches of MAX_NUMBER_SUB keys, all sent before
+/// any reply is read, and the replies are matched to them by request id.
+/// kvs_subscribe and kvs_subscribe_batch wait for the server on every call.
+/// @param keys Keys to be subscribed
+/// @param n Number of keys. A session holds at most MAX_NUMBER_SUB
+///          subscriptions, the keys past that fail.
+/// @param results Set to the server result for each key
+/// @return 0 if the server answered for every key, 1 otherwise.
+int kvs_subscribe_pipelined(const char keys[][MAX_STRING_SIZE], size_t n, char* results);
+
+/// Removes subscriptions for any number of keys in one round trip, as
+/// kvs_subscribe_pipelined.
+/// @param keys Keys to be unsubscribed
+/// @param n Number of keys
+/// @param results Set to the server result for each key
+/// @return 0 if the server answered for every key, 1 otherwise.
+int kvs_unsubscribe_pipelined(const char keys[][MAX_STRING_SIZE], size_t n, char* results);
+
+/// Reads keys from the server.
+/// @param keys Keys to read
+/// @param n Number of keys, at most MAX_NUMBER_SUB
+/// @param values Set to the value of each key that exists
+/// @param found Set to 1 for each key that exists, 0 otherwise
+/// @return 0 if the server answered for every key, 1 otherwise.
+int kvs_read(const char keys[][MAX_STRING_SIZE], size_t n, char values[][MAX_STRING_SIZE + 1],
+             char* found);
+
+/// Writes key value pairs, subscribers are notified as for a job WRITE.
+/// @param keys Keys to write
+/// @param values Value of each key
+/// @param n Number of pairs, at most MAX_NUMBER_SUB
+/// @param results Set to 0 for each pair written
+/// @return 0 if the server answered for every pair, 1 otherwise.
+int kvs_write(const char keys[][MAX_STRING_SIZE], const char values[][MAX_STRING_SIZE], size_t n,
+              char* results);
+
+/// Deletes keys from the server.
+/// @param keys Keys to delete
+/// @param n Number of keys, at most MAX_NUMBER_SUB
+/// @param results Set to 0 for each key deleted, 1 if it did not exist
+/// @return 0 if the server answered for every key, 1 otherwise.
+int kvs_delete(const char keys[][MAX_STRING_SIZE], size_t n, char* results);
+
+/// Subscribes to keys after a reconnect. The server first sends what the
+/// client missed since the last notification it saw: the changes to the
+/// keys made after that one if it still has them, otherwise the current
+/// value of each key.
+/// @param keys Keys or patterns to be subscribed
+/// @param n Number of keys, at most MAX_NUMBER_SUB
+/// @param since Sequence number from kvs_last_sequence in the last session
+/// @param results Set to the result of each subscription
+/// @return 0 if the server answered for every key, 1 otherwise.
+int kvs_resume(const char keys[][MAX_STRING_SIZE], size_t n, change_seq_t since, char* results);
+
+/// Asks the server to send the notifications through a shared memory ring
+/// instead of the notifications pipe. Must be called before subscribing.
+/// @param shm_name Name of the shared memory object to create.
+/// @return 0 if the ring is in use, 1 if the pipe is still used.
+int kvs_use_shared_notifications(char const* shm_name);
+
+/// Reads the next notification, decoding it with the protocol version
+/// chosen at connect.
+/// @param notif_fd File descriptor of the notifications pipe.
+/// @param key Set to the key that changed, MAX_STRING_SIZE + 1 bytes.
+/// @param value Set to its new value or "DELETED", MAX_STRING_SIZE + 1 bytes.
+/// @return 1 on success, as read_all otherwise.
+int kvs_read_notification(int notif_fd, char* key, char* value);
+
+/// Sequence number of the newest notification read, to be kept for
+/// kvs_resume. Always 0 with servers older than protocol version 3.
+/// @return The sequence number, 0 if none was read.
+change_seq_t kvs_last_sequence(void);
+
 /// Notifies the client that the server has disconnected.
 void server_disconnected_gracefully();
  
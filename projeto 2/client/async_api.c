@@ -0,0 +1,549 @@
+#include "async_api.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../common/io.h"
+#include "../common/protocol.h"
+#include "../common/wire.h"
+
+#define ASYNC_BUFFER_SIZE 8192
+#define SESSION_PATH_SIZE 256
+
+enum { SLOT_FREE, SLOT_SENT, SLOT_FAILED };
+
+typedef struct {
+  int state;
+  request_id_t id;
+  char op;
+  size_t count;
+  kvs_reply_cb cb;
+  void *arg;
+} pending_request;
+
+struct kvs_session {
+  int req_fd;
+  int resp_fd;
+  int notif_fd;
+  int epoll_fd;
+  int event_fd;  // signals completions generated by the client itself
+  int version;
+  int lost;  // the server closed the session
+  int want_write;  // req_fd is polled for space
+  char req_path[SESSION_PATH_SIZE];
+  char resp_path[SESSION_PATH_SIZE];
+  char notif_path[SESSION_PATH_SIZE];
+
+  char out_buf[ASYNC_BUFFER_SIZE];  // requests not written yet
+  size_t out_len;
+  char resp_buf[ASYNC_BUFFER_SIZE];  // reply bytes not decoded yet
+  size_t resp_len;
+  char notif_buf[ASYNC_BUFFER_SIZE];  // notification bytes not decoded yet
+  size_t notif_len;
+
+  pending_request pending[MAX_PENDING_REQUESTS];
+  request_id_t next_id;
+  change_seq_t last_sequence;  // of the last notification dispatched
+  kvs_notification_cb on_notification;
+  void *notification_arg;
+};
+
+static int make_non_blocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  return flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1;
+}
+
+static int watch(kvs_session *session, int op, int fd, uint32_t events) {
+  struct epoll_event event;
+  event.events = events;
+  event.data.fd = fd;
+  return epoll_ctl(session->epoll_fd, op, fd, &event) == -1;
+}
+
+// Creates a FIFO, replacing any left by an earlier client with the same id.
+// Unlike open_fifo, fails instead of exiting the host program.
+// @return 0 on success, 1 otherwise with errno set.
+static int make_fifo(const char *path) {
+  if (unlink(path) == -1 && errno != ENOENT) {
+    return 1;
+  }
+  return mkfifo(path, PIPE_PERMS) != 0;
+}
+
+// Reads the connect reply, the server closing the pipe meanwhile counts as
+// a reset connection.
+// @return 0 on success, 1 otherwise with errno set.
+static int read_connect_reply(kvs_session *session, char *buf, size_t len) {
+  int ret = read_all(session->resp_fd, buf, len, NULL);
+  if (ret == 0) {
+    errno = ECONNRESET;
+  }
+  return ret != 1;
+}
+
+// Connects with the same handshake as kvs_connect, on the caller's thread.
+// @return 0 on success, 1 otherwise with errno set.
+static int handshake(kvs_session *session, const char *server_name) {
+  char reg_pipe_path[PATH_MAX];
+  snprintf(reg_pipe_path, PATH_MAX, "/tmp/al97_reg_%s", server_name);
+
+  if (make_fifo(session->req_path) || make_fifo(session->resp_path) ||
+      make_fifo(session->notif_path)) {
+    return 1;
+  }
+
+  char message[CONNECT_FRAME_SIZE];
+  const char *const paths[] = {session->req_path, session->resp_path, session->notif_path};
+  size_t message_len = wire_put_connect(message, paths);
+
+  int server_fd = open(reg_pipe_path, O_WRONLY);
+  if (server_fd == -1) {
+    return 1;
+  }
+  int ret = write_all(server_fd, message, message_len);
+  close(server_fd);
+  if (ret == -1) {
+    return 1;
+  }
+
+  if ((session->req_fd = open(session->req_path, O_WRONLY)) == -1 ||
+      (session->resp_fd = open(session->resp_path, O_RDONLY)) == -1 ||
+      (session->notif_fd = open(session->notif_path, O_RDONLY)) == -1) {
+    return 1;
+  }
+
+  char reply[3];
+  if (read_connect_reply(session, reply, 2)) {
+    return 1;
+  }
+  session->version = PROTOCOL_V1;
+  if (reply[0] == OP_CONNECT_V2) {
+    if (read_connect_reply(session, reply + 2, 1)) {
+      return 1;
+    }
+    session->version = reply[2];
+  }
+  if (reply[1] != 0) {
+    errno = ECONNREFUSED;
+    return 1;
+  }
+  return 0;
+}
+
+static void remove_pipes(kvs_session *session) {
+  safe_unlink(session->req_path);
+  safe_unlink(session->resp_path);
+  safe_unlink(session->notif_path);
+}
+
+// Closes the descriptors a session opened, removes its pipes and frees it.
+static void release_session(kvs_session *session) {
+  int fds[] = {session->req_fd, session->resp_fd, session->notif_fd, session->epoll_fd,
+               session->event_fd};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (fds[i] != -1) {
+      safe_close(fds[i]);
+    }
+  }
+  remove_pipes(session);
+  free(session);
+}
+
+// Gives up opening a session, reporting why.
+// @return NULL, with errno as the failure left it.
+static kvs_session *fail_open(kvs_session *session, const char *what) {
+  int error = errno;
+  fprintf(stderr, "%s: %s\n", what, strerror(error));
+  release_session(session);
+  errno = error;
+  return NULL;
+}
+
+kvs_session *kvs_session_open(const char *client_id, const char *server_name,
+                              kvs_notification_cb on_notification, void *arg) {
+  kvs_session *session = malloc(sizeof(kvs_session));
+  if (session == NULL) {
+    return NULL;
+  }
+  memset(session, 0, sizeof(kvs_session));
+  session->req_fd = session->resp_fd = session->notif_fd = -1;
+  session->epoll_fd = session->event_fd = -1;
+  snprintf(session->req_path, SESSION_PATH_SIZE, "/tmp/al97_req_%s", client_id);
+  snprintf(session->resp_path, SESSION_PATH_SIZE, "/tmp/al97_resp_%s", client_id);
+  snprintf(session->notif_path, SESSION_PATH_SIZE, "/tmp/al97_notif_%s", client_id);
+  session->on_notification = on_notification;
+  session->notification_arg = arg;
+
+  if (handshake(session, server_name) != 0) {
+    return fail_open(session, "Failed to connect to the server");
+  }
+
+  session->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  session->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (session->epoll_fd == -1 || session->event_fd == -1 ||
+      make_non_blocking(session->req_fd) || make_non_blocking(session->resp_fd) ||
+      make_non_blocking(session->notif_fd) ||
+      watch(session, EPOLL_CTL_ADD, session->resp_fd, EPOLLIN) ||
+      watch(session, EPOLL_CTL_ADD, session->notif_fd, EPOLLIN) ||
+      watch(session, EPOLL_CTL_ADD, session->event_fd, EPOLLIN) ||
+      watch(session, EPOLL_CTL_ADD, session->req_fd, 0)) {
+    return fail_open(session, "Failed to set up the session");
+  }
+  return session;
+}
+
+int kvs_session_fd(kvs_session *session) {
+  return session->epoll_fd;
+}
+
+// Writes as much of the queued requests as the pipe takes, and polls the
+// pipe for space while some are left.
+static void flush_requests(kvs_session *session) {
+  size_t written = 0;
+  while (written < session->out_len) {
+    ssize_t res = write(session->req_fd, session->out_buf + written, session->out_len - written);
+    if (res == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        session->lost = 1;
+      }
+      break;
+    }
+    written += (size_t)res;
+  }
+  memmove(session->out_buf, session->out_buf + written, session->out_len - written);
+  session->out_len -= written;
+
+  int want_write = session->out_len > 0 && !session->lost;
+  if (want_write != session->want_write) {
+    watch(session, EPOLL_CTL_MOD, session->req_fd, want_write ? EPOLLOUT : 0);
+    session->want_write = want_write;
+  }
+}
+
+static void complete(kvs_session *session, pending_request *request, kvs_reply *reply) {
+  pending_request done = *request;
+  request->state = SLOT_FREE;
+  if (done.cb != NULL) {
+    done.cb(session, reply, done.arg);
+  }
+}
+
+// Fails every request in flight, the server will not answer them.
+static void fail_pending(kvs_session *session) {
+  for (int i = 0; i < MAX_PENDING_REQUESTS; i++) {
+    if (session->pending[i].state != SLOT_FREE) {
+      session->pending[i].state = SLOT_FAILED;
+    }
+  }
+  uint64_t one = 1;
+  if (write(session->event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+    perror("Failed to signal the session");
+  }
+}
+
+static int submit(kvs_session *session, char op, const char keys[][MAX_STRING_SIZE],
+                  const char values[][MAX_STRING_SIZE], size_t n, kvs_reply_cb cb, void *arg) {
+  if (n == 0 || n > MAX_NUMBER_SUB ||
+      ASYNC_BUFFER_SIZE - session->out_len < 1 + REQUEST_ID_SIZE + MAX_WRITE_FRAME_SIZE(n)) {
+    return 1;
+  }
+
+  request_id_t id = session->next_id;
+  pending_request *request = &session->pending[id % MAX_PENDING_REQUESTS];
+  if (request->state != SLOT_FREE) {
+    return 1;
+  }
+  session->next_id++;
+
+  request->state = SLOT_SENT;
+  request->id = id;
+  request->op = op;
+  request->count = n;
+  request->cb = cb;
+  request->arg = arg;
+
+  if (session->lost) {
+    fail_pending(session);
+    return 0;
+  }
+
+  // Every request is tagged, so replies can be matched whatever their order
+  char *frame = session->out_buf + session->out_len;
+  size_t len = 0;
+  frame[len++] = (char)(op | OP_FLAG_TAGGED);
+  memcpy(frame + len, &id, REQUEST_ID_SIZE);
+  len += REQUEST_ID_SIZE;
+  frame[len++] = (char)n;
+  for (size_t i = 0; i < n; i++) {
+    len += wire_put_string(frame + len, keys[i], session->version);
+    if (values != NULL) {
+      len += wire_put_string(frame + len, values[i], session->version);
+    }
+  }
+  session->out_len += len;
+
+  flush_requests(session);
+  return 0;
+}
+
+int kvs_async_subscribe(kvs_session *session, const char keys[][MAX_STRING_SIZE], size_t n,
+                        kvs_reply_cb cb, void *arg) {
+  return submit(session, OP_SUBSCRIBE_BATCH, keys, NULL, n, cb, arg);
+}
+
+int kvs_async_unsubscribe(kvs_session *session, const char keys[][MAX_STRING_SIZE], size_t n,
+                          kvs_reply_cb cb, void *arg) {
+  return submit(session, OP_UNSUBSCRIBE_BATCH, keys, NULL, n, cb, arg);
+}
+
+int kvs_async_read(kvs_session *session, const char keys[][MAX_STRING_SIZE], size_t n,
+                   kvs_reply_cb cb, void *arg) {
+  return submit(session, OP_READ, keys, NULL, n, cb, arg);
+}
+
+int kvs_async_write(kvs_session *session, const char keys[][MAX_STRING_SIZE],
+                    const char values[][MAX_STRING_SIZE], size_t n, kvs_reply_cb cb, void *arg) {
+  return submit(session, OP_WRITE, keys, values, n, cb, arg);
+}
+
+int kvs_async_delete(kvs_session *session, const char keys[][MAX_STRING_SIZE], size_t n,
+                     kvs_reply_cb cb, void *arg) {
+  return submit(session, OP_DELETE, keys, NULL, n, cb, arg);
+}
+
+// Size of the reply at the start of buf.
+// @return The size of the reply, 0 if more bytes are needed to know it.
+static size_t reply_size(const char *buf, size_t len, int version) {
+  if (len < 1) {
+    return 0;
+  }
+  if (buf[0] == OP_DISCONNECT) {
+    return 2;
+  }
+
+  size_t size = 1 + REQUEST_ID_SIZE + 1;
+  if (len < size) {
+    return 0;
+  }
+  size_t count = (unsigned char)buf[size - 1];
+  if (OP_CODE(buf[0]) != OP_READ) {
+    return size + count;
+  }
+
+  // Each READ result is followed by the value when the key exists
+  for (size_t i = 0; i < count; i++) {
+    if (len <= size) {
+      return 0;
+    }
+    if (buf[size++] == 0) {
+      size_t value_size = len > size ? wire_string_size(buf + size, len - size, version) : 0;
+      if (value_size == 0) {
+        return 0;
+      }
+      size += value_size;
+    }
+  }
+  return size;
+}
+
+static void handle_reply(kvs_session *session, const char *buf) {
+  request_id_t id;
+  memcpy(&id, buf + 1, REQUEST_ID_SIZE);
+  pending_request *request = &session->pending[id % MAX_PENDING_REQUESTS];
+  if (request->state != SLOT_SENT || request->id != id) {
+    fprintf(stderr, "Unexpected reply from server\n");
+    return;
+  }
+
+  kvs_reply reply;
+  reply.op = OP_CODE(buf[0]);
+  reply.count = (unsigned char)buf[1 + REQUEST_ID_SIZE];
+  if (reply.count > MAX_NUMBER_SUB) {
+    reply.count = 0;
+  }
+
+  const char *result = buf + 1 + REQUEST_ID_SIZE + 1;
+  for (size_t i = 0; i < reply.count; i++) {
+    reply.results[i] = *result++;
+    if (reply.op == OP_READ && reply.results[i] == 0) {
+      result += wire_get_string(result, reply.values[i], session->version);
+    }
+  }
+  complete(session, request, &reply);
+}
+
+// Reads what a non-blocking pipe has into a buffer.
+// @return 1 if the other end was closed, 0 otherwise.
+static int fill(int fd, char *buf, size_t *len) {
+  while (*len < ASYNC_BUFFER_SIZE) {
+    ssize_t res = read(fd, buf + *len, ASYNC_BUFFER_SIZE - *len);
+    if (res == 0) {
+      return 1;
+    }
+    if (res == -1) {
+      return errno != EAGAIN && errno != EINTR;
+    }
+    *len += (size_t)res;
+  }
+  return 0;
+}
+
+// Runs the callbacks of every complete reply buffered.
+// @return 1 if the disconnect reply was found, 0 otherwise.
+static int dispatch_replies(kvs_session *session) {
+  size_t offset = 0;
+  size_t size;
+  int disconnected = 0;
+
+  while (!disconnected &&
+         (size = reply_size(session->resp_buf + offset, session->resp_len - offset,
+                            session->version)) != 0 &&
+         size <= session->resp_len - offset) {
+    if (session->resp_buf[offset] == OP_DISCONNECT) {
+      disconnected = 1;
+    } else {
+      handle_reply(session, session->resp_buf + offset);
+    }
+    offset += size;
+  }
+
+  memmove(session->resp_buf, session->resp_buf + offset, session->resp_len - offset);
+  session->resp_len -= offset;
+  return disconnected;
+}
+
+static void dispatch_notifications(kvs_session *session) {
+  size_t offset = 0;
+
+  while (1) {
+    const char *buf = session->notif_buf + offset;
+    size_t len = session->notif_len - offset;
+    size_t seq_size = session->version >= PROTOCOL_V3 ? SEQUENCE_SIZE : 0;
+    if (len <= seq_size) {
+      break;
+    }
+    change_seq_t seq = 0;
+    memcpy(&seq, buf, seq_size);
+    buf += seq_size;
+    len -= seq_size;
+
+    size_t key_size = wire_string_size(buf, len, session->version);
+    if (key_size == 0 || key_size >= len) {
+      break;
+    }
+    size_t value_size = wire_string_size(buf + key_size, len - key_size, session->version);
+    if (value_size == 0 || key_size + value_size > len) {
+      break;
+    }
+
+    char key[MAX_STRING_SIZE + 1], value[MAX_STRING_SIZE + 1];
+    wire_get_string(buf, key, session->version);
+    wire_get_string(buf + key_size, value, session->version);
+    offset += seq_size + key_size + value_size;
+    if (seq > session->last_sequence) {
+      session->last_sequence = seq;
+    }
+    if (session->on_notification != NULL) {
+      session->on_notification(session, key, value, session->notification_arg);
+    }
+  }
+
+  memmove(session->notif_buf, session->notif_buf + offset, session->notif_len - offset);
+  session->notif_len -= offset;
+}
+
+// Runs the callbacks of the requests failed locally.
+static void dispatch_failed(kvs_session *session) {
+  uint64_t count;
+  if (read(session->event_fd, &count, sizeof(count)) != sizeof(count)) {
+    return;
+  }
+
+  for (int i = 0; i < MAX_PENDING_REQUESTS; i++) {
+    if (session->pending[i].state == SLOT_FAILED) {
+      kvs_reply reply;
+      reply.op = session->pending[i].op;
+      reply.count = 0;
+      complete(session, &session->pending[i], &reply);
+    }
+  }
+}
+
+int kvs_session_process(kvs_session *session) {
+  dispatch_failed(session);
+  if (session->lost) {
+    return 1;
+  }
+
+  flush_requests(session);
+
+  int closed = fill(session->resp_fd, session->resp_buf, &session->resp_len);
+  dispatch_replies(session);
+  closed |= fill(session->notif_fd, session->notif_buf, &session->notif_len);
+  dispatch_notifications(session);
+
+  if (closed || session->lost) {
+    session->lost = 1;
+    watch(session, EPOLL_CTL_DEL, session->resp_fd, 0);
+    watch(session, EPOLL_CTL_DEL, session->notif_fd, 0);
+    fail_pending(session);
+    return 1;
+  }
+  return 0;
+}
+
+int kvs_session_close(kvs_session *session) {
+  int ret = 1;
+
+  if (!session->lost) {
+    // The disconnect goes after the queued requests, and their replies
+    // arrive before its own
+    char code = OP_DISCONNECT;
+    int flags = fcntl(session->req_fd, F_GETFL);
+    fcntl(session->req_fd, F_SETFL, flags & ~O_NONBLOCK);
+    flags = fcntl(session->resp_fd, F_GETFL);
+    fcntl(session->resp_fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    if (write_all(session->req_fd, session->out_buf, session->out_len) != -1 &&
+        write_all(session->req_fd, &code, sizeof(code)) != -1) {
+      session->out_len = 0;
+      while (1) {
+        if (dispatch_replies(session)) {
+          ret = 0;
+          break;
+        }
+        ssize_t res = read(session->resp_fd, session->resp_buf + session->resp_len,
+                           ASYNC_BUFFER_SIZE - session->resp_len);
+        if (res == -1 && errno == EINTR) {
+          continue;
+        }
+        if (res <= 0) {
+          break;
+        }
+        session->resp_len += (size_t)res;
+      }
+    }
+  }
+
+  fail_pending(session);
+  dispatch_failed(session);
+
+  release_session(session);
+  return ret;
+}
+
+change_seq_t kvs_session_last_sequence(kvs_session *session) {
+  return session->last_sequence;
+}
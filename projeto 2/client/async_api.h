@@ -0,0 +1,92 @@
+#ifndef CLIENT_ASYNC_API_H
+#define CLIENT_ASYNC_API_H
+
+#include <stddef.h>
+
+#include "../common/constants.h"
+#include "../common/protocol.h"
+
+#define MAX_PENDING_REQUESTS 64  // requests in flight per session
+
+/// A connection to a KVS server used without blocking. Unlike api.h it
+/// keeps no global state, so a process can hold several sessions.
+typedef struct kvs_session kvs_session;
+
+/// Reply to a request.
+typedef struct {
+  char op;       // OP_SUBSCRIBE_BATCH, OP_UNSUBSCRIBE_BATCH, OP_READ, OP_WRITE or OP_DELETE
+  size_t count;  // number of results, 0 if the request failed
+  char results[MAX_NUMBER_SUB];  // server result for each key, for a READ 0
+                                 // if the key exists and 1 otherwise
+  char values[MAX_NUMBER_SUB][MAX_STRING_SIZE + 1];  // READ values of the keys found
+} kvs_reply;
+
+/// Called when the reply to a request arrives.
+typedef void (*kvs_reply_cb)(kvs_session *session, const kvs_reply *reply, void *arg);
+
+/// Called for each notification of a subscribed key.
+typedef void (*kvs_notification_cb)(kvs_session *session, const char *key, const char *value,
+                                    void *arg);
+
+/// Connects to a KVS server. Only the connection handshake blocks.
+/// @param client_id Unique id of the client, used to name its pipes.
+/// @param server_name Name of the server, as given to the server on start.
+/// @param on_notification Called for each notification.
+/// @param arg Passed to on_notification.
+/// @return The session, NULL with errno set if it could not be opened,
+///         ECONNREFUSED if the server refused it.
+kvs_session *kvs_session_open(const char *client_id, const char *server_name,
+                              kvs_notification_cb on_notification, void *arg);
+
+/// File descriptor that becomes readable whenever the session has work:
+/// replies, notifications, requests waiting to be written or local
+/// completions. It can be added to the caller's poll, select or epoll.
+/// @param session Session.
+/// @return The file descriptor.
+int kvs_session_fd(kvs_session *session);
+
+/// Does all the work available without blocking: writes queued requests,
+/// and runs the callbacks of the replies and notifications received.
+/// @param session Session.
+/// @return 0 on success, 1 once the server closed the session.
+int kvs_session_process(kvs_session *session);
+
+/// Sequence number of the newest notification dispatched, the one to pass
+/// to kvs_resume (see api.h) when reconnecting.
+/// @param session Session.
+/// @return The sequence number, 0 if none was dispatched.
+change_seq_t kvs_session_last_sequence(kvs_session *session);
+
+/// Disconnects and frees the session. Blocks until the server confirms,
+/// running the callbacks of the replies still in flight.
+/// @param session Session.
+/// @return 0 if the server confirmed the disconnect, 1 otherwise.
+int kvs_session_close(kvs_session *session);
+
+/// Submits requests without blocking. The callback is always run from
+/// kvs_session_process, never from the submit function. A request submitted
+/// after the server closed the session completes with a count of 0.
+/// @param session Session.
+/// @param keys Keys of the request.
+/// @param values Values for a write, one for each key.
+/// @param n Number of keys, from 1 to MAX_NUMBER_SUB.
+/// @param cb Called with the reply, may be NULL.
+/// @param arg Passed to cb.
+/// @return 0 if the request was queued, 1 if n is invalid or too many
+///         requests are in flight.
+int kvs_async_subscribe(kvs_session *session, const char keys[][MAX_STRING_SIZE], size_t n,
+                        kvs_reply_cb cb, void *arg);
+
+int kvs_async_unsubscribe(kvs_session *session, const char keys[][MAX_STRING_SIZE], size_t n,
+                          kvs_reply_cb cb, void *arg);
+
+int kvs_async_read(kvs_session *session, const char keys[][MAX_STRING_SIZE], size_t n,
+                   kvs_reply_cb cb, void *arg);
+
+int kvs_async_write(kvs_session *session, const char keys[][MAX_STRING_SIZE],
+                    const char values[][MAX_STRING_SIZE], size_t n, kvs_reply_cb cb, void *arg);
+
+int kvs_async_delete(kvs_session *session, const char keys[][MAX_STRING_SIZE], size_t n,
+                     kvs_reply_cb cb, void *arg);
+
+#endif  // CLIENT_ASYNC_API_H
@@ -21,17 +21,7 @@ void *notifications_thread(void *arg) {
   while (!disconnect_flag && !server_disconnected) {
     char pair[MAX_STRING_SIZE + 1][MAX_STRING_SIZE + 1] = {{'\0'}};
 
-    if (read_all(*notif_fd, pair[0], MAX_STRING_SIZE + 1, NULL) <= 0 && !disconnect_flag) {
-        server_disconnected = 1;
-        free(notif_fd);
-        server_disconnected_gracefully();
-        fprintf(stderr, "Disconnected forcefully from server\n");
-        // client is disconnected forcefully because the server disconnected
-        exit(1);
-        break;
-    }
-
-    if (read_all(*notif_fd, pair[1], MAX_STRING_SIZE + 1, NULL) <= 0 && !disconnect_flag) {
+    if (kvs_read_notification(*notif_fd, pair[0], pair[1]) <= 0 && !disconnect_flag) {
         server_disconnected = 1;
         free(notif_fd);
         server_disconnected_gracefully();
@@ -47,22 +37,79 @@ void *notifications_thread(void *arg) {
   return NULL;
 }
 
+// Reads the sequence number saved by the last run, 0 if there is none.
+static change_seq_t load_sequence(const char *path) {
+  unsigned long long seq = 0;
+  FILE *file = fopen(path, "r");
+  if (file != NULL) {
+    if (fscanf(file, "%llu", &seq) != 1) {
+      seq = 0;
+    }
+    fclose(file);
+  }
+  return (change_seq_t)seq;
+}
+
+static void save_sequence(const char *path, change_seq_t seq) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Failed to save the sequence number to %s\n", path);
+    return;
+  }
+  fprintf(file, "%llu\n", (unsigned long long)seq);
+  fclose(file);
+}
+
 int main(int argc, char* argv[]) {
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s <client_unique_id> <register_pipe_path>\n", argv[0]);
+  int shared_notifications = 0;
+  const char *sequence_file = NULL;
+  int opt;
+
+  // Options come before the positional arguments
+  while ((opt = getopt(argc, argv, "mr:u")) != -1) {
+    switch (opt) {
+      case 'm':
+        shared_notifications = 1;
+        break;
+      case 'u':
+        kvs_use_socket(1);
+        break;
+      case 'r':
+        sequence_file = optarg;
+        break;
+      default:
+        argc = 0;
+        break;
+    }
+  }
+
+  if (argc - optind < 2) {
+    fprintf(stderr,
+            "Usage: %s [-m] [-u] [-r sequence_file] <client_unique_id> <register_pipe_path>\n",
+            argv[0]);
+    fprintf(stderr, "  -m  receive notifications through shared memory\n");
+    fprintf(stderr, "  -u  connect through the server's Unix domain socket instead of pipes\n");
+    fprintf(stderr, "  -r  resume subscriptions from the sequence number kept in the file\n");
     return 1;
   }
+  argv += optind - 1;
 
   char req_pipe_path[256] = "/tmp/al97_req_";
   char resp_pipe_path[256] = "/tmp/al97_resp_";
   char notif_pipe_path[256] = "/tmp/al97_notif_";
+  char shm_name[256] = "/al97_shm_";
 
   char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE] = {0};
+  char values[MAX_NUMBER_SUB][MAX_STRING_SIZE] = {0};
+  char read_values[MAX_NUMBER_SUB][MAX_STRING_SIZE + 1];
+  char results[MAX_NUMBER_SUB];
   unsigned int delay_ms;
   size_t num;
+  change_seq_t since = sequence_file != NULL ? load_sequence(sequence_file) : 0;
   strncat(req_pipe_path, argv[1], strlen(argv[1]) * sizeof(char));
   strncat(resp_pipe_path, argv[1], strlen(argv[1]) * sizeof(char));
   strncat(notif_pipe_path, argv[1], strlen(argv[1]) * sizeof(char));
+  strncat(shm_name, argv[1], strlen(argv[1]) * sizeof(char));
 
   printf("Waiting for server access...\n");
 
@@ -74,6 +121,10 @@ int main(int argc, char* argv[]) {
   }
   fprintf(stdout, "Connected to server\n");
 
+  if (shared_notifications && kvs_use_shared_notifications(shm_name) != 0) {
+    fprintf(stderr, "Falling back to the notifications pipe\n");
+  }
+
   pthread_t notif_thread;
   if (pthread_create(&notif_thread, NULL, notifications_thread, notif_fd) != 0) {
     fprintf(stderr, "Failed to create notifications thread\n");
@@ -100,35 +151,92 @@ int main(int argc, char* argv[]) {
         safe_unlink(notif_pipe_path);
         free(notif_fd);
 
+        if (sequence_file != NULL) {
+          save_sequence(sequence_file, kvs_last_sequence() > since ? kvs_last_sequence() : since);
+        }
+
         //releases the semaphore and closes it
         return 0;
 
       case CMD_SUBSCRIBE:
-        num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+        num = parse_list(STDIN_FILENO, keys, MAX_NUMBER_SUB, MAX_STRING_SIZE);
         if (num == 0) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
           continue;
         }
          
-        if (kvs_subscribe(keys[0])) {
+        if (sequence_file != NULL) {
+          // Catches up on what changed since the last run
+          if (kvs_resume((const char (*)[MAX_STRING_SIZE])keys, num, since, results)) {
+            fprintf(stderr, "Command subscribe failed\n");
+          }
+        } else if (kvs_subscribe_pipelined((const char (*)[MAX_STRING_SIZE])keys, num, results)) {
             fprintf(stderr, "Command subscribe failed\n");
         }
 
         break;
 
       case CMD_UNSUBSCRIBE:
-        num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+        num = parse_list(STDIN_FILENO, keys, MAX_NUMBER_SUB, MAX_STRING_SIZE);
         if (num == 0) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
           continue;
         }
          
-        if (kvs_unsubscribe(keys[0])) {
+        if (kvs_unsubscribe_pipelined((const char (*)[MAX_STRING_SIZE])keys, num, results)) {
             fprintf(stderr, "Command subscribe failed\n");
         }
 
         break;
 
+      case CMD_READ:
+        num = parse_list(STDIN_FILENO, keys, MAX_NUMBER_SUB, MAX_STRING_SIZE);
+        if (num == 0) {
+          fprintf(stderr, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if (kvs_read((const char (*)[MAX_STRING_SIZE])keys, num, read_values, results)) {
+          fprintf(stderr, "Command read failed\n");
+          break;
+        }
+        // Same output as a READ in a job
+        printf("[");
+        for (size_t i = 0; i < num; i++) {
+          printf("(%s,%s)", keys[i], results[i] ? read_values[i] : "KVSERROR");
+        }
+        printf("]\n");
+        break;
+
+      case CMD_WRITE:
+        num = parse_write(STDIN_FILENO, keys, values, MAX_NUMBER_SUB, MAX_STRING_SIZE);
+        if (num == 0) {
+          fprintf(stderr, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if (kvs_write((const char (*)[MAX_STRING_SIZE])keys,
+                      (const char (*)[MAX_STRING_SIZE])values, num, results) == 0) {
+          for (size_t i = 0; i < num; i++) {
+            printf("Server returned %d for operation: write\n", results[i]);
+          }
+        }
+        break;
+
+      case CMD_DELETE:
+        num = parse_list(STDIN_FILENO, keys, MAX_NUMBER_SUB, MAX_STRING_SIZE);
+        if (num == 0) {
+          fprintf(stderr, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        if (kvs_delete((const char (*)[MAX_STRING_SIZE])keys, num, results) == 0) {
+          for (size_t i = 0; i < num; i++) {
+            printf("Server returned %d for operation: delete\n", results[i]);
+          }
+        }
+        break;
+
       case CMD_DELAY:
         if (parse_delay(STDIN_FILENO, &delay_ms) == -1) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
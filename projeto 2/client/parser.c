@@ -116,8 +116,31 @@ enum Command get_next(int fd) {
 
       return CMD_UNSUBSCRIBE;
 
+    case 'R':
+      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_READ;
+
+    case 'W':
+      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "WRITE ", 6) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_WRITE;
+
     case 'D':
       if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "DELAY ", 6) != 0) {
+        if (strncmp(buf, "DELETE", 6) == 0) {
+          if (read(fd, buf + 6, 1) != 1 || buf[6] != ' ') {
+            cleanup(fd);
+            return CMD_INVALID;
+          }
+          return CMD_DELETE;
+        }
         if (read(fd, buf + 6, 4) != 4 || strncmp(buf, "DISCONNECT", 10) != 0) {
           cleanup(fd);
           return CMD_INVALID;
@@ -182,6 +205,56 @@ size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t
   return num_keys;
 }
 
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+                   size_t max_pairs, size_t max_string_size) {
+  char ch;
+
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read(fd, &ch, 1) != 1 || ch != '(') {
+    cleanup(fd);
+    return 0;
+  }
+
+  size_t num_pairs = 0;
+  char key[max_string_size];
+  char value[max_string_size];
+  while (num_pairs < max_pairs) {
+    if (read_string(fd, key, max_string_size - 1) != 0 ||
+        read_string(fd, value, max_string_size - 1) != 1) {
+      cleanup(fd);
+      return 0;
+    }
+
+    strcpy(keys[num_pairs], key);
+    strcpy(values[num_pairs++], value);
+
+    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (ch == ']') {
+      break;
+    }
+  }
+
+  if (num_pairs == max_pairs && ch != ']') {
+    cleanup(fd);
+    return 0;
+  }
+
+  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 0;
+  }
+
+  return num_pairs;
+}
+
 int parse_delay(int fd, unsigned int *delay) {
   char ch;
 
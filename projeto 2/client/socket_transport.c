@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include "socket_transport.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../common/constants.h"
+#include "../common/io.h"
+#include "../common/wire.h"
+
+// Bytes received for one of the readers and not yet read
+typedef struct {
+  char *data;
+  size_t len;
+  size_t capacity;
+} byte_queue;
+
+static pthread_mutex_t receive_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t received = PTHREAD_COND_INITIALIZER;
+static int receiving = 0;  // a thread is waiting for records
+static int socket_closed = 0;  // 1 at end of file, -1 on error
+static byte_queue replies = {NULL, 0, 0};
+static byte_queue notifications = {NULL, 0, 0};
+
+int socket_connect(const char *server_name) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s%s", SOCKET_PATH_PREFIX, server_name);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("socket");
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "Failed to connect to %s: %s\n", addr.sun_path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  // The session is the connection itself, it needs no pipes
+  char message[CONNECT_FRAME_SIZE];
+  char const *const paths[] = {"", "", ""};
+  size_t message_len = wire_put_connect(message, paths);
+  if (write_all(fd, message, message_len) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  socket_closed = 0;
+  replies.len = 0;
+  notifications.len = 0;
+  return fd;
+}
+
+// Appends bytes to a queue, growing it as needed.
+static int queue_append(byte_queue *queue, const char *data, size_t len) {
+  if (queue->len + len > queue->capacity) {
+    size_t capacity = queue->capacity == 0 ? MAX_SOCKET_RECORD_SIZE : queue->capacity;
+    while (capacity < queue->len + len) {
+      capacity *= 2;
+    }
+    char *grown = realloc(queue->data, capacity);
+    if (grown == NULL) {
+      return 1;
+    }
+    queue->data = grown;
+    queue->capacity = capacity;
+  }
+  memcpy(queue->data + queue->len, data, len);
+  queue->len += len;
+  return 0;
+}
+
+static void unlock_receive(void *arg) {
+  (void)arg;
+  pthread_mutex_unlock(&receive_lock);
+}
+
+// Receives up to SOCKET_BATCH records and sorts them by reader. Called
+// with receive_lock held, which is released while waiting.
+static void receive_records(int fd) {
+  static char records[SOCKET_BATCH][MAX_SOCKET_RECORD_SIZE];
+  struct mmsghdr messages[SOCKET_BATCH];
+  struct iovec iov[SOCKET_BATCH];
+  int n, error, state;
+
+  memset(messages, 0, sizeof(messages));
+  for (int i = 0; i < SOCKET_BATCH; i++) {
+    iov[i].iov_base = records[i];
+    iov[i].iov_len = MAX_SOCKET_RECORD_SIZE;
+    messages[i].msg_hdr.msg_iov = &iov[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  // The notifications thread is cancelled on disconnect, which must not
+  // happen once records are received: they may hold the disconnect reply
+  receiving = 1;
+  pthread_mutex_unlock(&receive_lock);
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+  n = recvmmsg(fd, messages, SOCKET_BATCH, MSG_WAITFORONE, NULL);
+  error = errno;
+  pthread_mutex_lock(&receive_lock);
+  receiving = 0;
+
+  if (n == -1 && error != EINTR) {
+    socket_closed = -1;
+  }
+  for (int i = 0; i < n && !socket_closed; i++) {
+    const char *record = records[i];
+    size_t len = messages[i].msg_len;
+    if (len == 0) {
+      socket_closed = 1;
+    } else if (messages[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      socket_closed = -1;
+    } else if (record[0] == OP_NOTIFICATION) {
+      socket_closed = -queue_append(&notifications, record + 1, len - 1);
+    } else {
+      socket_closed = -queue_append(&replies, record, len);
+    }
+  }
+  pthread_cond_broadcast(&received);
+  pthread_setcancelstate(state, NULL);
+  pthread_testcancel();
+}
+
+// Reads bytes from a queue, receiving records until it has enough.
+static int read_queue(int fd, byte_queue *queue, void *buf, size_t size) {
+  int ret = 1;
+
+  pthread_mutex_lock(&receive_lock);
+  pthread_cleanup_push(unlock_receive, NULL);
+  while (queue->len < size && !socket_closed) {
+    if (receiving) {
+      pthread_cond_wait(&received, &receive_lock);
+    } else {
+      receive_records(fd);
+    }
+  }
+
+  if (queue->len >= size) {
+    memcpy(buf, queue->data, size);
+    queue->len -= size;
+    memmove(queue->data, queue->data + size, queue->len);
+  } else {
+    ret = socket_closed < 0 ? -1 : 0;
+  }
+  pthread_cleanup_pop(0);
+  pthread_mutex_unlock(&receive_lock);
+  return ret;
+}
+
+int socket_read_reply(int fd, void *buf, size_t size) {
+  return read_queue(fd, &replies, buf, size);
+}
+
+int socket_read_notification(int fd, void *buf, size_t size) {
+  return read_queue(fd, &notifications, buf, size);
+}
@@ -0,0 +1,31 @@
+#ifndef CLIENT_SOCKET_TRANSPORT_H
+#define CLIENT_SOCKET_TRANSPORT_H
+
+#include <stddef.h>
+
+#include "../common/protocol.h"
+
+/// Connects to the socket of a server and sends the connect request, see
+/// SOCKET_PATH_PREFIX. The reply is read with socket_read_reply.
+/// @param server_name Name of the server, as for the register pipe.
+/// @return The socket, -1 on failure.
+int socket_connect(const char *server_name);
+
+/// Reads the next bytes of the replies sent through the socket. Replies
+/// and notifications share the socket, so whichever thread is waiting
+/// receives the records of both and hands the other kind to its reader.
+/// @param fd Socket of the session.
+/// @param buf Buffer to read into.
+/// @param size Number of bytes to read.
+/// @return 1 on success, 0 once the server closed the socket, -1 on error.
+int socket_read_reply(int fd, void *buf, size_t size);
+
+/// Reads the next bytes of the notifications sent through the socket, as
+/// socket_read_reply does for replies.
+/// @param fd Socket of the session.
+/// @param buf Buffer to read into.
+/// @param size Number of bytes to read.
+/// @return 1 on success, 0 once the server closed the socket, -1 on error.
+int socket_read_notification(int fd, void *buf, size_t size);
+
+#endif  // CLIENT_SOCKET_TRANSPORT_H
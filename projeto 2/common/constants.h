@@ -1,8 +1,11 @@
 // constantes partilhadas entre cliente e servidor
+#ifndef MAX_SESSION_COUNT
 #define MAX_SESSION_COUNT 2  // num max de sessoes no server
+#endif
 #define STATE_ACCESS_DELAY_US  // delay a aplicar no server
 
 #define MAX_PIPE_PATH_LENGTH 40 // tamanho max do caminho do pipe
+#define CONNECT_FRAME_SIZE (1 + 3 * MAX_PIPE_PATH_LENGTH) // opcode + 3 pipes
 #define PIPE_PERMS 0640 
 
 #define MAX_STRING_SIZE 40
@@ -11,4 +14,13 @@
 #define OP_CONNECT 1
 #define OP_DISCONNECT 2
 #define OP_SUBSCRIBE 3
-#define OP_UNSUBSCRIBE 4
\ No newline at end of file
+#define OP_UNSUBSCRIBE 4
+#define OP_SUBSCRIBE_BATCH 5
+#define OP_UNSUBSCRIBE_BATCH 6
+#define OP_CONNECT_V2 7
+#define OP_NOTIF_SHM 8
+#define OP_READ 9
+#define OP_WRITE 10
+#define OP_DELETE 11
+#define OP_RESUME 12
+#define OP_NOTIFICATION 13
\ No newline at end of file
@@ -0,0 +1,178 @@
+#define _GNU_SOURCE
+#include "notif_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+
+#define NOTIF_RING_MAP_SIZE (sizeof(notif_ring) + NOTIF_RING_SIZE)
+#define PEER_CHECK_INTERVAL_MS 100
+#define SPIN_ITERATIONS 2000  // polls of the other side before sleeping
+
+// Spinning only pays off when the other side runs on another CPU
+static int spin_iterations = SPIN_ITERATIONS;
+
+// The futexes live in memory shared between processes, so the private
+// futex operations cannot be used.
+// @return 1 if the wait timed out, 0 otherwise.
+static int futex_wait(_Atomic uint32_t *word, uint32_t expected) {
+  struct timespec timeout = {0, PEER_CHECK_INTERVAL_MS * 1000000L};
+  return syscall(SYS_futex, word, FUTEX_WAIT, expected, &timeout, NULL, 0) == -1 &&
+         errno == ETIMEDOUT;
+}
+
+// Busy waits a little for the other side to move word away from value,
+// a sleep and a wake cost far more than a short spin at high rates.
+static void spin_while_equal(_Atomic uint32_t *word, uint32_t value) {
+  for (int i = 0; i < spin_iterations; i++) {
+    if (atomic_load_explicit(word, memory_order_relaxed) != value) {
+      return;
+    }
+  }
+}
+
+static void futex_wake(_Atomic uint32_t *word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Checks whether the other end of the notifications FIFO was closed.
+static int peer_gone(int peer_fd) {
+  struct pollfd pfd = {.fd = peer_fd, .events = 0, .revents = 0};
+  return poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLERR | POLLHUP));
+}
+
+static notif_ring *map_ring(int fd) {
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) < 2) {
+    spin_iterations = 0;
+  }
+
+  void *addr = mmap(NULL, NOTIF_RING_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return addr == MAP_FAILED ? NULL : (notif_ring *)addr;
+}
+
+notif_ring *notif_ring_create(const char *name) {
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, PIPE_PERMS);
+  if (fd == -1) {
+    return NULL;
+  }
+  if (ftruncate(fd, (off_t)NOTIF_RING_MAP_SIZE) == -1) {
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+
+  // A new object is zero filled, head, tail and the flags start at 0
+  notif_ring *ring = map_ring(fd);
+  if (ring == NULL) {
+    shm_unlink(name);
+    return NULL;
+  }
+  ring->size = NOTIF_RING_SIZE;
+  return ring;
+}
+
+notif_ring *notif_ring_attach(const char *name) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size != NOTIF_RING_MAP_SIZE) {
+    close(fd);
+    return NULL;
+  }
+  notif_ring *ring = map_ring(fd);
+  if (ring != NULL && ring->size != NOTIF_RING_SIZE) {
+    notif_ring_detach(ring);
+    return NULL;
+  }
+  return ring;
+}
+
+void notif_ring_detach(notif_ring *ring) {
+  munmap(ring, NOTIF_RING_MAP_SIZE);
+}
+
+void notif_ring_close(notif_ring *ring) {
+  // A reader that misses the wake sees the flag on its next timeout
+  atomic_store(&ring->closed, 1);
+  futex_wake(&ring->head);
+}
+
+// Copies a message at head, which must have room for it, and publishes it.
+static void ring_put(notif_ring *ring, uint32_t head, const void *buf, size_t len) {
+  size_t offset = head & (ring->size - 1);
+  size_t first = len < ring->size - offset ? len : ring->size - offset;
+  memcpy(ring->data + offset, buf, first);
+  memcpy(ring->data, (const char *)buf + first, len - first);
+  atomic_store(&ring->head, head + (uint32_t)len);
+
+  if (atomic_load(&ring->reader_idle)) {
+    futex_wake(&ring->head);
+  }
+}
+
+int notif_ring_try_write(notif_ring *ring, const void *buf, size_t len) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (ring->size - (head - tail) < len) {
+    return 0;
+  }
+  ring_put(ring, head, buf, len);
+  return 1;
+}
+
+int notif_ring_read(notif_ring *ring, void *buf, size_t len, int peer_fd) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+  while (1) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head - tail >= len) {
+      break;
+    }
+    if (atomic_load(&ring->closed)) {
+      return -2;
+    }
+
+    spin_while_equal(&ring->head, head);
+    if (atomic_load(&ring->head) - tail >= len) {
+      continue;
+    }
+
+    // Empty: sleep until the writer publishes more, unless it did meanwhile
+    int timed_out = 0;
+    atomic_store(&ring->reader_idle, 1);
+    head = atomic_load(&ring->head);
+    if (head - tail < len && !atomic_load(&ring->closed)) {
+      timed_out = futex_wait(&ring->head, head);
+    }
+    atomic_store(&ring->reader_idle, 0);
+
+    pthread_testcancel();
+    if (timed_out && peer_gone(peer_fd)) {
+      return -2;
+    }
+  }
+
+  size_t offset = tail & (ring->size - 1);
+  size_t first = len < ring->size - offset ? len : ring->size - offset;
+  memcpy(buf, ring->data + offset, first);
+  memcpy((char *)buf + first, ring->data, len - first);
+  atomic_store(&ring->tail, tail + (uint32_t)len);
+  return 1;
+}
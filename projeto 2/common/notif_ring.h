@@ -0,0 +1,71 @@
+#ifndef COMMON_NOTIF_RING_H
+#define COMMON_NOTIF_RING_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NOTIF_RING_SIZE (1 << 20)  // bytes of notifications a ring can hold
+#define NOTIF_RING_NAME_SIZE 32
+#define CACHE_LINE_SIZE 64
+
+// Single producer, single consumer byte ring in POSIX shared memory, used
+// instead of the notifications FIFO. Notifications are written with the
+// same encoding used on the FIFO, so the ring behaves like a pipe without
+// the read and write syscalls.
+//
+// The server is the only producer, and never waits for room: writers hold
+// the table write lock when they notify, so they only queue the
+// notification, and the notifier thread moves it to the ring with
+// notif_ring_try_write once there is room (see notif_queue.h).
+//
+// head and tail count bytes and wrap around freely. A reader that finds the
+// ring empty raises its idle flag and sleeps on a futex; the writer only
+// makes the wake syscall when that flag is set.
+typedef struct {
+  alignas(CACHE_LINE_SIZE) _Atomic uint32_t head;  // advanced by the writer
+  _Atomic uint32_t reader_idle;
+  alignas(CACHE_LINE_SIZE) _Atomic uint32_t tail;  // advanced by the reader
+  alignas(CACHE_LINE_SIZE) _Atomic uint32_t closed;
+  uint32_t size;
+  alignas(CACHE_LINE_SIZE) char data[];
+} notif_ring;
+
+/// Creates and maps a new shared memory ring.
+/// @param name Shared memory object name, e.g. "/al97_shm_id".
+/// @return The ring, NULL on failure.
+notif_ring *notif_ring_create(const char *name);
+
+/// Maps a ring created by the other side.
+/// @param name Shared memory object name.
+/// @return The ring, NULL on failure.
+notif_ring *notif_ring_attach(const char *name);
+
+/// Unmaps a ring.
+/// @param ring Ring to unmap.
+void notif_ring_detach(notif_ring *ring);
+
+/// Marks the ring as closed and wakes the reader, which reads the remaining
+/// bytes and then sees the end of the stream.
+/// @param ring Ring to close.
+void notif_ring_close(notif_ring *ring);
+
+/// Writes a whole message only if the ring has room for it, never waits.
+/// @param ring Ring to write to.
+/// @param buf Bytes to write.
+/// @param len Number of bytes, at most NOTIF_RING_SIZE.
+/// @return 1 if the message was written, 0 if the ring is too full.
+int notif_ring_try_write(notif_ring *ring, const void *buf, size_t len);
+
+/// Reads exactly len bytes, waiting for the writer if needed. Waiting is a
+/// cancellation point, as reading from the FIFO is.
+/// @param ring Ring to read from.
+/// @param buf Where to store the bytes.
+/// @param len Number of bytes to read.
+/// @param peer_fd Notifications FIFO of the session, it tells whether the
+///        server is still alive while waiting.
+/// @return 1 on success, -2 once the ring is closed and empty, as read_all.
+int notif_ring_read(notif_ring *ring, void *buf, size_t len, int peer_fd);
+
+#endif  // COMMON_NOTIF_RING_H
@@ -1,6 +1,10 @@
 #ifndef COMMON_PROTOCOL_H
 #define COMMON_PROTOCOL_H
 
+#include <stdint.h>
+
+#include "constants.h"
+
 // Opcodes for client-server communication
 // estes opcodes sao usados num switch case para determinar o que fazer com a mensagem recebida no server
 // usam estes opcodes tambem nos clientes quando enviam mensagens para o server
@@ -9,6 +13,83 @@ enum {
   // TODO mais opcodes para cada operacao
 };
 
+// Protocol versions. Clients that send OP_CONNECT speak version 1, where
+// every key, value and pipe path is padded to a fixed size. OP_CONNECT_V2
+// carries the highest version the client speaks and the server answers
+// with the version used for the rest of the session:
+//   [OP_CONNECT_V2][version]{[length][path]} x 3 (request, response, notif)
+//   reply: [OP_CONNECT_V2][result][version]
+// From version 2 on keys and values are sent as [length][characters], see
+// wire.h, which also applies to notifications: [key][value].
+// From version 3 on each notification starts with the sequence number of
+// the change, see OP_RESUME: [sequence][key][value].
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+#define PROTOCOL_V3 3
+#define PROTOCOL_VERSION PROTOCOL_V3
+#define CONNECT_V2_HEADER_SIZE 2
+
+// A request whose opcode has this bit set carries a request id right after
+// the opcode, and its reply is [opcode][id][result]. Tagged requests can be
+// sent back to back without waiting for each reply, the id tells which
+// request a reply belongs to.
+#define OP_FLAG_TAGGED 0x40
+#define OP_CODE(op) ((char)((op) & ~OP_FLAG_TAGGED))
+
+// Every write and delete gets the next number of a single server-wide
+// sequence, in the order subscribers are notified.
+typedef uint64_t change_seq_t;
+#define SEQUENCE_SIZE sizeof(change_seq_t)
+
+typedef uint32_t request_id_t;
+#define REQUEST_ID_SIZE sizeof(request_id_t)
+
+// SUBSCRIBE_BATCH and UNSUBSCRIBE_BATCH carry a key count after the opcode
+// (and id), followed by that many keys. The reply repeats the count and has
+// one result per key, in request order. A request with a count of 0 or
+// above MAX_NUMBER_SUB is malformed and ends the session.
+// OP_NOTIF_SHM carries the name of a POSIX shared memory ring created by
+// the client (see notif_ring.h), encoded as a key. Once the server replies
+// with 0 the notifications of the session go to the ring instead of the
+// FIFO. It must be sent before subscribing to any key.
+//
+// READ, WRITE and DELETE use the same count and keys, up to MAX_NUMBER_SUB
+// of them, and WRITE sends each key followed by its value. The reply to a
+// WRITE or DELETE has one result per key (0 on success, 1 if a deleted key
+// did not exist). The reply to a READ has, for each key, 0 followed by the
+// value, or 1 alone if the key does not exist. Keys and values hold at most
+// MAX_STRING_SIZE - 1 characters, as in the jobs, and keys start with a
+// letter or a digit; other keys fail with 1 in every operation, 0 when
+// subscribed to. Only patterns may start with anything.
+//
+// OP_RESUME subscribes to keys like SUBSCRIBE_BATCH, for a client that was
+// up to date up to a sequence number: [sequence][count][keys...]. Before
+// replying, the server sends the changes made to those keys after that
+// sequence as notifications, if its change log still has them, or else the
+// current value of every subscribed key, all with the current sequence.
+// The reply is [mode][count][results...], mode being RESUME_REPLAYED or
+// RESUME_SNAPSHOT. Only sessions of version 3 or newer can resume, others
+// get a count of 0.
+#define MAX_BATCH_FRAME_SIZE(count) (1 + (count) * (MAX_STRING_SIZE + 1))
+#define MAX_WRITE_FRAME_SIZE(count) (1 + (count) * 2 * (MAX_STRING_SIZE + 1))
+#define MAX_RESUME_FRAME_SIZE(count) (SEQUENCE_SIZE + MAX_BATCH_FRAME_SIZE(count))
+// Strings longer than MAX_STRING_SIZE are never sent, from version 2 on a
+// request with one is malformed and ends the session. The largest request
+// is then a tagged WRITE of MAX_NUMBER_SUB pairs.
+#define MAX_REQUEST_FRAME_SIZE (1 + REQUEST_ID_SIZE + MAX_WRITE_FRAME_SIZE(MAX_NUMBER_SUB))
+#define RESUME_REPLAYED 0
+#define RESUME_SNAPSHOT 1
+// Socket transport. Instead of three FIFOs, a client can open a single
+// AF_UNIX SOCK_SEQPACKET connection to SOCKET_PATH_PREFIX<server name>. Its
+// first record is an OP_CONNECT_V2 request with three empty paths, answered
+// as usual. From then on every record carries whole frames: requests, the
+// replies to them, and notifications, which go one per record after an
+// OP_NOTIFICATION byte so the client can tell them from replies.
+#define SOCKET_PATH_PREFIX "/tmp/al97_sock_"
+#define MAX_SOCKET_RECORD_SIZE 1024
+#define SOCKET_BATCH 16  // records moved by one recvmmsg or sendmmsg
+
+#define MAX_REPLY_SIZE (1 + REQUEST_ID_SIZE + 1 + MAX_NUMBER_SUB * (1 + MAX_STRING_SIZE + 1))
 
 
 #endif  // COMMON_PROTOCOL_H
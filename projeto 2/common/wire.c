@@ -0,0 +1,86 @@
+#include "wire.h"
+
+#include <limits.h>
+#include <string.h>
+
+#include "protocol.h"
+
+size_t wire_put_string(char *buf, const char *str, int version) {
+  size_t len = strnlen(str, MAX_STRING_SIZE);
+
+  if (version == PROTOCOL_V1) {
+    memset(buf, '\0', MAX_WIRE_STRING_SIZE);
+    memcpy(buf, str, len);
+    return MAX_WIRE_STRING_SIZE;
+  }
+
+  buf[0] = (char)len;
+  memcpy(buf + 1, str, len);
+  return 1 + len;
+}
+
+size_t wire_string_size(const char *buf, size_t len, int version) {
+  if (version == PROTOCOL_V1) {
+    return MAX_WIRE_STRING_SIZE;
+  }
+  return len < 1 ? 0 : 1 + (size_t)(unsigned char)buf[0];
+}
+
+size_t wire_get_string(const char *buf, char *str, int version) {
+  if (version == PROTOCOL_V1) {
+    memcpy(str, buf, MAX_WIRE_STRING_SIZE);
+    str[MAX_STRING_SIZE] = '\0';
+    return MAX_WIRE_STRING_SIZE;
+  }
+
+  // Longer strings than allowed are consumed whole but truncated
+  size_t len = (unsigned char)buf[0];
+  size_t copied = len < MAX_STRING_SIZE ? len : MAX_STRING_SIZE;
+  memcpy(str, buf + 1, copied);
+  str[copied] = '\0';
+  return 1 + len;
+}
+
+size_t wire_put_connect(char *buf, const char *const paths[3]) {
+  size_t len = CONNECT_V2_HEADER_SIZE;
+  buf[0] = OP_CONNECT_V2;
+  buf[1] = PROTOCOL_VERSION;
+
+  // Paths are length prefixed, without padding
+  for (int i = 0; i < 3; i++) {
+    size_t path_len = strnlen(paths[i], MAX_PIPE_PATH_LENGTH - 1);
+    buf[len++] = (char)path_len;
+    memcpy(buf + len, paths[i], path_len);
+    len += path_len;
+  }
+  return len;
+}
+
+size_t wire_put_notification(char *buf, change_seq_t seq, const char *key, const char *value,
+                             int version) {
+  size_t len = 0;
+  if (version >= PROTOCOL_V3) {
+    memcpy(buf, &seq, SEQUENCE_SIZE);
+    len += SEQUENCE_SIZE;
+  }
+  len += wire_put_string(buf + len, key, version);
+  return len + wire_put_string(buf + len, value, version);
+}
+
+int wire_read_string(wire_reader reader, void *source, char *str, int version) {
+  if (version == PROTOCOL_V1) {
+    int ret = reader(source, str, MAX_WIRE_STRING_SIZE);
+    str[MAX_STRING_SIZE] = '\0';
+    return ret;
+  }
+
+  char buf[1 + UCHAR_MAX];
+  int ret = reader(source, buf, 1);
+  if (ret == 1 && buf[0] != 0) {
+    ret = reader(source, buf + 1, (size_t)(unsigned char)buf[0]);
+  }
+  if (ret == 1) {
+    wire_get_string(buf, str, version);
+  }
+  return ret;
+}
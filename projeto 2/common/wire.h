@@ -0,0 +1,64 @@
+#ifndef COMMON_WIRE_H
+#define COMMON_WIRE_H
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "protocol.h"
+
+// Strings on the wire depend on the protocol version of the session. In
+// version 1 they are padded to MAX_STRING_SIZE + 1 bytes, from version 2 on
+// they are a length byte followed by the characters, without padding.
+#define MAX_WIRE_STRING_SIZE (MAX_STRING_SIZE + 1)
+#define MAX_NOTIFICATION_SIZE (SEQUENCE_SIZE + 2 * MAX_WIRE_STRING_SIZE)
+
+/// Encodes a string.
+/// @param buf Where to write it, at least MAX_WIRE_STRING_SIZE bytes.
+/// @param str String to encode, truncated to MAX_STRING_SIZE characters.
+/// @param version Protocol version of the session.
+/// @return Number of bytes written.
+size_t wire_put_string(char *buf, const char *str, int version);
+
+/// Size of the encoded string at the start of buf.
+/// @param buf Received bytes.
+/// @param len Number of received bytes.
+/// @param version Protocol version of the session.
+/// @return The size of the encoded string, 0 if more bytes are needed to
+///         know it.
+size_t wire_string_size(const char *buf, size_t len, int version);
+
+/// Decodes a complete string.
+/// @param buf Encoded string.
+/// @param str Where to store it, at least MAX_STRING_SIZE + 1 bytes.
+/// @param version Protocol version of the session.
+/// @return Number of bytes consumed.
+size_t wire_get_string(const char *buf, char *str, int version);
+
+/// Encodes a notification, the key followed by its new value.
+/// @param buf Where to write it, at least MAX_NOTIFICATION_SIZE bytes.
+/// @param seq Sequence number of the change, only sent from version 3 on.
+/// @param key Key that changed.
+/// @param value New value of the key, or "DELETED".
+/// @param version Protocol version of the session.
+/// @return Number of bytes written.
+size_t wire_put_notification(char *buf, change_seq_t seq, const char *key, const char *value,
+                             int version);
+
+/// Encodes an OP_CONNECT_V2 request asking for PROTOCOL_VERSION.
+/// @param buf Where to write it, at least CONNECT_FRAME_SIZE bytes.
+/// @param paths Request, response and notification pipe paths.
+/// @return Number of bytes written.
+size_t wire_put_connect(char *buf, const char *const paths[3]);
+
+/// Reads exactly size bytes from a source, returning as read_all.
+typedef int (*wire_reader)(void *source, void *buf, size_t size);
+
+/// Reads an encoded string.
+/// @param reader Function that reads from the source.
+/// @param source Where the string is read from, e.g. a file descriptor.
+/// @param str Where to store it, at least MAX_STRING_SIZE + 1 bytes.
+/// @param version Protocol version of the session.
+/// @return 1 on success, as read_all otherwise.
+int wire_read_string(wire_reader reader, void *source, char *str, int version);
+
+#endif  // COMMON_WIRE_H
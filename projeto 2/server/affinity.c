@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include "affinity.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MAX_NUMA_NODES 64
+#define CPU_LIST_SIZE 256
+#define NODE_PATH_SIZE 64
+
+static cpu_set_t role_cpus[AFFINITY_ROLES];
+static int role_configured[AFFINITY_ROLES] = {0};
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Parses a CPU list in the kernel format, e.g. "0-3,8,10-11".
+// @return 0 on success, 1 if the list is malformed.
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+  const char *ptr = list;
+  CPU_ZERO(set);
+
+  while (*ptr != '\0' && *ptr != '\n') {
+    char *end;
+    unsigned long first = strtoul(ptr, &end, 10);
+    if (end == ptr) {
+      return 1;
+    }
+
+    unsigned long last = first;
+    if (*end == '-') {
+      ptr = end + 1;
+      last = strtoul(ptr, &end, 10);
+      if (end == ptr || last < first) {
+        return 1;
+      }
+    }
+    if (last >= CPU_SETSIZE) {
+      return 1;
+    }
+
+    for (unsigned long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, set);
+    }
+
+    ptr = end;
+    if (*ptr == ',') {
+      ptr++;
+    } else if (*ptr != '\0' && *ptr != '\n') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Reads the CPUs of a NUMA node from sysfs.
+// @return 0 on success, 1 if the node is not present.
+static int read_node_cpus(int node, cpu_set_t *set) {
+  char path[NODE_PATH_SIZE];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return 1;
+  }
+
+  char list[CPU_LIST_SIZE];
+  int ret = fgets(list, sizeof(list), file) == NULL || parse_cpu_list(list, set);
+  fclose(file);
+  return ret;
+}
+
+// Writes a CPU set as a CPU list, e.g. "0-3,8".
+static void format_cpu_list(const cpu_set_t *set, char *buf, size_t size) {
+  size_t len = 0;
+  buf[0] = '\0';
+
+  for (size_t cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+    if (!CPU_ISSET(cpu, set)) {
+      continue;
+    }
+    size_t last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+      last++;
+    }
+
+    int n;
+    if (last == cpu) {
+      n = snprintf(buf + len, size - len, "%s%zu", len ? "," : "", cpu);
+    } else {
+      n = snprintf(buf + len, size - len, "%s%zu-%zu", len ? "," : "", cpu, last);
+    }
+    len += (size_t)n;
+    cpu = last;
+  }
+}
+
+// Writes the NUMA nodes that own CPUs of the set, e.g. "0,1".
+static void format_nodes(const cpu_set_t *set, char *buf, size_t size) {
+  size_t len = 0;
+  buf[0] = '\0';
+
+  for (int node = 0; node < MAX_NUMA_NODES && len < size; node++) {
+    cpu_set_t node_cpus, common;
+    if (read_node_cpus(node, &node_cpus) != 0) {
+      continue;
+    }
+    CPU_AND(&common, &node_cpus, set);
+    if (CPU_COUNT(&common) > 0) {
+      len += (size_t)snprintf(buf + len, size - len, "%s%d", len ? "," : "", node);
+    }
+  }
+
+  if (len == 0) {
+    snprintf(buf, size, "n/a");
+  }
+}
+
+int affinity_set_role(affinity_role role, const char *spec) {
+  cpu_set_t cpus;
+
+  if (strncmp(spec, "node", 4) == 0) {
+    char *end;
+    long node = strtol(spec + 4, &end, 10);
+    if (end == spec + 4 || *end != '\0' || node < 0 || node >= MAX_NUMA_NODES ||
+        read_node_cpus((int)node, &cpus) != 0) {
+      fprintf(stderr, "NUMA node not present: %s\n", spec);
+      return 1;
+    }
+  } else if (parse_cpu_list(spec, &cpus) != 0) {
+    fprintf(stderr, "Invalid CPU list: %s\n", spec);
+    return 1;
+  }
+
+  // Only keep the CPUs this process is allowed to run on
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    CPU_AND(&cpus, &cpus, &allowed);
+  }
+  if (CPU_COUNT(&cpus) == 0) {
+    fprintf(stderr, "No usable CPU in %s\n", spec);
+    return 1;
+  }
+
+  role_cpus[role] = cpus;
+  role_configured[role] = 1;
+  return 0;
+}
+
+void affinity_apply(affinity_role role, const char *name) {
+  if (!role_configured[role]) {
+    return;
+  }
+
+  pthread_t self = pthread_self();
+  if (pthread_setaffinity_np(self, sizeof(cpu_set_t), &role_cpus[role]) != 0) {
+    fprintf(stderr, "Failed to set the affinity of %s\n", name);
+    return;
+  }
+
+  // Reports where the thread can actually run
+  cpu_set_t placed;
+  char cpus[CPU_LIST_SIZE], nodes[CPU_LIST_SIZE];
+  if (pthread_getaffinity_np(self, sizeof(cpu_set_t), &placed) != 0) {
+    return;
+  }
+  format_cpu_list(&placed, cpus, sizeof(cpus));
+  format_nodes(&placed, nodes, sizeof(nodes));
+
+  pthread_mutex_lock(&report_lock);
+  printf("Placement: %s (tid %ld) on CPUs %s, NUMA nodes %s\n", name,
+         (long)syscall(SYS_gettid), cpus, nodes);
+  fflush(stdout);
+  pthread_mutex_unlock(&report_lock);
+}
+
+void affinity_apply_process(affinity_role role) {
+  if (role_configured[role]) {
+    sched_setaffinity(0, sizeof(cpu_set_t), &role_cpus[role]);
+  }
+}
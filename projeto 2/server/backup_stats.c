@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include "backup_stats.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "lock_profile.h"
+#include "stats.h"
+
+#define PROC_STAT_SIZE 1024
+#define MINFLT_FIELD 10  // of /proc/<pid>/stat, see man proc
+
+typedef enum { RECORD_FREE, RECORD_FORKING, RECORD_RUNNING } record_state;
+
+// The state and the parent side are only touched by the server, under
+// records_mutex; the child side by the child, which then sets child_done
+typedef struct {
+  record_state state;
+  pid_t pid;
+  int reaped;  // the child was waited for, maybe before it was done
+  char name[BACKUP_NAME_SIZE];
+  uint64_t fork_ns;
+  uint64_t lock_ns;
+  long faults_before;
+  int child_done;
+  uint64_t child_ns;
+  uint64_t write_ns;
+  long faults_after;  // -1 if the child could not read them
+} backup_record;
+
+// Shared with every child, forked after they are mapped
+static backup_record *records = NULL;
+static pthread_mutex_t records_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int backup_stats_init(void) {
+  records = mmap(NULL, BACKUP_RECORDS * sizeof(backup_record), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (records == MAP_FAILED) {
+    records = NULL;
+    fprintf(stderr, "Failed to map the backup records\n");
+    return 1;
+  }
+  LOCK_PROFILE_NAME(&records_mutex, "backup_records", -1);
+  return 0;
+}
+
+// Minor faults of the server so far, counting every thread.
+static long server_faults(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return -1;
+  }
+  return usage.ru_minflt;
+}
+
+// Logs and records every finished backup. Must hold records_mutex.
+static void collect_locked(void) {
+  for (int i = 0; i < BACKUP_RECORDS; i++) {
+    backup_record *record = &records[i];
+    if (record->state != RECORD_RUNNING ||
+        !__atomic_load_n(&record->child_done, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+
+    uint64_t serialize_ns = record->child_ns - record->write_ns;
+    long faults = -1;
+    if (record->faults_after >= 0 && record->faults_before >= 0) {
+      faults = record->faults_after - record->faults_before;
+    }
+    printf("Backup %s: fork %.1f us, lock held %.1f us, serialize %.1f us, write %.1f us, "
+           "minor faults %ld\n",
+           record->name, (double)record->fork_ns / 1e3, (double)record->lock_ns / 1e3,
+           (double)serialize_ns / 1e3, (double)record->write_ns / 1e3, faults);
+    fflush(stdout);
+
+    stats_record_ns(STAT_FORK, record->fork_ns);
+    stats_record_ns(STAT_FORK_LOCK, record->lock_ns);
+    stats_record_ns(STAT_BCK_SERIAL, serialize_ns);
+    stats_record_ns(STAT_BCK_WRITE, record->write_ns);
+    if (faults >= 0) {
+      stats_record_faults((uint64_t)faults);
+    }
+    record->state = RECORD_FREE;
+  }
+}
+
+void backup_stats_collect(void) {
+  if (records == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&records_mutex);
+  collect_locked();
+  pthread_mutex_unlock(&records_mutex);
+}
+
+int backup_stats_claim(const char *bck_name) {
+  if (records == NULL) {
+    return -1;
+  }
+
+  int claimed = -1;
+  pthread_mutex_lock(&records_mutex);
+  collect_locked();
+  for (int i = 0; i < BACKUP_RECORDS; i++) {
+    if (records[i].state == RECORD_FREE) {
+      claimed = i;
+      break;
+    }
+  }
+  if (claimed != -1) {
+    backup_record *record = &records[claimed];
+    record->state = RECORD_FORKING;
+    snprintf(record->name, sizeof(record->name), "%s", bck_name);
+    record->pid = 0;
+    record->reaped = 0;
+    record->child_done = 0;
+    record->faults_before = server_faults();
+  }
+  pthread_mutex_unlock(&records_mutex);
+  return claimed;
+}
+
+pid_t backup_stats_fork(int record) {
+  if (record < 0) {
+    return fork();
+  }
+
+  // Held across the fork so that a child reaped right away is found by its
+  // pid. The child never takes the mutex.
+  pthread_mutex_lock(&records_mutex);
+  pid_t pid = fork();
+  if (pid != 0) {
+    records[record].pid = pid;
+    pthread_mutex_unlock(&records_mutex);
+  }
+  return pid;
+}
+
+void backup_stats_forked(int record, pid_t pid, uint64_t fork_ns, uint64_t lock_ns) {
+  if (record < 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&records_mutex);
+  backup_record *entry = &records[record];
+  if (pid < 0 || (entry->reaped && !__atomic_load_n(&entry->child_done, __ATOMIC_ACQUIRE))) {
+    entry->state = RECORD_FREE;
+  } else {
+    entry->fork_ns = fork_ns;
+    entry->lock_ns = lock_ns;
+    entry->state = RECORD_RUNNING;
+  }
+  pthread_mutex_unlock(&records_mutex);
+}
+
+void backup_stats_reaped(pid_t pid) {
+  if (records == NULL || pid <= 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&records_mutex);
+  for (int i = 0; i < BACKUP_RECORDS; i++) {
+    backup_record *record = &records[i];
+    if (record->state == RECORD_FREE || record->pid != pid) {
+      continue;
+    }
+    record->reaped = 1;
+    // A child that died before it was done never fills its side, a record
+    // still forking is released by backup_stats_forked
+    if (record->state == RECORD_RUNNING &&
+        !__atomic_load_n(&record->child_done, __ATOMIC_ACQUIRE)) {
+      record->state = RECORD_FREE;
+    }
+    break;
+  }
+  collect_locked();
+  pthread_mutex_unlock(&records_mutex);
+}
+
+// Writes a positive number in decimal, without stdio.
+// @return Number of characters written.
+static size_t format_decimal(char *dest, long value) {
+  char digits[24];
+  size_t count = 0;
+  do {
+    digits[count++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value > 0);
+  for (size_t i = 0; i < count; i++) {
+    dest[i] = digits[count - 1 - i];
+  }
+  return count;
+}
+
+// Reads the minor faults of the parent from /proc, with async signal safe
+// calls only (getrusage can not look at another process).
+// @return Number of faults, -1 if they could not be read.
+static long parent_faults(void) {
+  char path[64] = "/proc/";
+  size_t length = strlen(path);
+  length += format_decimal(path + length, (long)getppid());
+  memcpy(path + length, "/stat", sizeof("/stat"));
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  char stat[PROC_STAT_SIZE];
+  ssize_t size = read(fd, stat, sizeof(stat) - 1);
+  close(fd);
+  if (size <= 0) {
+    return -1;
+  }
+  stat[size] = '\0';
+
+  // The name in field 2 may hold spaces, the fields after it can not
+  char *field = strrchr(stat, ')');
+  if (field == NULL) {
+    return -1;
+  }
+  for (int i = 2; i < MINFLT_FIELD; i++) {
+    field = strchr(field + 1, ' ');
+    if (field == NULL) {
+      return -1;
+    }
+  }
+
+  long faults = 0;
+  for (field++; *field >= '0' && *field <= '9'; field++) {
+    faults = faults * 10 + (*field - '0');
+  }
+  return faults;
+}
+
+void backup_stats_child_done(int record, uint64_t start, uint64_t write_ns) {
+  if (record < 0) {
+    return;
+  }
+  records[record].child_ns = stats_now() - start;
+  records[record].write_ns = write_ns;
+  records[record].faults_after = parent_faults();
+  __atomic_store_n(&records[record].child_done, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,56 @@
+#ifndef KVS_BACKUP_STATS_H
+#define KVS_BACKUP_STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Cost of each backup, measured on both sides of its fork: the parent
+// records the fork and how long it held the table lock around it, the child
+// its serialization and write time and the minor faults the parent took
+// while it ran (copy on write). Records live in memory shared with the
+// children and are logged and added to the stats once the child is done.
+// A child that dies before that has its record released when it is reaped.
+
+#define BACKUP_RECORDS 64      // backups measured at once, others are not
+#define BACKUP_NAME_SIZE 64
+
+/// Maps the records shared with the children. Must be called before the
+/// first backup.
+/// @return 0 on success, 1 otherwise.
+int backup_stats_init(void);
+
+/// Claims a record for a backup about to fork, taking the parent's faults
+/// so far. Collects the finished backups first.
+/// @param bck_name Name of the backup file.
+/// @return Index of the record, -1 if none is free.
+int backup_stats_claim(const char *bck_name);
+
+/// Forks the child of a backup, so that the record knows its pid before
+/// anyone can reap it.
+/// @param record Index returned by backup_stats_claim, -1 for none.
+/// @return Result of fork.
+pid_t backup_stats_fork(int record);
+
+/// Fills the parent side of a record after the fork.
+/// @param record Index returned by backup_stats_claim, ignored if -1.
+/// @param pid Result of fork, the record is released if negative.
+/// @param fork_ns Time spent in fork.
+/// @param lock_ns Time the table lock was held around the fork.
+void backup_stats_forked(int record, pid_t pid, uint64_t fork_ns, uint64_t lock_ns);
+
+/// Fills the child side of a record once the backup is written. Only uses
+/// async signal safe calls.
+/// @param record Index returned by backup_stats_claim, ignored if -1.
+/// @param start Time the child started, from stats_now.
+/// @param write_ns Part of the child's time spent in write.
+void backup_stats_child_done(int record, uint64_t start, uint64_t write_ns);
+
+/// Logs every finished backup on stdout and adds it to the stats.
+void backup_stats_collect(void);
+
+/// Tells that a child was reaped, releasing its record even if the child
+/// died before it was done. Then collects the finished backups.
+/// @param pid Result of wait, ignored unless positive.
+void backup_stats_reaped(pid_t pid);
+
+#endif  // KVS_BACKUP_STATS_H
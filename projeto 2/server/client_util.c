@@ -1,67 +1,73 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "../common/constants.h"
 #include "../common/io.h"
+#include "../common/protocol.h"
+#include "../common/wire.h"
+#include "affinity.h"
 #include "client_util.h"
+#include "conn_queue.h"
+#include "lock_profile.h"
 #include "operations.h"
+#include "session_loop.h"
+#include "socket_transport.h"
+#include "stats.h"
 
 int max_clients;
 int stop_server = 0;
 
 pthread_t *client_worker_threads;
-sem_t *sem_empty;
-sem_t *sem_full;
-pthread_mutex_t mutex;
-
-client_args BUFFER_PC;
+conn_queue pending_sessions;
+size_t conn_queue_depth = DEFAULT_CONN_QUEUE_DEPTH;
 
 client_args active_clients[MAX_SESSION_COUNT];
 pthread_mutex_t active_clients_mutex;
 
+// Bytes read from the register pipe that were not decoded yet
+char register_buf[REGISTER_BUFFER_SIZE];
+size_t register_len = 0;
+
 int sigusr1_flag = false;
+int event_loop_threads = 0;
 
-void producer(client_args args) {
+void producer(const pending_session *session) {
   if (sigusr1_flag) {
+    if (session->is_socket) {
+      safe_close(session->req_pipe_fd);
+    }
     return;
   }
-  sem_wait(sem_empty);
-  pthread_mutex_lock(&mutex);
-
-  BUFFER_PC = args;
-
-  pthread_mutex_unlock(&mutex);
-  sem_post(sem_full);
+  // Only blocks once conn_queue_depth sessions are waiting for a worker
+  conn_queue_push(&pending_sessions, session, &sigusr1_flag);
 }
 
-client_args consumer() {
-  sem_wait(sem_full);
-  pthread_mutex_lock(&mutex);
-
-  client_args args = BUFFER_PC;
-
-  pthread_mutex_unlock(&mutex);
-  sem_post(sem_empty);
-
-  return args;
+pending_session consumer() {
+  pending_session session;
+  conn_queue_pop(&pending_sessions, &session);
+  return session;
 }
 
 void init_worker_threads() {
   client_worker_threads = malloc((unsigned long)max_clients * sizeof(pthread_t));
 
-  sem_empty = sem_open("/sem_empty", O_CREAT, 0644, 1);
-  sem_full = sem_open("/sem_full", O_CREAT, 0644, 0);
+  if (conn_queue_init(&pending_sessions, conn_queue_depth) != 0) {
+    fprintf(stderr, "Failed to initialize the connection queue\n");
+    exit(1);
+  }
 
-  pthread_mutex_init(&mutex, NULL);
   pthread_mutex_init(&active_clients_mutex, NULL);
+  LOCK_PROFILE_NAME(&active_clients_mutex, "active_clients_mutex", -1);
 
   for (int i = 0; i < MAX_SESSION_COUNT; i++) {
     memset(active_clients[i].req_pipe_path, 0, sizeof(active_clients[i].req_pipe_path));
@@ -70,6 +76,24 @@ void init_worker_threads() {
     active_clients[i].resp_pipe_fd = -1;
     active_clients[i].req_pipe_fd = -1;
     active_clients[i].notif_pipe_fd = -1;
+    pthread_mutex_init(&active_clients[i].lock, NULL);
+    LOCK_PROFILE_NAME(&active_clients[i].lock, "session_lock", i);
+    if (notif_queue_init(&active_clients[i].queue) != 0) {
+      fprintf(stderr, "Failed to initialize the notification queues\n");
+      exit(1);
+    }
+  }
+  if (notifier_start() != 0) {
+    exit(1);
+  }
+
+  if (event_loop_threads > 0) {
+    // One thread accepts sessions, the event loops serve all of them
+    if (session_loop_start(event_loop_threads) != 0) {
+      fprintf(stderr, "Failed to start the session event loops\n");
+      exit(1);
+    }
+    max_clients = 1;
   }
 
   for (int i = 0; i < max_clients; i++) {
@@ -83,210 +107,911 @@ void close_worker_threads() {
   }
 
   free(client_worker_threads);
-  pthread_mutex_destroy(&mutex);
+  conn_queue_destroy(&pending_sessions);
+}
+
+// Size of the connect request at the start of buf.
+// @return The size of the request, 0 if more bytes are needed to know it.
+static size_t connect_frame_size(const char *buf, size_t len) {
+  if (buf[0] != OP_CONNECT_V2) {
+    return CONNECT_FRAME_SIZE;
+  }
+
+  size_t size = CONNECT_V2_HEADER_SIZE;
+  for (int i = 0; i < 3; i++) {
+    if (len <= size) {
+      return 0;
+    }
+    size += 1 + (size_t)(unsigned char)buf[size];
+  }
+  return size;
+}
 
-  sem_close(sem_empty);
-  sem_close(sem_full);
+// Copies a length prefixed pipe path, truncated to fit.
+// @return Number of bytes consumed.
+static size_t get_pipe_path(const char *buf, char *path) {
+  size_t len = (unsigned char)buf[0];
+  size_t copied = len < MAX_PIPE_PATH_LENGTH ? len : MAX_PIPE_PATH_LENGTH - 1;
+  memcpy(path, buf + 1, copied);
+  path[copied] = '\0';
+  return 1 + len;
+}
 
-  sem_unlink("/sem_empty");
-  sem_unlink("/sem_full");
+int session_version(int requested) {
+  return requested < PROTOCOL_V2 ? PROTOCOL_V2
+         : requested > PROTOCOL_VERSION ? PROTOCOL_VERSION : requested;
 }
 
-client_args produce(int fd) {
-  client_args ret = {0};
-  int res = 0;
+// Decodes the complete connect requests at the start of register_buf.
+// @return Number of sessions decoded.
+static size_t decode_connects(pending_session *sessions, size_t max) {
+  size_t offset = 0;
+  size_t count = 0;
+
+  while (count < max && register_len > offset) {
+    const char *frame = register_buf + offset;
+    size_t size = connect_frame_size(frame, register_len - offset);
+    if (size == 0 || register_len - offset < size) {
+      break;
+    }
+
+    pending_session *client = &sessions[count++];
+    memset(client, 0, sizeof(pending_session));
+
+    if (frame[0] == OP_CONNECT_V2) {
+      client->version = session_version((unsigned char)frame[1]);
+
+      const char *path = frame + CONNECT_V2_HEADER_SIZE;
+      path += get_pipe_path(path, client->req_pipe_path);
+      path += get_pipe_path(path, client->resp_pipe_path);
+      get_pipe_path(path, client->notif_pipe_path);
+    } else {
+      // The opcode is followed by the request, response and notification pipes
+      client->version = PROTOCOL_V1;
+      memcpy(client->req_pipe_path, frame + 1, MAX_PIPE_PATH_LENGTH);
+      memcpy(client->resp_pipe_path, frame + 1 + MAX_PIPE_PATH_LENGTH, MAX_PIPE_PATH_LENGTH);
+      memcpy(client->notif_pipe_path, frame + 1 + 2 * MAX_PIPE_PATH_LENGTH, MAX_PIPE_PATH_LENGTH);
+      client->req_pipe_path[MAX_PIPE_PATH_LENGTH - 1] = '\0';
+      client->resp_pipe_path[MAX_PIPE_PATH_LENGTH - 1] = '\0';
+      client->notif_pipe_path[MAX_PIPE_PATH_LENGTH - 1] = '\0';
+    }
 
-  char code;
-  res = read_all(fd, &code, sizeof(char), &sigusr1_flag);
-  if (res <= 1 && sigusr1_flag) {
-    return ret;
+    offset += size;
   }
-  else if (res == -1) {
-    fprintf(stderr, "Failed to read from server pipe\n");
-    exit(1);
+
+  memmove(register_buf, register_buf + offset, register_len - offset);
+  register_len -= offset;
+  return count;
+}
+
+size_t produce(int fd, pending_session *sessions, size_t max) {
+  size_t count = decode_connects(sessions, max);
+  if (count > 0) {
+    return count;
   }
-  
-  char req_pipe_path[MAX_PIPE_PATH_LENGTH];
-  char resp_pipe_path[MAX_PIPE_PATH_LENGTH];
-  char notif_pipe_path[MAX_PIPE_PATH_LENGTH];
 
-  res = read_all(fd, req_pipe_path, MAX_PIPE_PATH_LENGTH, &sigusr1_flag);
+  // One read takes every connect request already in the pipe
+  ssize_t res = read(fd, register_buf + register_len, REGISTER_BUFFER_SIZE - register_len);
   if (res == -1) {
+    if (errno == EINTR) {
+      return 0;
+    }
     fprintf(stderr, "Failed to read from server pipe\n");
     exit(1);
   }
+  register_len += (size_t)res;
 
-  res = read_all(fd, resp_pipe_path, MAX_PIPE_PATH_LENGTH, &sigusr1_flag);
-  if (res == -1) {
-    fprintf(stderr, "Failed to read from server pipe\n");
-    exit(1);
+  return decode_connects(sessions, max);
+}
+
+// Opens the pipes of a new client, stores it in a free slot of
+// active_clients and acknowledges the connection.
+// @return The slot of the session, -1 on failure.
+static int session_open(const pending_session *client) {
+  int index = -1;
+
+  int req_fd = client->req_pipe_fd;
+  int resp_fd = client->resp_pipe_fd;
+  int notif_fd = client->notif_pipe_fd;
+  if (!client->is_socket) {
+    req_fd = safe_open(client->req_pipe_path, O_RDONLY);
+    resp_fd = safe_open(client->resp_pipe_path, O_WRONLY);
+    notif_fd = safe_open(client->notif_pipe_path, O_WRONLY);
+  }
+  // Event loops must never block on a request pipe, even reading on a stale
+  // event once the slot was reused. Sockets stay blocking, they also carry
+  // the replies and are read with MSG_DONTWAIT instead.
+  if (event_loop_threads > 0 && !client->is_socket) {
+    int flags = fcntl(req_fd, F_GETFL);
+    if (flags == -1 || fcntl(req_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+      perror("fcntl");
+    }
   }
 
-  res = read_all(fd, notif_pipe_path, MAX_PIPE_PATH_LENGTH, &sigusr1_flag);
-  if (res == -1) {
-    fprintf(stderr, "Failed to read from server pipe\n");
+  pthread_mutex_lock(&active_clients_mutex);
+  for (int i = 0; i < MAX_SESSION_COUNT; i++) {
+    if (active_clients[i].req_pipe_fd < 0) {
+      if (notif_queue_open(&active_clients[i].queue, notif_fd, client->is_socket) != 0) {
+        // Refused, as when no slot is free
+        perror("fcntl");
+        break;
+      }
+      strcpy(active_clients[i].req_pipe_path, client->req_pipe_path);
+      strcpy(active_clients[i].resp_pipe_path, client->resp_pipe_path);
+      strcpy(active_clients[i].notif_pipe_path, client->notif_pipe_path);
+      active_clients[i].req_pipe_fd = req_fd;
+      active_clients[i].resp_pipe_fd = resp_fd;
+      active_clients[i].notif_pipe_fd = notif_fd;
+      active_clients[i].is_socket = client->is_socket;
+      active_clients[i].version = client->version;
+      active_clients[i].ring = NULL;
+      active_clients[i].in_len = 0;
+      active_clients[i].out_len = 0;
+      active_clients[i].nonblocking = 0;
+      active_clients[i].watching_replies = 0;
+      active_clients[i].leaving = 0;
+      memset(active_clients[i].keys, 0, sizeof(active_clients[i].keys));
+      index = i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&active_clients_mutex);
+
+  // Version 2 replies also tell the client which version was chosen
+  char reply[3] = {OP_CONNECT, (char)(index < 0 ? 1 : 0), (char)client->version};
+  size_t reply_len = 2;
+  if (client->version >= PROTOCOL_V2) {
+    reply[0] = OP_CONNECT_V2;
+    reply_len = 3;
+  }
+  if (write_all(resp_fd, reply, reply_len) == -1) {
+    fprintf(stderr, "Failed to write to client\n");
     exit(1);
   }
 
-  strncpy(ret.req_pipe_path, req_pipe_path, MAX_PIPE_PATH_LENGTH);
-  strncpy(ret.resp_pipe_path, resp_pipe_path, MAX_PIPE_PATH_LENGTH);
-  strncpy(ret.notif_pipe_path, notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+  if (index < 0) {
+    safe_close(req_fd);
+    if (!client->is_socket) {
+      safe_close(resp_fd);
+      safe_close(notif_fd);
+    }
+  }
+  return index;
+}
 
-  return ret;
+// Closes the pipes of a session, or its socket.
+static void session_close_fds(client_args *client) {
+  safe_close(client->req_pipe_fd);
+  if (!client->is_socket) {
+    safe_close(client->resp_pipe_fd);
+    safe_close(client->notif_pipe_fd);
+  }
 }
 
-void *client_threads() {
-  sigset_t set;
-  sigemptyset(&set);
-  sigaddset(&set, SIGUSR1);
-  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
-    fprintf(stderr, "Failed to block SIGUSR1\n");
-    exit(1);
+// Every request fits the buffer, so a session never waits for a frame it
+// has no room for
+_Static_assert(MAX_REQUEST_FRAME_SIZE <= REQUEST_BUFFER_SIZE,
+               "request frames must fit REQUEST_BUFFER_SIZE");
+
+#define FRAME_MALFORMED SIZE_MAX
+
+// Size of the request frame at the start of buf.
+// @param version Protocol version of the session.
+// @return The size of the frame, 0 if more bytes are needed to know it, or
+//         FRAME_MALFORMED if its key count is 0 or above MAX_NUMBER_SUB or
+//         it has a string longer than MAX_STRING_SIZE.
+static size_t request_frame_size(const char *buf, size_t len, int version) {
+  if (len < 1) {
+    return 0;
   }
 
-  while (!stop_server) {
-    int index = 0;
-    client_args client = consumer();
-
-    int req_fd = safe_open(client.req_pipe_path, O_RDONLY);
-    int resp_fd = safe_open(client.resp_pipe_path, O_WRONLY);
-    int notif_fd = safe_open(client.notif_pipe_path, O_WRONLY);
-
-    pthread_mutex_lock(&active_clients_mutex);
-    for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-      if (active_clients[i].req_pipe_fd < 0) {
-        strcpy(active_clients[i].req_pipe_path, client.req_pipe_path);
-        strcpy(active_clients[i].resp_pipe_path, client.resp_pipe_path);
-        strcpy(active_clients[i].notif_pipe_path, client.notif_pipe_path);
-        active_clients[i].req_pipe_fd = req_fd;
-        active_clients[i].resp_pipe_fd = resp_fd;
-        active_clients[i].notif_pipe_fd = notif_fd;
-        memset(active_clients[i].keys, 0, sizeof(active_clients[i].keys));
-        index = i;
-        break;
+  size_t size = (buf[0] & OP_FLAG_TAGGED) ? 1 + REQUEST_ID_SIZE : 1;
+  size_t strings = 1;
+  switch (OP_CODE(buf[0])) {
+    case OP_DISCONNECT:
+      return size;
+    case OP_RESUME:
+      size += SEQUENCE_SIZE;
+      // fall through
+    case OP_SUBSCRIBE_BATCH:
+    case OP_UNSUBSCRIBE_BATCH:
+    case OP_READ:
+    case OP_WRITE:
+    case OP_DELETE:
+      if (len <= size) {
+        return 0;
+      }
+      strings = (unsigned char)buf[size++];
+      if (strings == 0 || strings > MAX_NUMBER_SUB) {
+        // Where the keys end is unknown, so is where the next frame starts
+        return FRAME_MALFORMED;
+      }
+      if (OP_CODE(buf[0]) == OP_WRITE) {
+        strings *= 2;  // a value follows each key
       }
+      break;
+    default:
+      // SUBSCRIBE, UNSUBSCRIBE and unknown codes carry a key
+      break;
+  }
+
+  for (size_t i = 0; i < strings; i++) {
+    size_t key_size = len > size ? wire_string_size(buf + size, len - size, version) : 0;
+    if (key_size == 0) {
+      return 0;
     }
-    pthread_mutex_unlock(&active_clients_mutex);
+    if (key_size > MAX_WIRE_STRING_SIZE) {
+      return FRAME_MALFORMED;
+    }
+    size += key_size;
+  }
+  return size;
+}
 
-    char code = OP_CONNECT;
-    char res = 0;
-    if (write_all(active_clients[index].resp_pipe_fd, &code, sizeof(char)) == -1) {
-      fprintf(stderr, "Failed to write to client\n");
-      exit(1);
+// Tells whether the table can hold a key or value: it fits the strings of
+// the jobs, whose terminator takes the last of MAX_STRING_SIZE bytes.
+static int storable_string(const char *str) {
+  return strlen(str) < MAX_STRING_SIZE;
+}
+
+// Tells whether a key can be written, read or deleted: it fits and the
+// table has a bucket for it (see hash).
+static int storable_key(const char *key) {
+  return storable_string(key) && hash(key) >= 0;
+}
+
+// Tells whether a key can be subscribed to: a pattern of the same length,
+// which may start with anything, or a key the table can hold.
+static int subscribable(const char *key) {
+  size_t len = strlen(key);
+  return (len > 0 && len < MAX_STRING_SIZE && key[len - 1] == PATTERN_WILDCARD) ||
+         storable_key(key);
+}
+
+// Records a key subscribed by a session, so it is removed on disconnect.
+// A key that cannot be recorded must not be subscribed, its subscription
+// would outlive the session.
+// @return 0 on success, 1 if the session has MAX_NUMBER_SUB keys already.
+static int track_key(client_args *client, const char *key) {
+  for (int i = 0; i < MAX_NUMBER_SUB; i++) {
+    if (client->keys[i][0] == '\0') {
+      strncpy(client->keys[i], key, MAX_STRING_SIZE);
+      return 0;
     }
-    if (write_all(active_clients[index].resp_pipe_fd, &res, sizeof(char)) == -1) {
-      fprintf(stderr, "Failed to write to client\n");
-      exit(1);
+  }
+  return 1;
+}
+
+static void untrack_key(client_args *client, const char *key) {
+  for (int i = 0; i < MAX_NUMBER_SUB; i++) {
+    if (strcmp(client->keys[i], key) == 0) {
+      memset(client->keys[i], '\0', MAX_STRING_SIZE);
+      break;
+    }
+  }
+}
+
+// Records the keys of a subscribe request, moving those that could be
+// recorded to the front of keys. Keys that can not be subscribed to are
+// left out.
+// @param slots Set to the position in the request of each key kept.
+// @return Number of keys kept.
+static size_t track_keys(client_args *client, char keys[][MAX_STRING_SIZE + 1], size_t count,
+                         size_t *slots) {
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!subscribable(keys[i]) || track_key(client, keys[i]) != 0) {
+      continue;
+    }
+    if (kept != i) {
+      memcpy(keys[kept], keys[i], MAX_STRING_SIZE + 1);
     }
+    slots[kept++] = i;
+  }
+  return kept;
+}
+
+// Forgets the kept keys that failed to subscribe and puts the results back
+// in request order, the keys not kept failed too.
+static void settle_keys(client_args *client, char keys[][MAX_STRING_SIZE + 1], char *results,
+                        size_t count, const size_t *slots, size_t kept) {
+  char kept_results[MAX_NUMBER_SUB];
+  memcpy(kept_results, results, kept);
+  memset(results, 0, count);
+  for (size_t i = 0; i < kept; i++) {
+    if (kept_results[i] == 0) {
+      untrack_key(client, keys[i]);
+    }
+    results[slots[i]] = kept_results[i];
+  }
+}
 
-    char key[MAX_STRING_SIZE + 1] = {'\0'};
-    int ret = 0;
+// How the notifications of a session are sent.
+static Subscriber session_subscriber(client_args *client) {
+  Subscriber subscriber = {client->notif_pipe_fd, client->version, &client->queue};
+  return subscriber;
+}
 
-    while (!stop_server) {
-      ret = read_all(active_clients[index].req_pipe_fd, &code, sizeof(char), NULL);
-      if (ret == -1) {
-        fprintf(stderr, "Failed to read from client\n");
-        exit(1);
-      } else if (ret == -2) {
-        fprintf(stderr, "Client %d disconnected\n", index);
-        break;
+// Maps the shared memory ring of a session, its notifications are written
+// there from now on.
+// @return 0 on success, 1 if the ring could not be mapped or the session
+//         already subscribed to keys.
+static char session_attach_ring(client_args *client, const char *name) {
+  for (int i = 0; i < MAX_NUMBER_SUB; i++) {
+    if (client->keys[i][0] != '\0') {
+      return 1;
+    }
+  }
+  if (client->ring != NULL) {
+    return 1;
+  }
+
+  client->ring = notif_ring_attach(name);
+  if (client->ring == NULL) {
+    return 1;
+  }
+  notif_queue_set_ring(&client->queue, client->ring);
+  return 0;
+}
+
+// Stops the notifications of a session, reporting those it lost to the
+// queue policy. Must be called after the session was unsubscribed from
+// every key.
+static void session_close_notifications(int index) {
+  client_args *client = &active_clients[index];
+  notif_queue_close(&client->queue);
+  if (client->queue.dropped > 0 || client->queue.coalesced > 0 || client->queue.overflowed) {
+    fprintf(stderr, "Client %d: %lu notifications dropped, %lu coalesced%s\n", index,
+            client->queue.dropped, client->queue.coalesced,
+            client->queue.overflowed ? ", disconnected for falling behind" : "");
+  }
+}
+
+// Wakes the reader of the session's ring and unmaps it. Must be called
+// after session_close_notifications.
+static void session_detach_ring(client_args *client) {
+  if (client->ring != NULL) {
+    notif_ring_close(client->ring);
+    notif_ring_detach(client->ring);
+    client->ring = NULL;
+  }
+}
+
+// Handles a SUBSCRIBE_BATCH or UNSUBSCRIBE_BATCH request of a session.
+// @param body The request after the opcode and id.
+// @param reply Set to the key count followed by the result of each key.
+// @return The size of the reply.
+static size_t handle_batch(int index, char code, const char *body, char *reply) {
+  client_args *client = &active_clients[index];
+  char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE + 1];
+  size_t count = (unsigned char)body[0];  // checked by request_frame_size
+
+  const char *key = body + 1;
+  for (size_t i = 0; i < count; i++) {
+    key += wire_get_string(key, keys[i], client->version);
+  }
+
+  if (code == OP_SUBSCRIBE_BATCH) {
+    size_t slots[MAX_NUMBER_SUB];
+    size_t kept = track_keys(client, keys, count, slots);
+    Subscriber subscriber = session_subscriber(client);
+    uint64_t start = stats_now();
+    kvs_subscribe_batch(keys, kept, &subscriber, reply + 1);
+    stats_record(STAT_SUBSCRIBE, start);
+    settle_keys(client, keys, reply + 1, count, slots, kept);
+  } else {
+    for (size_t i = 0; i < count; i++) {
+      untrack_key(client, keys[i]);
+    }
+    kvs_unsubscribe_batch(keys, count, client->notif_pipe_fd, reply + 1);
+  }
+  reply[0] = (char)count;
+  return 1 + count;
+}
+
+// Handles a RESUME request of a session.
+// @param body The request after the opcode and id.
+// @param reply Set to the mode, the key count and the result of each key.
+// @return The size of the reply.
+static size_t handle_resume(int index, const char *body, char *reply) {
+  client_args *client = &active_clients[index];
+  char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE + 1];
+  change_seq_t seq;
+  memcpy(&seq, body, SEQUENCE_SIZE);
+  size_t count = (unsigned char)body[SEQUENCE_SIZE];
+
+  // Older sessions would not know which notifications are replayed
+  if (client->version < PROTOCOL_V3) {
+    reply[0] = RESUME_SNAPSHOT;
+    reply[1] = 0;
+    return 2;
+  }
+
+  const char *key = body + SEQUENCE_SIZE + 1;
+  for (size_t i = 0; i < count; i++) {
+    key += wire_get_string(key, keys[i], client->version);
+  }
+  size_t slots[MAX_NUMBER_SUB];
+  size_t kept = track_keys(client, keys, count, slots);
+
+  Subscriber subscriber = session_subscriber(client);
+  reply[0] = kvs_resume(keys, kept, seq, &subscriber, reply + 2);
+  settle_keys(client, keys, reply + 2, count, slots, kept);
+  reply[1] = (char)count;
+  return 2 + count;
+}
+
+// Handles a READ, WRITE or DELETE request of a session. Keys and values the
+// table can not hold fail without reaching it, see storable_key.
+// @param body The request after the opcode and id.
+// @param reply Set to the key count followed by the result of each key.
+// @return The size of the reply.
+static size_t handle_data(int index, char code, const char *body, char *reply) {
+  client_args *client = &active_clients[index];
+  char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE];
+  char values[MAX_NUMBER_SUB][MAX_STRING_SIZE];
+  char results[MAX_NUMBER_SUB];  // of the keys kept, 0 on success
+  size_t slots[MAX_NUMBER_SUB];  // position in the request of each key kept
+  size_t count = (unsigned char)body[0];  // checked by request_frame_size
+
+  const char *str = body + 1;
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++) {
+    char key[MAX_STRING_SIZE + 1], value[MAX_STRING_SIZE + 1] = "";
+    str += wire_get_string(str, key, client->version);
+    if (code == OP_WRITE) {
+      str += wire_get_string(str, value, client->version);
+    }
+    if (storable_key(key) && storable_string(value)) {
+      strcpy(keys[kept], key);
+      strcpy(values[kept], value);
+      slots[kept++] = i;
+    }
+  }
+
+  uint64_t start = stats_now();
+  switch (code) {
+    case OP_READ: {
+      char found[MAX_NUMBER_SUB];
+      if (kvs_read_values(kept, keys, values, found) != 0) {
+        memset(found, 0, kept);
       }
+      stats_record(STAT_READ, start);
+      for (size_t i = 0; i < kept; i++) {
+        results[i] = found[i] ? 0 : 1;
+      }
+      break;
+    }
+    case OP_WRITE:
+      if (kvs_write_keys(kept, keys, values, 0, results) != 0) {
+        memset(results, 1, kept);
+      }
+      stats_record(STAT_WRITE, start);
+      break;
+    default:
+      if (kvs_delete_keys(kept, keys, results) != 0) {
+        memset(results, 1, kept);
+      }
+      stats_record(STAT_DELETE, start);
+      break;
+  }
+
+  size_t len = 1;
+  reply[0] = (char)count;
+  size_t next = 0;  // next key kept
+  for (size_t i = 0; i < count; i++) {
+    int valid = next < kept && slots[next] == i;
+    char result = valid ? results[next] : 1;
+    reply[len++] = result;
+    if (code == OP_READ && result == 0) {
+      len += wire_put_string(reply + len, values[next], client->version);
+    }
+    next += (size_t)valid;
+  }
+  return len;
+}
+
+// Handles a SUBSCRIBE or UNSUBSCRIBE request of a session.
+// @return The result to send back to the client.
+static char handle_request(int index, char code, const char *key) {
+  client_args *client = &active_clients[index];
+  char res;
 
-      if (code == OP_DISCONNECT) {
+  switch (code) {
+    case OP_SUBSCRIBE: {
+      if (!subscribable(key) || track_key(client, key) != 0) {
+        res = 0;  // as for a key that does not exist
         break;
       }
+      Subscriber subscriber = session_subscriber(client);
+      uint64_t start = stats_now();
+      res = kvs_subscribe(key, &subscriber);
+      stats_record(STAT_SUBSCRIBE, start);
+      if (res == 0) {
+        untrack_key(client, key);
+      }
+      break;
+    }
+    case OP_UNSUBSCRIBE:
+      untrack_key(client, key);
+      res = kvs_unsubscribe(key, client->notif_pipe_fd);
+      break;
+    case OP_NOTIF_SHM:
+      res = session_attach_ring(client, key);
+      break;
+    default:
+      fprintf(stderr, "Unknown operation code: %d\n", code);
+      res = 1;
+      break;
+  }
+  return res;
+}
 
-      ret = read_all(active_clients[index].req_pipe_fd, key, MAX_STRING_SIZE + 1, NULL);
-      if (ret == -1) {
-        fprintf(stderr, "Failed to read from client\n");
-        exit(1);
-      } else if (ret == -2) {
-        printf("Client %d disconnected\n", index);
+// Sends the replies gathered for a session. A socket takes them as a single
+// record or not at all, a pipe possibly only in part.
+// @param wait If unset, only writes what the client takes without blocking.
+// @return 0 on success, 1 if the client is gone.
+static int write_replies(client_args *client, int wait) {
+  size_t written = 0;
+  while (written < client->out_len) {
+    const char *buf = client->out_buf + written;
+    size_t len = client->out_len - written;
+    ssize_t n = client->is_socket
+                    ? send(client->resp_pipe_fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL)
+                    : write(client->resp_pipe_fd, buf, len);
+    if (n >= 0) {
+      written += (size_t)n;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      if (!wait) {
         break;
       }
+      struct pollfd pfd = {.fd = client->resp_pipe_fd, .events = POLLOUT};
+      if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+        return 1;
+      }
+    } else if (errno != EINTR) {
+      fprintf(stderr, "Failed to write to client\n");
+      return 1;
+    }
+  }
+  memmove(client->out_buf, client->out_buf + written, client->out_len - written);
+  client->out_len -= written;
+  return 0;
+}
 
-      switch (code) {
-        case OP_SUBSCRIBE:
-          for (int i = 0; i < MAX_NUMBER_SUB; i++) {
-            if (active_clients[index].keys[i][0] == '\0') {
-              strncpy(active_clients[index].keys[i], key, MAX_STRING_SIZE);
-              break;
-            }
-          }
-          res = kvs_subscribe(key, notif_fd);
-          break;
-        case OP_UNSUBSCRIBE:
-          for (int i = 0; i < MAX_NUMBER_SUB; i++) {
-            if (strcmp(active_clients[index].keys[i], key) == 0) {
-              memset(active_clients[index].keys[i], '\0', MAX_STRING_SIZE);
-              break;
-            }
-          }
-          res = kvs_unsubscribe(key, notif_fd);
-          break;
-        default:
-          fprintf(stderr, "Unknown operation code: %d\n", code);
-          res = 1;
-          break;
+// Handles every complete request frame buffered for a session, keeping
+// a trailing partial frame for the next read. The replies to pipelined
+// requests are sent together with a single write. A session of an event
+// loop stops once its client leaves replies untaken, its frames wait for
+// session_serve.
+// @return SESSION_OPEN, SESSION_DISCONNECT if the client asked to leave, or
+//         SESSION_LOST if a request was malformed or the replies could not
+//         be written.
+static int session_process(int index) {
+  client_args *client = &active_clients[index];
+  char *replies = client->out_buf;
+  size_t offset = 0;
+  int status = SESSION_OPEN;
+
+  while (status == SESSION_OPEN) {
+    const char *frame = client->in_buf + offset;
+    size_t size = request_frame_size(frame, client->in_len - offset, client->version);
+    if (size == FRAME_MALFORMED) {
+      fprintf(stderr, "Client %d sent a malformed request\n", index);
+      status = SESSION_LOST;
+      break;
+    }
+    if (size == 0 || client->in_len - offset < size) {
+      break;
+    }
+
+    if (client->out_len + MAX_REPLY_SIZE > REPLY_BUFFER_SIZE) {
+      if (write_replies(client, !client->nonblocking) != 0) {
+        status = SESSION_LOST;
+        break;
+      }
+      if (client->out_len + MAX_REPLY_SIZE > REPLY_BUFFER_SIZE) {
+        break;
       }
+    }
+    offset += size;
+
+    char code = OP_CODE(frame[0]);
+    size_t header = (frame[0] & OP_FLAG_TAGGED) ? 1 + REQUEST_ID_SIZE : 1;
+    if (code == OP_DISCONNECT) {
+      status = SESSION_DISCONNECT;
+      continue;
+    }
+
+    size_t replies_len = client->out_len;
+    // The reply echoes the opcode and, if tagged, the request id
+    memcpy(replies + replies_len, frame, header);
+    replies_len += header;
 
-      ret = write_all(active_clients[index].resp_pipe_fd, &code, sizeof(char));
-      if (ret == -1) {
-        fprintf(stderr, "Failed to write to client\n");
-        exit(1);
+    if (code == OP_SUBSCRIBE_BATCH || code == OP_UNSUBSCRIBE_BATCH) {
+      replies_len += handle_batch(index, code, frame + header, replies + replies_len);
+    } else if (code == OP_RESUME) {
+      replies_len += handle_resume(index, frame + header, replies + replies_len);
+    } else if (code == OP_READ || code == OP_WRITE || code == OP_DELETE) {
+      replies_len += handle_data(index, code, frame + header, replies + replies_len);
+    } else {
+      char key[MAX_STRING_SIZE + 1];
+      wire_get_string(frame + header, key, client->version);
+      replies[replies_len++] = handle_request(index, code, key);
+    }
+    client->out_len = replies_len;
+  }
+  if (status != SESSION_LOST && write_replies(client, !client->nonblocking) != 0) {
+    status = SESSION_LOST;
+  }
+
+  memmove(client->in_buf, client->in_buf + offset, client->in_len - offset);
+  client->in_len -= offset;
+  return status;
+}
+
+// Reads the request records of a socket session, up to SOCKET_BATCH of
+// them with each call. Records always hold whole frames.
+static int session_read_socket(int index, int drain) {
+  client_args *client = &active_clients[index];
+  char records[SOCKET_BATCH][MAX_SOCKET_RECORD_SIZE];
+  size_t lens[SOCKET_BATCH];
+
+  while (1) {
+    int n = socket_receive(client->req_pipe_fd, records, lens, !drain);
+    if (n > 0) {
+      for (int i = 0; i < n; i++) {
+        if (lens[i] > REQUEST_BUFFER_SIZE - client->in_len) {
+          // Only happens to a client that sends on without taking replies
+          fprintf(stderr, "Client %d is not reading its replies\n", index);
+          return SESSION_LOST;
+        }
+        memcpy(client->in_buf + client->in_len, records[i], lens[i]);
+        client->in_len += lens[i];
+        int status = client->out_len > 0 ? SESSION_OPEN : session_process(index);
+        if (status != SESSION_OPEN) {
+          return status;
+        }
+      }
+      if (!drain || client->out_len > 0) {
+        return SESSION_OPEN;
       }
+    } else if (n == 0) {
+      fprintf(stderr, "Client %d disconnected\n", index);
+      return SESSION_LOST;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return SESSION_OPEN;
+    } else if (errno != EINTR) {
+      return SESSION_LOST;
+    }
+  }
+}
+
+int session_read(int index, int drain) {
+  client_args *client = &active_clients[index];
+  if (client->is_socket) {
+    return session_read_socket(index, drain);
+  }
 
-      ret = write_all(active_clients[index].resp_pipe_fd, &res, sizeof(char));
-      if (ret == -1) {
-        fprintf(stderr, "Failed to write to client\n");
-        exit(1);
+  while (1) {
+    ssize_t n = read(client->req_pipe_fd, client->in_buf + client->in_len,
+                     REQUEST_BUFFER_SIZE - client->in_len);
+    if (n > 0) {
+      client->in_len += (size_t)n;
+      int status = session_process(index);
+      if (status != SESSION_OPEN || !drain || client->out_len > 0) {
+        return status;
       }
+    } else if (n == 0) {
+      fprintf(stderr, "Client %d disconnected\n", index);
+      return SESSION_LOST;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return SESSION_OPEN;
+    } else if (errno != EINTR) {
+      return SESSION_LOST;
+    }
+  }
+}
+
+int session_lock(int index, int req_fd) {
+  pthread_mutex_lock(&active_clients[index].lock);
+  if (active_clients[index].req_pipe_fd != req_fd) {
+    pthread_mutex_unlock(&active_clients[index].lock);
+    return 1;
+  }
+  return 0;
+}
+
+void session_unlock(int index) {
+  pthread_mutex_unlock(&active_clients[index].lock);
+}
 
-      memset(key, '\0', MAX_STRING_SIZE + 1);
+// Unsubscribes a session from every key and stops its notifications. Must
+// hold the session lock.
+static void session_release(int index) {
+  client_args *client = &active_clients[index];
+  kvs_disconnect_client(client->keys, client->notif_pipe_fd);
+  session_close_notifications(index);
+  session_detach_ring(client);
+}
+
+// Releases a session whose client asked to leave and queues the answer,
+// after any reply it did not take yet. session_process always leaves room
+// for it. Must hold the session lock.
+static void session_leave(int index) {
+  client_args *client = &active_clients[index];
+  session_release(index);
+  client->out_buf[client->out_len++] = OP_DISCONNECT;
+  client->out_buf[client->out_len++] = 0;
+  client->leaving = 1;
+}
+
+int session_serve(int index) {
+  client_args *client = &active_clients[index];
+  if (write_replies(client, 0) != 0) {
+    return SESSION_LOST;
+  }
+  if (client->out_len > 0) {
+    return SESSION_OPEN;
+  }
+  if (client->leaving) {
+    return SESSION_DISCONNECT;
+  }
+
+  // Frames left waiting for the replies to be taken come first
+  int status = session_process(index);
+  if (status == SESSION_OPEN && client->out_len == 0) {
+    status = session_read(index, 1);
+  }
+  if (status == SESSION_DISCONNECT) {
+    // Answered without waiting, the loop watches the rest go out
+    session_leave(index);
+    if (write_replies(client, 0) != 0) {
+      return SESSION_LOST;
     }
+    return client->out_len > 0 ? SESSION_OPEN : SESSION_DISCONNECT;
+  }
+  return status;
+}
 
-    if (ret >= 0) {
-      kvs_disconnect_client(active_clients[index].keys, notif_fd);
-      code = OP_DISCONNECT;
-      res = 0;  
-      write_all(active_clients[index].resp_pipe_fd, &code, sizeof(char));
-      write_all(active_clients[index].resp_pipe_fd, &res, sizeof(char));
+void session_end(int index, int req_fd) {
+  pthread_mutex_lock(&active_clients_mutex);
+  client_args *client = &active_clients[index];
+  if (client->req_pipe_fd != req_fd) {
+    // Already torn down by a SIGUSR1
+    pthread_mutex_unlock(&active_clients_mutex);
+    return;
+  }
+  pthread_mutex_lock(&client->lock);
 
-      safe_close(active_clients[index].req_pipe_fd);
-      safe_close(active_clients[index].resp_pipe_fd);
-      safe_close(active_clients[index].notif_pipe_fd);
+  if (!client->leaving) {
+    session_release(index);
+  }
+  session_close_fds(client);
 
-      pthread_mutex_lock(&active_clients_mutex);
-      memset(active_clients[index].req_pipe_path, 0, sizeof(active_clients[index].req_pipe_path));
-      memset(active_clients[index].resp_pipe_path, 0, sizeof(active_clients[index].resp_pipe_path));
-      memset(active_clients[index].notif_pipe_path, 0, sizeof(active_clients[index].notif_pipe_path));
-      active_clients[index].req_pipe_fd = -1;
-      active_clients[index].resp_pipe_fd = -1;
-      active_clients[index].notif_pipe_fd = -1;
-      pthread_mutex_unlock(&active_clients_mutex);   
+  memset(client->req_pipe_path, 0, sizeof(client->req_pipe_path));
+  memset(client->resp_pipe_path, 0, sizeof(client->resp_pipe_path));
+  memset(client->notif_pipe_path, 0, sizeof(client->notif_pipe_path));
+  client->req_pipe_fd = -1;
+  client->resp_pipe_fd = -1;
+  client->notif_pipe_fd = -1;
+  pthread_mutex_unlock(&client->lock);
+  pthread_mutex_unlock(&active_clients_mutex);
+}
+
+void *client_threads() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR1\n");
+    exit(1);
+  }
+  affinity_apply(AFFINITY_SESSIONS, "session worker");
+
+  while (!stop_server) {
+    pending_session client = consumer();
+
+    int index = session_open(&client);
+    if (index < 0) {
+      continue;
     }
+    int req_fd = active_clients[index].req_pipe_fd;
+
+    if (event_loop_threads > 0) {
+      // The session is served by the event loops from now on
+      if (session_loop_add(index) != 0) {
+        session_end(index, req_fd);
+      }
+      continue;
+    }
+
+    int status = SESSION_OPEN;
+    while (!stop_server && status == SESSION_OPEN) {
+      status = session_read(index, 0);
+    }
+    if (status == SESSION_DISCONNECT && session_lock(index, req_fd) == 0) {
+      session_leave(index);
+      session_unlock(index);
+      // Only this worker waits for the client to take the answer, as for
+      // any reply
+      write_replies(&active_clients[index], 1);
+    }
+    session_end(index, req_fd);
   }
   return NULL;
 }
 
 
+// Accepts the sessions of the socket transport, as the register reader
+// does for connect requests.
+static void *socket_listener(void *arg) {
+  int listen_fd = *(int *)arg;
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR1\n");
+    exit(1);
+  }
+  affinity_apply(AFFINITY_SESSIONS, "socket listener");
+
+  socket_acceptor acceptor;
+  if (socket_acceptor_init(&acceptor, listen_fd) != 0) {
+    fprintf(stderr, "Failed to accept socket sessions\n");
+    return NULL;
+  }
+
+  unsigned int retry_ms = ACCEPT_RETRY_MS;
+  while (!stop_server) {
+    pending_session client;
+    int ret = socket_accept(&acceptor, &client);
+    if (ret == 0) {
+      producer(&client);
+    }
+    if (ret != -1 || errno == EINTR || errno == ECONNABORTED) {
+      retry_ms = ACCEPT_RETRY_MS;
+      continue;
+    }
+
+    // Out of descriptors or memory, accepting again at once would only spin
+    perror("accept");
+    struct timespec delay = {retry_ms / 1000, (long)(retry_ms % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+    retry_ms = retry_ms * 2 < ACCEPT_MAX_RETRY_MS ? retry_ms * 2 : ACCEPT_MAX_RETRY_MS;
+  }
+  socket_acceptor_destroy(&acceptor);
+  return NULL;
+}
+
 void client_pool_manager(pool_args * args) {
   pool_args *pool = (pool_args *) args;
   max_clients = (int)pool->max_clients;
   int server_reg_path = pool->server_fd;
 
+  affinity_apply(AFFINITY_SESSIONS, "register reader");
+
   init_worker_threads();
 
+  pthread_t listener;
+  if (pool->socket_fd >= 0 &&
+      pthread_create(&listener, NULL, socket_listener, &pool->socket_fd) != 0) {
+    fprintf(stderr, "Failed to create the socket listener\n");
+  }
+
   while (!stop_server) {
     if (sigusr1_flag) {
+      pthread_mutex_lock(&active_clients_mutex);
       for (int i = 0; i < MAX_SESSION_COUNT; i++) {
         if (active_clients[i].req_pipe_fd != -1) {
-          kvs_disconnect_client(active_clients[i].keys, 
-                                active_clients[i].notif_pipe_fd);
+          // Waits for an event loop serving the session to be done with it
+          pthread_mutex_lock(&active_clients[i].lock);
+          if (!active_clients[i].leaving) {
+            session_release(i);
+          }
 
-          safe_close(active_clients[i].notif_pipe_fd);
-          safe_close(active_clients[i].resp_pipe_fd);
-          safe_close(active_clients[i].req_pipe_fd);
+          session_close_fds(&active_clients[i]);
 
           safe_unlink(active_clients[i].req_pipe_path);
           safe_unlink(active_clients[i].resp_pipe_path);
@@ -297,13 +1022,18 @@ void client_pool_manager(pool_args * args) {
           active_clients[i].req_pipe_fd = -1;
           active_clients[i].resp_pipe_fd = -1;
           active_clients[i].notif_pipe_fd = -1;
+          pthread_mutex_unlock(&active_clients[i].lock);
         }
       }
+      pthread_mutex_unlock(&active_clients_mutex);
       sigusr1_flag = false;
     }
     if (!sigusr1_flag){
-      client_args client = produce(server_reg_path);
-      producer(client);
+      pending_session sessions[CONNECT_BATCH];
+      size_t count = produce(server_reg_path, sessions, CONNECT_BATCH);
+      for (size_t i = 0; i < count; i++) {
+        producer(&sessions[i]);
+      }
     }
   }
 }
@@ -312,6 +1042,14 @@ void set_stop_server(int stop) {
   stop_server = stop;
 }
 
+void set_event_loop_threads(int threads) {
+  event_loop_threads = threads;
+}
+
+void set_conn_queue_depth(size_t depth) {
+  conn_queue_depth = depth;
+}
+
 void sig_handler(int sig) {
   sigusr1_flag = true;
   if (signal(sig, sig_handler) == SIG_ERR) {
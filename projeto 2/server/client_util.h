@@ -1,12 +1,15 @@
 #ifndef CLIENT_UTIL_H
 #define CLIENT_UTIL_H
 
+#include <pthread.h>
+
 #include "constants.h"
 #include "kvs.h"
 
 typedef struct {
     int max_clients;
     int server_fd;
+    int socket_fd;  // listening socket, -1 if the socket transport is off
 } pool_args;
 
 typedef struct {
@@ -16,20 +19,109 @@ typedef struct {
     int req_pipe_fd;
     int resp_pipe_fd;
     int notif_pipe_fd;
+    int is_socket;  // the three descriptors are the same socket, no paths
+    int version;  // protocol version negotiated at connect
+    notif_ring *ring;  // set once the client asks for OP_NOTIF_SHM
+    notif_queue queue;  // notifications not yet written to the client
     char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE];
+    char in_buf[REQUEST_BUFFER_SIZE];  // request bytes not yet handled
+    size_t in_len;
+    char out_buf[REPLY_BUFFER_SIZE];  // replies not yet taken by the client
+    size_t out_len;
+    int nonblocking;  // served by an event loop, replies never wait for the client
+    int watching_replies;  // the event loop waits to write replies, not to read
+    int leaving;  // unsubscribed and answered OP_DISCONNECT, only replies are left
+    pthread_mutex_t lock;  // held while an event loop serves the session
 } client_args;
 
-///  Reads the client pipe arguments from the server pipe.
+// A session waiting for a worker, only what session_open needs to fill a
+// slot of active_clients
+typedef struct {
+    char req_pipe_path[MAX_PIPE_PATH_LENGTH];
+    char resp_pipe_path[MAX_PIPE_PATH_LENGTH];
+    char notif_pipe_path[MAX_PIPE_PATH_LENGTH];
+    int req_pipe_fd;
+    int resp_pipe_fd;
+    int notif_pipe_fd;
+    int is_socket;  // the three descriptors are the same socket, no paths
+    int version;  // protocol version negotiated at connect
+} pending_session;
+
+// State of a session after reading from its request pipe
+enum {
+    SESSION_OPEN,        // still connected
+    SESSION_DISCONNECT,  // the client sent OP_DISCONNECT
+    SESSION_LOST         // the request pipe was closed or failed, or a
+                         // request was malformed
+};
+
+extern client_args active_clients[MAX_SESSION_COUNT];
+
+/// Protocol version of a session, the highest one both sides speak.
+/// @param requested Version the client asked for.
+/// @return The version to use.
+int session_version(int requested);
+
+/// Reads the client pipe arguments from the server pipe. Takes everything
+/// already in the pipe with a single read and decodes every complete connect
+/// request in it; a partial request is kept until the rest arrives.
 /// @param fd The file descriptor of the server pipe.
-/// @return The client arguments.
-client_args produce(int fd);
+/// @param sessions Where to store the sessions.
+/// @param max Maximum number of sessions to decode.
+/// @return The number of sessions decoded, 0 if interrupted by a signal.
+size_t produce(int fd, pending_session *sessions, size_t max);
 
 void * client_threads();
 
+/// Reads from the request pipe of a session and handles every complete
+/// request read. Partial requests are kept until the rest arrives.
+/// @param index Slot of the session in active_clients.
+/// @param drain If set, keeps reading until the (non-blocking) pipe is empty.
+/// @return SESSION_OPEN, SESSION_DISCONNECT or SESSION_LOST.
+int session_read(int index, int drain);
+
+/// Locks a session for an event loop, unless it was torn down since the
+/// event was queued. Takes active_clients_mutex first if both are needed.
+/// @param index Slot of the session in active_clients.
+/// @param req_fd Request pipe the session was opened with.
+/// @return 0 if the slot still holds the session and is now locked, 1
+///         otherwise.
+int session_lock(int index, int req_fd);
+
+/// Unlocks a session locked with session_lock.
+/// @param index Slot of the session in active_clients.
+void session_unlock(int index);
+
+/// Serves a session of an event loop: writes the replies its client did not
+/// take yet and, once it took them all, handles and reads its requests. A
+/// session whose client asked to leave stays open until it took the answer.
+/// Must hold the session lock.
+/// @param index Slot of the session in active_clients.
+/// @return SESSION_OPEN, SESSION_DISCONNECT once the client took every
+///         reply after asking to leave, or SESSION_LOST.
+int session_serve(int index);
+
+/// Unsubscribes a session from every key, closes its pipes and frees its
+/// slot. Never waits for the client, the answer to OP_DISCONNECT is sent
+/// before.
+/// @param index Slot of the session in active_clients.
+/// @param req_fd Request pipe the session was opened with, nothing is done
+///        if the slot no longer holds it.
+void session_end(int index, int req_fd);
+
 // Client Queue Functions Prototypes
 void client_pool_manager(pool_args * args);
 void set_stop_server(int stop);
 
+/// Sets the number of event loop threads serving the sessions.
+/// @param threads 0 to serve each session in its own worker thread.
+void set_event_loop_threads(int threads);
+
+/// Sets how many connection requests can wait for a worker before the
+/// register pipe stops being read.
+/// @param depth Depth of the pending session queue.
+void set_conn_queue_depth(size_t depth);
+
 void sig_handler(int sig);
 
 #endif
\ No newline at end of file
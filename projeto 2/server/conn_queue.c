@@ -0,0 +1,100 @@
+#include "conn_queue.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "../common/io.h"
+
+int conn_queue_init(conn_queue *queue, size_t depth) {
+  size_t capacity = 1;
+  while (capacity < depth) {
+    capacity <<= 1;
+  }
+
+  queue->slots = safe_malloc(capacity * sizeof(conn_slot));
+  queue->mask = capacity - 1;
+  for (size_t i = 0; i < capacity; i++) {
+    atomic_init(&queue->slots[i].sequence, i);
+  }
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+
+  if (sem_init(&queue->items, 0, 0) != 0) {
+    free(queue->slots);
+    return 1;
+  }
+  if (sem_init(&queue->spaces, 0, (unsigned int)capacity) != 0) {
+    sem_destroy(&queue->items);
+    free(queue->slots);
+    return 1;
+  }
+  return 0;
+}
+
+void conn_queue_destroy(conn_queue *queue) {
+  sem_destroy(&queue->items);
+  sem_destroy(&queue->spaces);
+  free(queue->slots);
+}
+
+int conn_queue_push(conn_queue *queue, const pending_session *session, int *intr) {
+  while (sem_wait(&queue->spaces) == -1) {
+    if (errno != EINTR || (intr != NULL && *intr)) {
+      return 1;
+    }
+  }
+
+  // A slot is free once its sequence matches the position. The semaphore
+  // only tells that some slot was freed: the one at head may still be held
+  // by a consumer that claimed it before the one that posted, so besides
+  // retrying on a lost CAS the loop spins until that consumer copied the
+  // session out.
+  size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  conn_slot *slot;
+  while (1) {
+    slot = &queue->slots[pos & queue->mask];
+    size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (seq == pos) {
+      if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else {
+      pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    }
+  }
+
+  slot->value = *session;
+  atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+  sem_post(&queue->items);
+  return 0;
+}
+
+void conn_queue_pop(conn_queue *queue, pending_session *session) {
+  while (sem_wait(&queue->items) == -1 && errno == EINTR) {
+  }
+
+  // A slot holds a session once its sequence is one past the position, the
+  // loop also spins while a producer that claimed it is still copying in
+  size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  conn_slot *slot;
+  while (1) {
+    slot = &queue->slots[pos & queue->mask];
+    size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (seq == pos + 1) {
+      if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else {
+      pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    }
+  }
+
+  *session = slot->value;
+  // Marks the slot free for the producer that wraps around to it
+  atomic_store_explicit(&slot->sequence, pos + queue->mask + 1, memory_order_release);
+  sem_post(&queue->spaces);
+}
@@ -0,0 +1,53 @@
+#ifndef CONN_QUEUE_H
+#define CONN_QUEUE_H
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "client_util.h"
+
+#define DEFAULT_CONN_QUEUE_DEPTH 64
+
+typedef struct {
+    atomic_size_t sequence;
+    pending_session value;
+} conn_slot;
+
+// Bounded multi-producer multi-consumer ring of pending sessions.
+// Slots are claimed with a CAS on head/tail (no lock is taken), and the two
+// unnamed semaphores only put a thread to sleep when the ring is full or
+// empty, so a burst of connects never stalls the register pipe reader
+// until depth requests are waiting.
+typedef struct {
+    conn_slot *slots;
+    size_t mask;
+    atomic_size_t head;  // next position to enqueue
+    atomic_size_t tail;  // next position to dequeue
+    sem_t items;
+    sem_t spaces;
+} conn_queue;
+
+/// Initializes the queue.
+/// @param queue Queue to initialize.
+/// @param depth Minimum number of pending sessions, rounded up to a power of two.
+/// @return 0 on success, 1 otherwise.
+int conn_queue_init(conn_queue *queue, size_t depth);
+
+/// Destroys the queue.
+/// @param queue Queue to destroy.
+void conn_queue_destroy(conn_queue *queue);
+
+/// Adds a session to the queue, blocking while it is full.
+/// @param queue The queue.
+/// @param session Session to add.
+/// @param intr If not NULL, gives up when set by a signal handler.
+/// @return 0 if the session was added, 1 if interrupted.
+int conn_queue_push(conn_queue *queue, const pending_session *session, int *intr);
+
+/// Removes the oldest session from the queue, blocking while it is empty.
+/// @param queue The queue.
+/// @param session Where to store the session.
+void conn_queue_pop(conn_queue *queue, pending_session *session);
+
+#endif  // CONN_QUEUE_H
@@ -4,3 +4,8 @@
 
 #define MAX_PIPE_PATH_LENGTH 40
 #define PIPE_PERMS 0640 
+
+#define REQUEST_BUFFER_SIZE 1024
+#define REPLY_BUFFER_SIZE 512
+#define CONNECT_BATCH 64  // connect requests decoded per register pipe read
+#define REGISTER_BUFFER_SIZE (CONNECT_BATCH * CONNECT_FRAME_SIZE)
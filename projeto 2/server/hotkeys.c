@@ -0,0 +1,180 @@
+#include "hotkeys.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/io.h"
+#include "constants.h"
+#include "lock_profile.h"
+
+#define HOTKEYS_LINE_SIZE (MAX_STRING_SIZE + 48)
+
+typedef struct {
+  char key[MAX_STRING_SIZE + 1];
+  uint32_t estimate;
+} hot_key;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  uint32_t sketch[HOTKEYS_DEPTH][HOTKEYS_WIDTH];
+  hot_key heap[HOTKEYS_TOP];  // min-heap on the estimate
+  int heap_size;
+  uint32_t samples;  // since the last decay
+} hot_tracker;
+
+static const char *const kind_names[HOT_KINDS] = {"write", "read", "notify"};
+
+static hot_tracker trackers[HOT_KINDS] = {
+    {.mutex = PTHREAD_MUTEX_INITIALIZER},
+    {.mutex = PTHREAD_MUTEX_INITIALIZER},
+    {.mutex = PTHREAD_MUTEX_INITIALIZER},
+};
+
+static _Thread_local uint32_t sample_state = 0;
+
+// Tells whether to count this access, one in HOTKEYS_SAMPLE at random so
+// the sample does not follow any pattern of the jobs.
+static int sampled(void) {
+  if (sample_state == 0) {
+    // Any nonzero seed will do, the address differs between threads
+    sample_state = (uint32_t)(uintptr_t)&sample_state | 1;
+  }
+  // xorshift32
+  sample_state ^= sample_state << 13;
+  sample_state ^= sample_state >> 17;
+  sample_state ^= sample_state << 5;
+  return sample_state % HOTKEYS_SAMPLE == 0;
+}
+
+// FNV-1a, seeded differently for every row of the sketch.
+static uint32_t row_hash(const char *key, uint32_t row) {
+  uint32_t hash = 2166136261u ^ (row * 0x9e3779b9u);
+  for (; *key != '\0'; key++) {
+    hash ^= (unsigned char)*key;
+    hash *= 16777619u;
+  }
+  return hash & (HOTKEYS_WIDTH - 1);
+}
+
+static void swap_keys(hot_key *a, hot_key *b) {
+  hot_key tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+// Moves an entry whose estimate grew down to its place in the heap.
+static void sift_down(hot_tracker *tracker, int i) {
+  for (;;) {
+    int smallest = i;
+    for (int child = 2 * i + 1; child <= 2 * i + 2 && child < tracker->heap_size; child++) {
+      if (tracker->heap[child].estimate < tracker->heap[smallest].estimate) {
+        smallest = child;
+      }
+    }
+    if (smallest == i) {
+      return;
+    }
+    swap_keys(&tracker->heap[i], &tracker->heap[smallest]);
+    i = smallest;
+  }
+}
+
+static void sift_up(hot_tracker *tracker, int i) {
+  while (i > 0 && tracker->heap[i].estimate < tracker->heap[(i - 1) / 2].estimate) {
+    swap_keys(&tracker->heap[i], &tracker->heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+}
+
+// Halves every count. Halving keeps the heap ordered.
+static void decay(hot_tracker *tracker) {
+  for (int row = 0; row < HOTKEYS_DEPTH; row++) {
+    for (int col = 0; col < HOTKEYS_WIDTH; col++) {
+      tracker->sketch[row][col] >>= 1;
+    }
+  }
+  for (int i = 0; i < tracker->heap_size; i++) {
+    tracker->heap[i].estimate >>= 1;
+  }
+  tracker->samples = 0;
+}
+
+void hotkeys_record(hot_kind kind, const char *key) {
+  if (!sampled()) {
+    return;
+  }
+  hot_tracker *tracker = &trackers[kind];
+
+  pthread_mutex_lock(&tracker->mutex);
+  uint32_t estimate = UINT32_MAX;
+  for (uint32_t row = 0; row < HOTKEYS_DEPTH; row++) {
+    uint32_t *counter = &tracker->sketch[row][row_hash(key, row)];
+    if (*counter < UINT32_MAX) {
+      (*counter)++;
+    }
+    if (*counter < estimate) {
+      estimate = *counter;
+    }
+  }
+
+  int found = -1;
+  for (int i = 0; i < tracker->heap_size; i++) {
+    if (strcmp(tracker->heap[i].key, key) == 0) {
+      found = i;
+      break;
+    }
+  }
+  if (found != -1) {
+    tracker->heap[found].estimate = estimate;
+    sift_down(tracker, found);
+  } else if (tracker->heap_size < HOTKEYS_TOP || estimate > tracker->heap[0].estimate) {
+    int i = tracker->heap_size < HOTKEYS_TOP ? tracker->heap_size++ : 0;
+    strncpy(tracker->heap[i].key, key, MAX_STRING_SIZE);
+    tracker->heap[i].key[MAX_STRING_SIZE] = '\0';
+    tracker->heap[i].estimate = estimate;
+    if (i == 0) {
+      sift_down(tracker, 0);
+    } else {
+      sift_up(tracker, i);
+    }
+  }
+
+  if (++tracker->samples == HOTKEYS_DECAY_SAMPLES) {
+    decay(tracker);
+  }
+  pthread_mutex_unlock(&tracker->mutex);
+}
+
+static int compare_estimate(const void *a, const void *b) {
+  const hot_key *x = a, *y = b;
+  return (x->estimate < y->estimate) - (x->estimate > y->estimate);
+}
+
+int hotkeys_write(int fd) {
+  char line[HOTKEYS_LINE_SIZE];
+
+  for (int kind = 0; kind < HOT_KINDS; kind++) {
+    hot_key ranked[HOTKEYS_TOP];
+    pthread_mutex_lock(&trackers[kind].mutex);
+    int count = trackers[kind].heap_size;
+    memcpy(ranked, trackers[kind].heap, (size_t)count * sizeof(hot_key));
+    pthread_mutex_unlock(&trackers[kind].mutex);
+    qsort(ranked, (size_t)count, sizeof(hot_key), compare_estimate);
+
+    snprintf(line, sizeof(line), "hot %s keys (estimated accesses):\n", kind_names[kind]);
+    if (write_all(fd, line, strlen(line)) == -1) {
+      return 1;
+    }
+    for (int i = 0; i < count; i++) {
+      snprintf(line, sizeof(line), "  %-*s %10llu\n", MAX_STRING_SIZE, ranked[i].key,
+               (unsigned long long)ranked[i].estimate * HOTKEYS_SAMPLE);
+      if (write_all(fd, line, strlen(line)) == -1) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef KVS_HOTKEYS_H
+#define KVS_HOTKEYS_H
+
+// Online estimate of the keys that take most of the traffic: a sample of
+// the accesses goes into a count-min sketch, and the keys with the highest
+// estimates are kept in a min-heap. Every HOTKEYS_DECAY_SAMPLES samples the
+// counts are halved, so the ranking follows the current workload.
+
+#define HOTKEYS_SAMPLE 8            // one access in this many is counted
+#define HOTKEYS_DEPTH 4             // rows of the sketch
+#define HOTKEYS_WIDTH 1024          // counters per row, a power of two
+#define HOTKEYS_TOP 16              // keys reported per kind of access
+#define HOTKEYS_DECAY_SAMPLES 16384
+
+// Accesses tracked, each with a sketch and a ranking of its own
+typedef enum { HOT_WRITE, HOT_READ, HOT_NOTIFY, HOT_KINDS } hot_kind;
+
+/// Counts an access to a key, if it is sampled. Safe from any thread.
+/// @param kind Kind of access.
+/// @param key Key accessed.
+void hotkeys_record(hot_kind kind, const char *key);
+
+/// Writes the hottest keys of every kind of access, with their estimated
+/// number of accesses.
+/// @param fd File descriptor to write to.
+/// @return 0 on success, 1 otherwise.
+int hotkeys_write(int fd);
+
+#endif  // KVS_HOTKEYS_H
@@ -1,11 +1,17 @@
 #include "kvs.h"
 
 #include <ctype.h>
+#include <malloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "../common/io.h"
+#include "../common/protocol.h"
+#include "../common/wire.h"
+#include "hotkeys.h"
+#include "ttl_wheel.h"
 
 // Hash function based on key initial.
 // @param key Lowercase alphabetical string.
@@ -27,12 +33,27 @@ struct HashTable* create_hash_table() {
 	for (int i = 0; i < TABLE_SIZE; i++) {
 		ht->table[i] = NULL;
 	}
+	memset(ht->memory, 0, sizeof(ht->memory));
+	ht->patterns = NULL;
+	// Numbers start at the time in microseconds, so those a client got from
+	// an earlier run of the server are older than the log and lead to a snapshot
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	ht->first_seq = (change_seq_t)now.tv_sec * 1000000 + (change_seq_t)now.tv_nsec / 1000;
+	ht->seq = ht->first_seq;
 	pthread_rwlock_init(&ht->tablelock, NULL);
 	return ht;
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
+int pair_expired(const KeyNode *keyNode, uint64_t now) {
+    return keyNode->expires_at != 0 && keyNode->expires_at <= now;
+}
+
+int write_pair(HashTable *ht, const char *key, const char *value, uint64_t expires_at) {
     int index = hash(key);
+    if (index < 0) {
+        return 1;
+    }
 
     // Search for the key node
 	KeyNode *keyNode = ht->table[index];
@@ -41,8 +62,13 @@ int write_pair(HashTable *ht, const char *key, const char *value) {
     while (keyNode != NULL) {
         if (strcmp(keyNode->key, key) == 0) {
             // overwrite value
+            ht->memory[index].value_bytes -= strlen(keyNode->value) + 1;
+            ht->memory[index].allocated -= malloc_usable_size(keyNode->value);
             free(keyNode->value);
             keyNode->value = strdup(value);
+            keyNode->expires_at = expires_at;
+            ht->memory[index].value_bytes += strlen(value) + 1;
+            ht->memory[index].allocated += malloc_usable_size(keyNode->value);
             return 0;
         }
         previousNode = keyNode;
@@ -53,15 +79,27 @@ int write_pair(HashTable *ht, const char *key, const char *value) {
     keyNode->key = strdup(key); // Allocate memory for the key
     keyNode->value = strdup(value); // Allocate memory for the value
     for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-        keyNode->subscribers[i] = -1;
+        keyNode->subscribers[i].fd = -1;
     }
+    keyNode->expires_at = expires_at;
     keyNode->next = ht->table[index]; // Link to existing nodes
     ht->table[index] = keyNode; // Place new key node at the start of the list
+
+    BucketMemory *memory = &ht->memory[index];
+    memory->nodes++;
+    memory->key_bytes += strlen(key) + 1;
+    memory->value_bytes += strlen(value) + 1;
+    memory->allocated += malloc_usable_size(keyNode) + malloc_usable_size(keyNode->key) +
+                         malloc_usable_size(keyNode->value);
     return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
+char* read_pair(HashTable *ht, const char *key, char *expired) {
     int index = hash(key);
+    *expired = 0;
+    if (index < 0) {
+        return NULL;
+    }
 
 	KeyNode *keyNode = ht->table[index];
     KeyNode *previousNode;
@@ -69,6 +107,10 @@ char* read_pair(HashTable *ht, const char *key) {
 
     while (keyNode != NULL) {
         if (strcmp(keyNode->key, key) == 0) {
+            if (keyNode->expires_at != 0 && pair_expired(keyNode, ttl_now_ms())) {
+                *expired = 1;
+                return NULL;
+            }
             value = strdup(keyNode->value);
             return value; // Return the value if found
         }
@@ -81,6 +123,9 @@ char* read_pair(HashTable *ht, const char *key) {
 
 int delete_pair(HashTable *ht, const char *key) {
     int index = hash(key);
+    if (index < 0) {
+        return 1;
+    }
 
     // Search for the key node
     KeyNode *keyNode = ht->table[index];
@@ -89,6 +134,7 @@ int delete_pair(HashTable *ht, const char *key) {
     while (keyNode != NULL) {
         if (strcmp(keyNode->key, key) == 0) {
             // Key found; delete this node
+            int expired = keyNode->expires_at != 0 && pair_expired(keyNode, ttl_now_ms());
             if (prevNode == NULL) {
                 // Node to delete is the first node in the list
                 ht->table[index] = keyNode->next; // Update the table to point to the next node
@@ -97,11 +143,17 @@ int delete_pair(HashTable *ht, const char *key) {
                 prevNode->next = keyNode->next; // Link the previous node to the next node
             }
             // Free the memory allocated for the key and value
-            notify_subscribers(keyNode, "DELETED");
+            notify_subscribers(ht, keyNode, "DELETED");
+            BucketMemory *memory = &ht->memory[index];
+            memory->nodes--;
+            memory->key_bytes -= strlen(keyNode->key) + 1;
+            memory->value_bytes -= strlen(keyNode->value) + 1;
+            memory->allocated -= malloc_usable_size(keyNode) + malloc_usable_size(keyNode->key) +
+                                 malloc_usable_size(keyNode->value);
             free(keyNode->key);
             free(keyNode->value);
             free(keyNode); // Free the key node itself
-            return 0; // Exit the function
+            return expired; // Exit the function
         }
         prevNode = keyNode; // Move prevNode to current node
         keyNode = keyNode->next; // Move to the next node
@@ -110,6 +162,36 @@ int delete_pair(HashTable *ht, const char *key) {
     return 1;
 }
 
+int expire_pair(HashTable *ht, const char *key) {
+    int index = hash(key);
+    if (index < 0) {
+        return 0;
+    }
+
+    for (KeyNode *keyNode = ht->table[index]; keyNode != NULL; keyNode = keyNode->next) {
+        if (strcmp(keyNode->key, key) == 0) {
+            if (keyNode->expires_at == 0 || !pair_expired(keyNode, ttl_now_ms())) {
+                return 0;
+            }
+            delete_pair(ht, key);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Frees a pattern trie.
+static void free_patterns(PatternNode *node) {
+    if (node == NULL) {
+        return;
+    }
+    for (int i = 0; i < PATTERN_FANOUT; i++) {
+        free_patterns(node->children[i]);
+    }
+    free(node->subscribers);
+    free(node);
+}
+
 void free_table(HashTable *ht) {
     for (int i = 0; i < TABLE_SIZE; i++) {
         KeyNode *keyNode = ht->table[i];
@@ -121,12 +203,118 @@ void free_table(HashTable *ht) {
             free(temp);
         }
     }
+    free_patterns(ht->patterns);
     pthread_rwlock_destroy(&ht->tablelock);
     free(ht);
 }
 
-int add_subscriber(HashTable *ht, const char *key, int notif_fd) {
+// Tells whether a subscription is a prefix pattern.
+// @return Length of the prefix, -1 if key is an exact key.
+static int pattern_prefix_length(const char *key) {
+    size_t len = strlen(key);
+    if (len == 0 || key[len - 1] != PATTERN_WILDCARD) {
+        return -1;
+    }
+    return (int)len - 1;
+}
+
+// Finds the trie node of a prefix.
+// @param create If set, creates the missing nodes on the way.
+// @return The node, NULL if it does not exist or could not be created.
+static PatternNode *find_pattern(HashTable *ht, const char *prefix, size_t len, int create) {
+    PatternNode **node = &ht->patterns;
+    PatternNode *parent = NULL;
+    for (size_t i = 0; ; i++) {
+        if (*node == NULL) {
+            if (!create || (*node = calloc(1, sizeof(PatternNode))) == NULL) {
+                return NULL;
+            }
+            if (parent != NULL) {
+                parent->child_count++;
+            }
+        }
+        if (i == len) {
+            return *node;
+        }
+        parent = *node;
+        node = &(*node)->children[(unsigned char)prefix[i]];
+    }
+}
+
+static int add_pattern_subscriber(HashTable *ht, const char *prefix, size_t len,
+                                  const Subscriber *subscriber) {
+    PatternNode *node = find_pattern(ht, prefix, len, 1);
+    if (node == NULL) {
+        return 0;
+    }
+
+    if (node->subscriber_count == node->subscriber_capacity) {
+        size_t capacity = node->subscriber_capacity == 0 ? 4 : node->subscriber_capacity * 2;
+        Subscriber *subscribers = realloc(node->subscribers, capacity * sizeof(Subscriber));
+        if (subscribers == NULL) {
+            return 0;
+        }
+        node->subscribers = subscribers;
+        node->subscriber_capacity = capacity;
+    }
+    node->subscribers[node->subscriber_count++] = *subscriber;
+    return 1;
+}
+
+static int remove_pattern_subscriber(HashTable *ht, const char *prefix, size_t len, int fd) {
+    // Links to the nodes on the prefix's path, to prune them on the way back
+    PatternNode **path[MAX_STRING_SIZE + 1];
+    if (len > MAX_STRING_SIZE) {
+        return 0;
+    }
+    PatternNode **link = &ht->patterns;
+    for (size_t i = 0; ; i++) {
+        if (*link == NULL) {
+            return 0;
+        }
+        path[i] = link;
+        if (i == len) {
+            break;
+        }
+        link = &(*link)->children[(unsigned char)prefix[i]];
+    }
+
+    PatternNode *node = *link;
+    size_t i = 0;
+    while (i < node->subscriber_count && node->subscribers[i].fd != fd) {
+        i++;
+    }
+    if (i == node->subscriber_count) {
+        return 0;
+    }
+    node->subscribers[i] = node->subscribers[--node->subscriber_count];
+
+    for (size_t depth = len + 1; depth-- > 0;) {
+        node = *path[depth];
+        if (node->subscriber_count > 0 || node->child_count > 0) {
+            break;
+        }
+        free(node->subscribers);
+        free(node);
+        *path[depth] = NULL;
+        if (depth > 0) {
+            (*path[depth - 1])->child_count--;
+        }
+    }
+    return 1;
+}
+
+int add_subscriber(HashTable *ht, const char *key, const Subscriber *subscriber) {
+    int prefix_len = pattern_prefix_length(key);
+    if (prefix_len >= 0) {
+        return add_pattern_subscriber(ht, key, (size_t)prefix_len, subscriber);
+    }
+
     int index = hash(key);
+    if (index < 0) {
+        return 0;
+    }
+    expire_pair(ht, key);
 
     KeyNode *keyNode = ht->table[index];
     KeyNode *previousNode;
@@ -134,8 +322,8 @@ int add_subscriber(HashTable *ht, const char *key, int notif_fd) {
     while (keyNode != NULL) {
         if (strcmp(keyNode->key, key) == 0) {
             for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-                if (keyNode->subscribers[i] == -1) {
-                    keyNode->subscribers[i] = notif_fd;
+                if (keyNode->subscribers[i].fd == -1) {
+                    keyNode->subscribers[i] = *subscriber;
                     return 1;
                 }
             }
@@ -148,7 +336,15 @@ int add_subscriber(HashTable *ht, const char *key, int notif_fd) {
 }
 
 int remove_subscriber(HashTable *ht, const char *key, int fd) {
+    int prefix_len = pattern_prefix_length(key);
+    if (prefix_len >= 0) {
+        return remove_pattern_subscriber(ht, key, (size_t)prefix_len, fd);
+    }
+
     int index = hash(key);
+    if (index < 0) {
+        return 0;
+    }
 
     KeyNode *keyNode = ht->table[index];
     KeyNode *previousNode;
@@ -156,8 +352,8 @@ int remove_subscriber(HashTable *ht, const char *key, int fd) {
     while (keyNode != NULL) {
         if (strcmp(keyNode->key, key) == 0) {
             for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-                if (keyNode->subscribers[i] == fd) {
-                    keyNode->subscribers[i] = -1;
+                if (keyNode->subscribers[i].fd == fd) {
+                    keyNode->subscribers[i].fd = -1;
                     return 1;
                 }
             }
@@ -170,17 +366,123 @@ int remove_subscriber(HashTable *ht, const char *key, int fd) {
 }
 
 
-void notify_subscribers(KeyNode *keyNode, const char *value) {
-    char pair[MAX_STRING_SIZE + 1][MAX_STRING_SIZE + 1] = {{'\0'}};
-    strcpy(pair[0], keyNode->key);
-    strcpy(pair[1], value);
+// A notification, encoded once per protocol version in use.
+typedef struct {
+    change_seq_t seq;
+    const char *key;
+    const char *value;
+    char encoded[PROTOCOL_VERSION + 1][MAX_NOTIFICATION_SIZE];
+    size_t encoded_len[PROTOCOL_VERSION + 1];
+} Notification;
 
-    for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-        if (keyNode->subscribers[i] != -1) {
-            int notif_fd = keyNode->subscribers[i];
-            write_all(notif_fd, &pair[0], MAX_STRING_SIZE + 1);
-            write_all(notif_fd, &pair[1], MAX_STRING_SIZE + 1);
+static void notify_all(Notification *notification, const Subscriber *subscribers, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const Subscriber *subscriber = &subscribers[i];
+        if (subscriber->fd == -1) {
+            continue;
+        }
+        int version = subscriber->version;
+        if (notification->encoded_len[version] == 0) {
+            notification->encoded_len[version] = wire_put_notification(
+                notification->encoded[version], notification->seq, notification->key,
+                notification->value, version);
+        }
+        // Never waits for the client, the notifier thread writes it
+        notif_queue_push(subscriber->queue, notification->key, notification->encoded[version],
+                         notification->encoded_len[version]);
+    }
+}
+
+void notify_subscribers(HashTable *ht, KeyNode *keyNode, const char *value) {
+    hotkeys_record(HOT_NOTIFY, keyNode->key);
+    Change *change = &ht->changes[++ht->seq % CHANGE_LOG_SIZE];
+    change->seq = ht->seq;
+    strncpy(change->key, keyNode->key, MAX_STRING_SIZE);
+    change->key[MAX_STRING_SIZE] = '\0';
+    strncpy(change->value, value, MAX_STRING_SIZE);
+    change->value[MAX_STRING_SIZE] = '\0';
+
+    Notification notification = {
+        .seq = ht->seq, .key = keyNode->key, .value = value, .encoded_len = {0}};
+    notify_all(&notification, keyNode->subscribers, MAX_SESSION_COUNT);
+
+    // Every node on the key's path in the trie is a matching prefix
+    const char *c = keyNode->key;
+    PatternNode *node = ht->patterns;
+    while (node != NULL) {
+        notify_all(&notification, node->subscribers, node->subscriber_count);
+        if (*c == '\0') {
+            break;
+        }
+        node = node->children[(unsigned char)*c++];
+    }
+}
+
+// Tells whether a key is covered by a subscription to a key or pattern.
+static int subscription_matches(const char *subscription, const char *key) {
+    int prefix_len = pattern_prefix_length(subscription);
+    if (prefix_len < 0) {
+        return strcmp(subscription, key) == 0;
+    }
+    return strncmp(subscription, key, (size_t)prefix_len) == 0;
+}
+
+static int matches_any(char keys[][MAX_STRING_SIZE + 1], size_t count, const char *key) {
+    for (size_t i = 0; i < count; i++) {
+        if (subscription_matches(keys[i], key)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int key_exists(HashTable *ht, const char *key) {
+    int index = hash(key);
+    if (index < 0) {
+        return 0;
+    }
+    for (KeyNode *keyNode = ht->table[index]; keyNode != NULL; keyNode = keyNode->next) {
+        if (strcmp(keyNode->key, key) == 0) {
+            return 1;
         }
     }
+    return 0;
 }
 
+int replay_changes(HashTable *ht, char keys[][MAX_STRING_SIZE + 1], size_t count,
+                   change_seq_t seq, const Subscriber *subscriber) {
+    change_seq_t oldest = ht->seq - ht->first_seq > CHANGE_LOG_SIZE
+                              ? ht->seq - CHANGE_LOG_SIZE : ht->first_seq;
+
+    if (seq >= oldest && seq <= ht->seq) {
+        for (change_seq_t s = seq + 1; s <= ht->seq; s++) {
+            Change *change = &ht->changes[s % CHANGE_LOG_SIZE];
+            if (matches_any(keys, count, change->key)) {
+                Notification notification = {
+                    .seq = s, .key = change->key, .value = change->value, .encoded_len = {0}};
+                notify_all(&notification, subscriber, 1);
+            }
+        }
+        return RESUME_REPLAYED;
+    }
+
+    // Too old, or from another run of the server
+    for (size_t i = 0; i < count; i++) {
+        if (pattern_prefix_length(keys[i]) < 0 && !key_exists(ht, keys[i])) {
+            Notification notification = {
+                .seq = ht->seq, .key = keys[i], .value = "DELETED", .encoded_len = {0}};
+            notify_all(&notification, subscriber, 1);
+        }
+    }
+    uint64_t now = ttl_now_ms();
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        for (KeyNode *keyNode = ht->table[i]; keyNode != NULL; keyNode = keyNode->next) {
+            if (!pair_expired(keyNode, now) && matches_any(keys, count, keyNode->key)) {
+                Notification notification = {.seq = ht->seq, .key = keyNode->key,
+                                             .value = keyNode->value, .encoded_len = {0}};
+                notify_all(&notification, subscriber, 1);
+            }
+        }
+    }
+    return RESUME_SNAPSHOT;
+}
@@ -3,19 +3,68 @@
 #define TABLE_SIZE 26
 
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #include "../common/constants.h"
+#include "../common/protocol.h"
+#include "notif_queue.h"
+
+typedef struct Subscriber {
+    int fd;       // notification pipe, -1 if the slot is free
+    int version;  // protocol version the notifications are encoded with
+    notif_queue *queue;  // where the notifications of the session wait
+} Subscriber;
 
 typedef struct KeyNode {
     char *key;
     char *value;
-    int subscribers[MAX_SESSION_COUNT];
+    Subscriber subscribers[MAX_SESSION_COUNT];
+    uint64_t expires_at;  // from ttl_now_ms, 0 if the key does not expire
     struct KeyNode *next;
 } KeyNode;
 
+#define PATTERN_WILDCARD '*'
+#define PATTERN_FANOUT 256  // one child per byte value
+
+// Trie of prefix subscriptions, e.g. "user:*". The subscribers of the node
+// reached by a prefix get notified of every key starting with it, so
+// matching a key costs one step per character, whatever the number of
+// patterns. Nodes left without subscribers nor children are freed.
+typedef struct PatternNode {
+    struct PatternNode *children[PATTERN_FANOUT];
+    size_t child_count;
+    Subscriber *subscribers;
+    size_t subscriber_count;
+    size_t subscriber_capacity;
+} PatternNode;
+
+#define CHANGE_LOG_SIZE 4096  // changes kept for clients that resume
+
+// A write or delete, "DELETED" being the value of a delete.
+typedef struct Change {
+    change_seq_t seq;
+    char key[MAX_STRING_SIZE + 1];
+    char value[MAX_STRING_SIZE + 1];
+} Change;
+
+// Memory held by the keys of a bucket, kept up to date by write_pair and
+// delete_pair so reporting it does not walk the chains.
+typedef struct BucketMemory {
+    size_t nodes;
+    size_t key_bytes;    // key strings, terminators included
+    size_t value_bytes;  // value strings, terminators included
+    size_t allocated;    // what the allocator reserved for nodes, keys and values
+} BucketMemory;
+
 typedef struct HashTable {
     KeyNode *table[TABLE_SIZE];
+    BucketMemory memory[TABLE_SIZE];
+    PatternNode *patterns;  // root of the prefix subscriptions, NULL if none
+    // Last CHANGE_LOG_SIZE changes, change seq being at seq % CHANGE_LOG_SIZE
+    Change changes[CHANGE_LOG_SIZE];
+    change_seq_t first_seq;  // sequence number before the first change
+    change_seq_t seq;  // sequence number of the last change
     pthread_rwlock_t tablelock;
 } HashTable;
 
@@ -23,45 +72,84 @@ typedef struct HashTable {
 /// @return Newly created hash table, NULL on failure
 struct HashTable *create_hash_table();
 
+/// Bucket of a key, from its first character.
+/// @param key The key.
+/// @return Index in the table, -1 if the key does not start with a letter
+///         or a digit. Such keys can not be stored nor subscribed to.
 int hash(const char *key); 
 
 // Writes a key value pair in the hash table.
 // @param ht The hash table.
 // @param key The key.
 // @param value The value.
-// @return 0 if successful.
-int write_pair(HashTable *ht, const char *key, const char *value);
+// @param expires_at When the key expires, from ttl_now_ms, 0 for never.
+// @return 0 if successful, 1 if the key has no bucket (see hash).
+int write_pair(HashTable *ht, const char *key, const char *value, uint64_t expires_at);
 
-// Reads the value of a given key.
+// Reads the value of a given key. An expired key is not found, but is left
+// for the caller to delete with expire_pair, as it may only hold a read lock.
 // @param ht The hash table.
 // @param key The key.
-// return the value if found, NULL otherwise.
-char* read_pair(HashTable *ht, const char *key);
+// @param expired Set to 1 if the key exists but expired, 0 otherwise.
+// return the value if found, NULL otherwise or if the key has no bucket.
+char* read_pair(HashTable *ht, const char *key, char *expired);
 
-/// Deletes a pair from the table.
+/// Deletes a pair from the table. An expired key is deleted as well, but
+/// counts as missing.
 /// @param ht Hash table to read from.
 /// @param key Key of the pair to be deleted.
 /// @return 0 if the node was deleted successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
+/// Tells whether a key expired.
+/// @param keyNode Node of the key.
+/// @param now Current time, from ttl_now_ms.
+/// @return 1 if it did, 0 otherwise.
+int pair_expired(const KeyNode *keyNode, uint64_t now);
+
+/// Deletes a key if it expired, notifying its subscribers as a delete does.
+/// @param ht Hash table.
+/// @param key Key to expire.
+/// @return 1 if the key expired and was deleted, 0 otherwise.
+int expire_pair(HashTable *ht, const char *key);
+
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
 
-/// Adds a subscriber to a key.
+/// Adds a subscriber to a key. A key ending in PATTERN_WILDCARD subscribes to
+/// every key with that prefix, existing or not. An expired key is deleted
+/// and not subscribed to.
 /// @param ht Hash table to add the subscriber.
-/// @param key Key to add the subscriber.
-/// @param notif_fd File descriptor to notify the subscriber.
-int add_subscriber(HashTable *ht, const char *key, int notif_fd);
+/// @param key Key or pattern to add the subscriber.
+/// @param subscriber Where and how to send the notifications.
+/// @return 1 if subscribed, 0 if the key does not exist or has no bucket.
+int add_subscriber(HashTable *ht, const char *key, const Subscriber *subscriber);
 
-/// Removes a subscriber from a key.
+/// Removes a subscriber from a key or pattern.
 /// @param ht Hash table to remove the subscriber.
-/// @param key Key to remove the subscriber.
+/// @param key Key or pattern to remove the subscriber.
 int remove_subscriber(HashTable *ht, const char *key , int fd);
 
-/// Notifies all subscribers of a key.
+/// Records a change of a key in the change log, then notifies all its
+/// subscribers, and those of the patterns matching it. A session gets one
+/// notification per matching subscription.
+/// @param ht Hash table holding the patterns.
 /// @param keyNode Node of the key to notify the subscribers.
 /// @param value Value of updated key or "DELETED" if the key was deleted.
-void notify_subscribers(KeyNode *keyNode, const char *value);
+void notify_subscribers(HashTable *ht, KeyNode *keyNode, const char *value);
+
+/// Sends a subscriber what it missed of some keys or patterns since a
+/// sequence number: the changes after it if the change log still has them
+/// all, otherwise the current value of every matching key, and "DELETED"
+/// for the keys that do not exist.
+/// @param ht Hash table.
+/// @param keys Keys or patterns subscribed.
+/// @param count Number of keys.
+/// @param seq Last sequence number the subscriber saw.
+/// @param subscriber Where and how to send the notifications.
+/// @return RESUME_REPLAYED or RESUME_SNAPSHOT.
+int replay_changes(HashTable *ht, char keys[][MAX_STRING_SIZE + 1], size_t count,
+                   change_seq_t seq, const Subscriber *subscriber);
 
 #endif  // KVS_H
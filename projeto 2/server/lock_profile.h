@@ -0,0 +1,67 @@
+#ifndef KVS_LOCK_PROFILE_H
+#define KVS_LOCK_PROFILE_H
+
+// Lock contention profiling, compiled in with make LOCK_PROFILE=1. Files
+// that include this header then lock through the profiled_* functions,
+// which record for every lock its acquisitions, the contended ones, the
+// time spent waiting and the time it was held. Without LOCK_PROFILE the
+// locks are the plain pthread ones and the macros below do nothing.
+
+#ifdef LOCK_PROFILE
+
+#include <pthread.h>
+
+#define LOCK_PROFILE_SLOTS 512     // distinct locks that can be profiled
+#define LOCK_PROFILE_HELD 64       // locks a thread can hold at once
+#define LOCK_PROFILE_NAME_SIZE 32
+
+/// Names a lock in the report. Unnamed locks are shown by address.
+/// @param lock The lock.
+/// @param name Name of the lock.
+/// @param index Appended to the name when not negative, e.g. for arrays.
+void lock_profile_name(const void *lock, const char *name, int index);
+
+/// Writes the profiled locks to stderr, the most waited for first.
+void lock_profile_report(void);
+
+int profiled_mutex_lock(pthread_mutex_t *mutex);
+int profiled_mutex_unlock(pthread_mutex_t *mutex);
+int profiled_rwlock_rdlock(pthread_rwlock_t *rwlock);
+int profiled_rwlock_wrlock(pthread_rwlock_t *rwlock);
+int profiled_rwlock_unlock(pthread_rwlock_t *rwlock);
+int profiled_rwlock_tryrdlock(pthread_rwlock_t *rwlock);
+int profiled_rwlock_trywrlock(pthread_rwlock_t *rwlock);
+
+/// Blocks on a rwlock that a trylock just found busy, counting the
+/// acquisition as contended without trying the lock again.
+/// @param rwlock The lock.
+/// @return The result of the pthread call.
+int profiled_rwlock_rdlock_busy(pthread_rwlock_t *rwlock);
+int profiled_rwlock_wrlock_busy(pthread_rwlock_t *rwlock);
+
+#define LOCK_PROFILE_NAME(lock, name, index) lock_profile_name(lock, name, index)
+#define LOCK_PROFILE_REPORT() lock_profile_report()
+#define LOCK_PROFILE_RDLOCK_BUSY(rwlock) profiled_rwlock_rdlock_busy(rwlock)
+#define LOCK_PROFILE_WRLOCK_BUSY(rwlock) profiled_rwlock_wrlock_busy(rwlock)
+
+// lock_profile.c itself needs the real functions
+#ifndef LOCK_PROFILE_IMPL
+#define pthread_mutex_lock profiled_mutex_lock
+#define pthread_mutex_unlock profiled_mutex_unlock
+#define pthread_rwlock_rdlock profiled_rwlock_rdlock
+#define pthread_rwlock_wrlock profiled_rwlock_wrlock
+#define pthread_rwlock_unlock profiled_rwlock_unlock
+#define pthread_rwlock_tryrdlock profiled_rwlock_tryrdlock
+#define pthread_rwlock_trywrlock profiled_rwlock_trywrlock
+#endif
+
+#else
+
+#define LOCK_PROFILE_NAME(lock, name, index) ((void)0)
+#define LOCK_PROFILE_REPORT() ((void)0)
+#define LOCK_PROFILE_RDLOCK_BUSY(rwlock) pthread_rwlock_rdlock(rwlock)
+#define LOCK_PROFILE_WRLOCK_BUSY(rwlock) pthread_rwlock_wrlock(rwlock)
+
+#endif  // LOCK_PROFILE
+
+#endif  // KVS_LOCK_PROFILE_H
@@ -15,16 +15,25 @@
 #include "../common/constants.h"
 #include "../common/io.h"
 #include "../common/protocol.h"
+#include "affinity.h"
+#include "backup_stats.h"
 #include "client_util.h"
+#include "hotkeys.h"
 #include "io.h"
+#include "lock_profile.h"
+#include "notif_queue.h"
 #include "operations.h"
 #include "parser.h"
 #include "pthread.h"
+#include "scheduler.h"
+#include "socket_transport.h"
+#include "stats.h"
 
 struct SharedData {
   DIR* dir;
   char* dir_name;
   pthread_mutex_t directory_mutex;
+  job_scheduler scheduler;
 };
 
 struct stat st = {0};
@@ -36,6 +45,27 @@ size_t active_backups = 0;     // Number of active backups
 size_t max_backups;            // Maximum allowed simultaneous backups
 size_t max_threads;            // Maximum allowed simultaneous threads
 char* jobs_directory = NULL;
+static int memory_at_exit = 0;  // -M, print kvs_memory when the server stops
+
+// Reports the memory of the table on stderr.
+static void report_memory(void) {
+  kvs_memory(STDERR_FILENO);
+}
+
+static const char* server_name = NULL;
+
+// Runs once the server is stopped. Removes the register pipe and the
+// socket, so clients do not find a server that is gone, and reports the
+// memory if asked to.
+static void server_exit(void) {
+  if (memory_at_exit) {
+    report_memory();
+  }
+  char server_path[PATH_MAX];
+  snprintf(server_path, PATH_MAX, "/tmp/al97_reg_%s", server_name);
+  unlink(server_path);
+  socket_unlink(server_name);
+}
 
 int filter_job_files(const struct dirent* entry) {
     const char* dot = strrchr(entry->d_name, '.');
@@ -66,25 +96,33 @@ static int entry_files(const char* dir, struct dirent* entry, char* in_path, cha
   return 0;
 }
 
-static int run_job(int in_fd, int out_fd, char* filename) {
-  size_t file_backups = 0;
+// Runs a job until it ends or reaches a WAIT, in which case the job is
+// returned as JOB_PARKED so the worker can move on to other jobs.
+static int run_job(job_t* job) {
+  int in_fd = job->in_fd;
+  int out_fd = job->out_fd;
   while (1) {
     char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
     char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
     unsigned int delay;
+    unsigned int ttl_ms;
     size_t num_pairs;
+    uint64_t start;
 
     switch (get_next(in_fd)) {
       case CMD_WRITE:
-        num_pairs = parse_write(in_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+        num_pairs = parse_write_ttl(in_fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE,
+                                    &ttl_ms);
         if (num_pairs == 0) {
           write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
           continue;
         }
 
-        if (kvs_write(num_pairs, keys, values)) {
+        start = stats_now();
+        if (kvs_write_ttl(num_pairs, keys, values, ttl_ms)) {
           write_str(STDERR_FILENO, "Failed to write pair\n");
         }
+        stats_record(STAT_WRITE, start);
         break;
 
       case CMD_READ:
@@ -95,9 +133,11 @@ static int run_job(int in_fd, int out_fd, char* filename) {
           continue;
         }
 
+        start = stats_now();
         if (kvs_read(num_pairs, keys, out_fd)) {
           write_str(STDERR_FILENO, "Failed to read pair\n");
         }
+        stats_record(STAT_READ, start);
         break;
 
       case CMD_DELETE:
@@ -108,13 +148,17 @@ static int run_job(int in_fd, int out_fd, char* filename) {
           continue;
         }
 
+        start = stats_now();
         if (kvs_delete(num_pairs, keys, out_fd)) {
           write_str(STDERR_FILENO, "Failed to delete pair\n");
         }
+        stats_record(STAT_DELETE, start);
         break;
 
       case CMD_SHOW:
+        start = stats_now();
         kvs_show(out_fd);
+        stats_record(STAT_SHOW, start);
         break;
 
       case CMD_WAIT:
@@ -125,24 +169,44 @@ static int run_job(int in_fd, int out_fd, char* filename) {
 
         if (delay > 0) {
           printf("Waiting %d seconds\n", delay / 1000);
-          kvs_wait(delay);
+          sched_set_delay(job, delay);
+          return JOB_PARKED;
         }
         break;
 
       case CMD_BACKUP:
         pthread_mutex_lock(&n_current_backups_lock);
         if (active_backups >= max_backups) {
-          wait(NULL);
+          backup_stats_reaped(wait(NULL));
         } else {
           active_backups++;
         }
         pthread_mutex_unlock(&n_current_backups_lock);
-        int aux = kvs_backup(++file_backups, filename, jobs_directory);
+        start = stats_now();
+        int aux = kvs_backup(++job->file_backups, job->filename, jobs_directory);
+        stats_record(STAT_BACKUP, start);
 
         if (aux < 0) {
             write_str(STDERR_FILENO, "Failed to do backup\n");
         } else if (aux == 1) {
-          return 1;
+          return JOB_ABORT;
+        }
+        break;
+
+      case CMD_STATS:
+        backup_stats_collect();
+        if (stats_write(out_fd)) {
+          write_str(STDERR_FILENO, "Failed to write statistics\n");
+        }
+        break;
+
+      case CMD_STATS_MEMORY:
+        kvs_memory(out_fd);
+        break;
+
+      case CMD_HOTKEYS:
+        if (hotkeys_write(out_fd)) {
+          write_str(STDERR_FILENO, "Failed to write hot keys\n");
         }
         break;
 
@@ -153,12 +217,14 @@ static int run_job(int in_fd, int out_fd, char* filename) {
       case CMD_HELP:
         write_str(STDOUT_FILENO,
             "Available commands:\n"
-            "  WRITE [(key,value)(key2,value2),...]\n"
+            "  WRITE [TTL <ttl_ms>] [(key,value)(key2,value2),...]\n"
             "  READ [key,key2,...]\n"
             "  DELETE [key,key2,...]\n"
             "  SHOW\n"
             "  WAIT <delay_ms>\n"
             "  BACKUP\n" 
+            "  STATS [MEMORY]\n"
+            "  HOTKEYS\n"
             "  HELP\n");
 
         break;
@@ -168,16 +234,87 @@ static int run_job(int in_fd, int out_fd, char* filename) {
 
       case EOC:
         printf("EOF\n");
-        return 0;
+        return JOB_FINISHED;
+    }
+  }
+}
+
+// Opens the next .job file of the directory.
+// @return The opened job, NULL once the directory has no more jobs.
+static job_t* open_next_job(struct SharedData* thread_data) {
+  struct dirent* entry;
+  char in_path[MAX_JOB_FILE_NAME_SIZE], out_path[MAX_JOB_FILE_NAME_SIZE];
+
+  if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
+    fprintf(stderr, "Thread failed to lock directory_mutex\n");
+    return NULL;
+  }
+
+  while ((entry = readdir(thread_data->dir)) != NULL) {
+    if (entry_files(thread_data->dir_name, entry, in_path, out_path) == 0) {
+      break;
     }
   }
+
+  if (entry == NULL) {
+    pthread_mutex_unlock(&thread_data->directory_mutex);
+    return NULL;
+  }
+
+  // The dirent may be overwritten by the next readdir, keep the name
+  job_t* job = safe_malloc(sizeof(job_t));
+  strncpy(job->filename, entry->d_name, MAX_JOB_FILE_NAME_SIZE - 1);
+  job->filename[MAX_JOB_FILE_NAME_SIZE - 1] = '\0';
+  job->file_backups = 0;
+  sched_job_started(&thread_data->scheduler);
+
+  if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
+    fprintf(stderr, "Thread failed to unlock directory_mutex\n");
+    return NULL;
+  }
+
+  job->in_fd = open(in_path, O_RDONLY);
+  if (job->in_fd == -1) {
+    write_str(STDERR_FILENO, "Failed to open input file: ");
+    write_str(STDERR_FILENO, in_path);
+    write_str(STDERR_FILENO, "\n");
+    free(job);
+    sched_job_finished(&thread_data->scheduler);
+    return open_next_job(thread_data);
+  }
+
+  job->out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (job->out_fd == -1) {
+    write_str(STDERR_FILENO, "Failed to open output file: ");
+    write_str(STDERR_FILENO, out_path);
+    write_str(STDERR_FILENO, "\n");
+    close(job->in_fd);
+    free(job);
+    sched_job_finished(&thread_data->scheduler);
+    return open_next_job(thread_data);
+  }
+
+  return job;
+}
+
+// Picks the next job to run: parked jobs that are due first, then new files
+// from the directory and, once it is exhausted, waits for parked jobs.
+static job_t* next_job(struct SharedData* thread_data) {
+  job_t* job = sched_poll(&thread_data->scheduler);
+  if (job != NULL) {
+    return job;
+  }
+
+  job = open_next_job(thread_data);
+  if (job != NULL) {
+    return job;
+  }
+
+  return sched_wait(&thread_data->scheduler);
 }
 
-//frees arguments
 static void* get_file(void* arguments) {
   struct SharedData* thread_data = (struct SharedData*) arguments;
-  DIR* dir = thread_data->dir;
-  char* dir_name = thread_data->dir_name;
 
   sigset_t set;
   sigemptyset(&set);
@@ -186,63 +323,30 @@ static void* get_file(void* arguments) {
     fprintf(stderr, "Failed to block SIGUSR1\n");
     exit(1);
   }
+  affinity_apply(AFFINITY_JOBS, "job worker");
 
-  if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
-    fprintf(stderr, "Thread failed to lock directory_mutex\n");
-    return NULL;
-  }
+  job_t* job;
+  while ((job = next_job(thread_data)) != NULL) {
+    int out = run_job(job);
 
-  struct dirent* entry;
-  char in_path[MAX_JOB_FILE_NAME_SIZE], out_path[MAX_JOB_FILE_NAME_SIZE];
-  while ((entry = readdir(dir)) != NULL) {
-    if (entry_files(dir_name, entry, in_path, out_path)) {
+    if (out == JOB_PARKED) {
+      sched_park(&thread_data->scheduler, job);
       continue;
     }
 
-    if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
-      fprintf(stderr, "Thread failed to unlock directory_mutex\n");
-      return NULL;
-    }
-
-    int in_fd = open(in_path, O_RDONLY);
-    if (in_fd == -1) {
-      write_str(STDERR_FILENO, "Failed to open input file: ");
-      write_str(STDERR_FILENO, in_path);
-      write_str(STDERR_FILENO, "\n");
-      pthread_exit(NULL);
-    }
-
-    int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (out_fd == -1) {
-      write_str(STDERR_FILENO, "Failed to open output file: ");
-      write_str(STDERR_FILENO, out_path);
-      write_str(STDERR_FILENO, "\n");
-      pthread_exit(NULL);
-    }
-
-    int out = run_job(in_fd, out_fd, entry->d_name);
+    close(job->in_fd);
+    close(job->out_fd);
+    free(job);
+    sched_job_finished(&thread_data->scheduler);
 
-    close(in_fd);
-    close(out_fd);
-
-    if (out) {
-      if (closedir(dir) == -1) {
+    if (out == JOB_ABORT) {
+      if (closedir(thread_data->dir) == -1) {
         fprintf(stderr, "Failed to close directory\n");
         return 0;
       }
 
       exit(0);
     }
-
-    if (pthread_mutex_lock(&thread_data->directory_mutex) != 0) {
-      fprintf(stderr, "Thread failed to lock directory_mutex\n");
-      return NULL;
-    }
-  }
-
-  if (pthread_mutex_unlock(&thread_data->directory_mutex) != 0) {
-    fprintf(stderr, "Thread failed to unlock directory_mutex\n");
-    return NULL;
   }
 
   pthread_exit(NULL);
@@ -257,7 +361,14 @@ static void dispatch_threads(DIR* dir, char* server_pathname) {
     return;
   }
 
-  struct SharedData thread_data = {dir, jobs_directory, PTHREAD_MUTEX_INITIALIZER};
+  struct SharedData thread_data = {.dir = dir, .dir_name = jobs_directory,
+                                   .directory_mutex = PTHREAD_MUTEX_INITIALIZER};
+  LOCK_PROFILE_NAME(&thread_data.directory_mutex, "directory_mutex", -1);
+  if (sched_init(&thread_data.scheduler) != 0) {
+    fprintf(stderr, "Failed to initialize job scheduler\n");
+    free(threads);
+    return;
+  }
 
   for (size_t i = 0; i < max_threads; i++) {
     if (pthread_create(&threads[i], NULL, get_file, (void*)&thread_data) != 0) {
@@ -280,6 +391,10 @@ static void dispatch_threads(DIR* dir, char* server_pathname) {
   pool_args *pool = safe_malloc(sizeof(pool_args));
   pool->server_fd = server_fd;
   pool->max_clients = MAX_SESSION_COUNT;
+  pool->socket_fd = socket_listen(server_pathname);
+  if (pool->socket_fd < 0) {
+    fprintf(stderr, "Socket transport unavailable, serving the pipes only\n");
+  }
 
   client_pool_manager(pool);
 
@@ -295,11 +410,84 @@ static void dispatch_threads(DIR* dir, char* server_pathname) {
   if (pthread_mutex_destroy(&thread_data.directory_mutex) != 0) {
     fprintf(stderr, "Failed to destroy directory_mutex\n");
   }
+  sched_destroy(&thread_data.scheduler);
 
   free(threads);
 }
 
 
+// Parses the optional command line flags.
+// @return 0 on success, 1 on an invalid option.
+static int parse_options(int argc, char** argv) {
+  int opt;
+  char* endptr;
+
+  while ((opt = getopt(argc, argv, "e:q:j:s:b:n:p:M")) != -1) {
+    switch (opt) {
+      case 'e': {
+        long threads = strtol(optarg, &endptr, 10);
+        if (*endptr != '\0' || threads < 0) {
+          fprintf(stderr, "Invalid event_loop_threads value\n");
+          return 1;
+        }
+        set_event_loop_threads((int)threads);
+        break;
+      }
+      case 'q': {
+        unsigned long depth = strtoul(optarg, &endptr, 10);
+        if (*endptr != '\0' || depth == 0) {
+          fprintf(stderr, "Invalid connection queue depth\n");
+          return 1;
+        }
+        set_conn_queue_depth(depth);
+        break;
+      }
+      case 'n': {
+        unsigned long depth = strtoul(optarg, &endptr, 10);
+        if (*endptr != '\0' || depth < MIN_NOTIF_QUEUE_DEPTH) {
+          fprintf(stderr, "Invalid notification queue depth\n");
+          return 1;
+        }
+        notif_queue_set_depth(depth);
+        break;
+      }
+      case 'p':
+        if (strcmp(optarg, "drop") == 0) {
+          notif_queue_set_policy(NOTIF_DROP_OLDEST);
+        } else if (strcmp(optarg, "coalesce") == 0) {
+          notif_queue_set_policy(NOTIF_COALESCE);
+        } else if (strcmp(optarg, "disconnect") == 0) {
+          notif_queue_set_policy(NOTIF_DISCONNECT);
+        } else {
+          fprintf(stderr, "Invalid notification queue policy: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'j':
+        if (affinity_set_role(AFFINITY_JOBS, optarg) != 0) {
+          return 1;
+        }
+        break;
+      case 's':
+        if (affinity_set_role(AFFINITY_SESSIONS, optarg) != 0) {
+          return 1;
+        }
+        break;
+      case 'b':
+        if (affinity_set_role(AFFINITY_AUX, optarg) != 0) {
+          return 1;
+        }
+        break;
+      case 'M':
+        memory_at_exit = 1;
+        break;
+      default:
+        return 1;
+    }
+  }
+  return 0;
+}
+
 int main(int argc, char** argv) {
   struct sigaction sa;
   memset(&sa, 0, sizeof(sa));
@@ -313,15 +501,21 @@ int main(int argc, char** argv) {
 
   sa.sa_flags = SA_RESTART;  
 
-  if (argc < 5) {
+  if (parse_options(argc, argv) != 0 || argc - optind < 4) {
     write_str(STDERR_FILENO, "Usage: ");
     write_str(STDERR_FILENO, argv[0]);
+    write_str(STDERR_FILENO, " [-e event_loop_threads] [-q conn_queue_depth]");
+    write_str(STDERR_FILENO, " [-j job_cpus] [-s session_cpus] [-b backup_cpus]");
+    write_str(STDERR_FILENO, " [-n notif_queue_depth] [-p drop|coalesce|disconnect] [-M]");
     write_str(STDERR_FILENO, " <jobs_dir>");
 		write_str(STDERR_FILENO, " <max_threads>");
 		write_str(STDERR_FILENO, " <max_backups>");
     write_str(STDERR_FILENO, " server_fifo_name\n");
     return 1;
   }
+  // glibc getopt moves the options in front of the positionals wherever they
+  // were given, so the positionals start at optind either way
+  argv += optind - 1;
 
   jobs_directory = argv[1];
 
@@ -350,10 +544,17 @@ int main(int argc, char** argv) {
 		return 0;
 	}
 
+  // Before any other thread, so they all leave SIGUSR2 to the dumper
+  server_name = argv[4];
+  if (stats_start(argv[4], server_exit)) {
+    return 1;
+  }
+
   if (kvs_init()) {
     write_str(STDERR_FILENO, "Failed to initialize KVS\n");
     return 1;
   }
+  LOCK_PROFILE_NAME(&n_current_backups_lock, "n_current_backups_lock", -1);
 
   DIR* dir = opendir(argv[1]);
   if (dir == NULL) {
@@ -371,11 +572,14 @@ int main(int argc, char** argv) {
   }
 
   while (active_backups > 0) {
-    wait(NULL);
+    backup_stats_reaped(wait(NULL));
     active_backups--;
   }
+  backup_stats_collect();
 
+  server_exit();
   kvs_terminate();
+  LOCK_PROFILE_REPORT();
 
   return 0;
 }
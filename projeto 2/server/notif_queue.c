@@ -0,0 +1,406 @@
+#define _GNU_SOURCE
+#include "notif_queue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "affinity.h"
+
+#define INITIAL_QUEUE_CAPACITY 16
+#define RING_RETRY_MS 10  // a ring cannot be polled for space
+#define RING_MAX_RETRY_MS 1000  // while no ring reader takes anything
+
+static size_t queue_depth = DEFAULT_NOTIF_QUEUE_DEPTH;
+static notif_policy queue_policy = NOTIF_COALESCE;
+
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static notif_queue *ready = NULL;  // queues the notifier has not seen yet
+static int wake_fd = -1;
+static pthread_t notifier_thread;
+
+void notif_queue_set_depth(size_t depth) {
+  queue_depth = depth;
+}
+
+void notif_queue_set_policy(notif_policy policy) {
+  queue_policy = policy;
+}
+
+int notif_queue_init(notif_queue *queue) {
+  memset(queue, 0, sizeof(notif_queue));
+  queue->fd = -1;
+  return pthread_mutex_init(&queue->lock, NULL) != 0;
+}
+
+int notif_queue_open(notif_queue *queue, int fd, int is_socket) {
+  // A socket also carries the replies, each send asks not to block instead
+  int flags = fcntl(fd, F_GETFL);
+  if (!is_socket && (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)) {
+    return 1;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  queue->fd = fd;
+  queue->is_socket = is_socket;
+  queue->ring = NULL;
+  queue->overflowed = 0;
+  queue->dropped = 0;
+  queue->coalesced = 0;
+  pthread_mutex_unlock(&queue->lock);
+  return 0;
+}
+
+void notif_queue_set_ring(notif_queue *queue, notif_ring *ring) {
+  pthread_mutex_lock(&queue->lock);
+  queue->ring = ring;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+// Must be called with queue->lock held.
+static void discard_all(notif_queue *queue) {
+  free(queue->items);
+  queue->items = NULL;
+  queue->capacity = 0;
+  queue->head = 0;
+  queue->count = 0;
+  queue->written = 0;
+}
+
+void notif_queue_close(notif_queue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  discard_all(queue);
+  queue->fd = -1;
+  queue->ring = NULL;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static queued_notification *item_at(notif_queue *queue, size_t i) {
+  return &queue->items[(queue->head + i) % queue->capacity];
+}
+
+// Makes room for one more notification, growing the ring up to the depth.
+// @return 0 on success, 1 if the queue is full.
+static int reserve(notif_queue *queue) {
+  if (queue->count < queue->capacity) {
+    return 0;
+  }
+  if (queue->capacity >= queue_depth) {
+    return 1;
+  }
+
+  size_t capacity = queue->capacity == 0 ? INITIAL_QUEUE_CAPACITY : queue->capacity * 2;
+  if (capacity > queue_depth) {
+    capacity = queue_depth;
+  }
+  queued_notification *items = malloc(capacity * sizeof(queued_notification));
+  if (items == NULL) {
+    return 1;
+  }
+
+  // Unwrapped, oldest first
+  for (size_t i = 0; i < queue->count; i++) {
+    items[i] = *item_at(queue, i);
+  }
+  free(queue->items);
+  queue->items = items;
+  queue->capacity = capacity;
+  queue->head = 0;
+  return 0;
+}
+
+// Drops the oldest notification that is not being written.
+static void drop_oldest(notif_queue *queue) {
+  if (queue->written > 0) {
+    // The one being written has to be finished, the next one goes instead
+    *item_at(queue, 1) = *item_at(queue, 0);
+  }
+  queue->head = (queue->head + 1) % queue->capacity;
+  queue->count--;
+  queue->dropped++;
+}
+
+// Removes the newest queued notification of a key and appends the new one,
+// so the notifications still go out in the order of the changes.
+// @return 1 if the key had a notification queued, 0 otherwise.
+static int coalesce(notif_queue *queue, const char *key, const char *data, size_t len) {
+  size_t first = queue->written > 0 ? 1 : 0;
+  size_t i = queue->count;
+  while (i > first && strcmp(item_at(queue, i - 1)->key, key) != 0) {
+    i--;
+  }
+  if (i == first) {
+    return 0;
+  }
+
+  for (i--; i + 1 < queue->count; i++) {
+    *item_at(queue, i) = *item_at(queue, i + 1);
+  }
+  queued_notification *item = item_at(queue, queue->count - 1);
+  memcpy(item->data, data, len);
+  item->len = len;
+  queue->coalesced++;
+  return 1;
+}
+
+// Gives up on a session that fell too far behind. Its client sees the end
+// of the notifications and leaves.
+static void overflow(notif_queue *queue) {
+  discard_all(queue);
+  queue->overflowed = 1;
+  if (queue->ring != NULL) {
+    notif_ring_close(queue->ring);
+    return;
+  }
+  if (queue->is_socket) {
+    shutdown(queue->fd, SHUT_RDWR);
+    return;
+  }
+
+  // The descriptor stays valid until the session ends and closes it
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd != -1) {
+    dup2(null_fd, queue->fd);
+    close(null_fd);
+  }
+}
+
+void notif_queue_push(notif_queue *queue, const char *key, const char *data, size_t len) {
+  pthread_mutex_lock(&queue->lock);
+  if (queue->fd == -1 || queue->overflowed) {
+    pthread_mutex_unlock(&queue->lock);
+    return;
+  }
+
+  if (reserve(queue) != 0) {
+    if (queue->count == 0) {
+      // Out of memory for even one
+      queue->dropped++;
+      pthread_mutex_unlock(&queue->lock);
+      return;
+    }
+    if (queue_policy == NOTIF_DISCONNECT) {
+      overflow(queue);
+      pthread_mutex_unlock(&queue->lock);
+      return;
+    }
+    if (queue_policy == NOTIF_COALESCE && coalesce(queue, key, data, len)) {
+      pthread_mutex_unlock(&queue->lock);
+      return;
+    }
+    drop_oldest(queue);
+  }
+
+  int was_empty = queue->count == 0;
+  queued_notification *item = item_at(queue, queue->count++);
+  strncpy(item->key, key, MAX_STRING_SIZE);
+  item->key[MAX_STRING_SIZE] = '\0';
+  memcpy(item->data, data, len);
+  item->len = len;
+
+  if (!queue->scheduled) {
+    queue->scheduled = 1;
+    pthread_mutex_lock(&ready_lock);
+    queue->next = ready;
+    ready = queue;
+    pthread_mutex_unlock(&ready_lock);
+  }
+  // A queue the notifier already holds is only retried when it wakes up
+  if (was_empty) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+      perror("Failed to wake the notifier");
+    }
+  }
+  pthread_mutex_unlock(&queue->lock);
+}
+
+// Sends queued notifications to a socket, one record each and up to
+// SOCKET_BATCH of them per call.
+// @return Number of notifications sent, -1 on failure.
+static int send_records(notif_queue *queue) {
+  static const char marker = OP_NOTIFICATION;
+  struct mmsghdr messages[SOCKET_BATCH];
+  struct iovec iov[SOCKET_BATCH][2];
+  unsigned int count = queue->count < SOCKET_BATCH ? (unsigned int)queue->count : SOCKET_BATCH;
+
+  memset(messages, 0, sizeof(messages));
+  for (unsigned int i = 0; i < count; i++) {
+    queued_notification *item = item_at(queue, i);
+    iov[i][0].iov_base = (void *)&marker;
+    iov[i][0].iov_len = 1;
+    iov[i][1].iov_base = item->data;
+    iov[i][1].iov_len = item->len;
+    messages[i].msg_hdr.msg_iov = iov[i];
+    messages[i].msg_hdr.msg_iovlen = 2;
+  }
+  return sendmmsg(queue->fd, messages, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// Writes as much of a queue as its client takes without blocking.
+// @param ring_full Set if a shared memory ring had no room.
+// @param ring_progress Set if something was written to a shared memory ring.
+// @return 1 if notifications are left, 0 once the queue is empty.
+static int flush(notif_queue *queue, int *ring_full, int *ring_progress) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count > 0) {
+    queued_notification *item = item_at(queue, 0);
+    if (queue->ring != NULL) {
+      if (notif_ring_try_write(queue->ring, item->data, item->len) != 1) {
+        *ring_full = 1;
+        break;
+      }
+      *ring_progress = 1;
+    } else if (queue->is_socket) {
+      int sent = send_records(queue);
+      if (sent == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          discard_all(queue);
+        }
+        break;
+      }
+      queue->head = (queue->head + (size_t)sent) % queue->capacity;
+      queue->count -= (size_t)sent;
+      continue;
+    } else {
+      ssize_t n = write(queue->fd, item->data + queue->written, item->len - queue->written);
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          // The client is gone, its session ends when the request pipe closes
+          discard_all(queue);
+        }
+        break;
+      }
+      queue->written += (size_t)n;
+      if (queue->written < item->len) {
+        continue;
+      }
+    }
+    queue->written = 0;
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+  }
+
+  int left = queue->count > 0;
+  if (!left) {
+    queue->scheduled = 0;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return left;
+}
+
+static void *notifier(void *arg) {
+  (void)arg;
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR1\n");
+    exit(1);
+  }
+  affinity_apply(AFFINITY_AUX, "notifier");
+
+  notif_queue *blocked = NULL;  // queues whose client is not reading
+  struct pollfd *fds = NULL;
+  size_t fds_capacity = 0;
+  int ring_full = 0;
+  int ring_retry_ms = RING_RETRY_MS;
+
+  while (1) {
+    // Waits for new notifications, or for a blocked client to take more
+    size_t nfds = 1;
+    for (notif_queue *queue = blocked; queue != NULL; queue = queue->next) {
+      nfds++;
+    }
+    if (nfds > fds_capacity) {
+      fds_capacity = nfds * 2;
+      fds = realloc(fds, fds_capacity * sizeof(struct pollfd));
+      if (fds == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(1);
+      }
+    }
+    fds[0].fd = wake_fd;
+    fds[0].events = POLLIN;
+    nfds = 1;
+    for (notif_queue *queue = blocked; queue != NULL; queue = queue->next) {
+      pthread_mutex_lock(&queue->lock);
+      if (queue->ring == NULL && queue->fd != -1) {
+        fds[nfds].fd = queue->fd;
+        fds[nfds].events = POLLOUT;
+        nfds++;
+      }
+      pthread_mutex_unlock(&queue->lock);
+    }
+
+    if (poll(fds, (nfds_t)nfds, ring_full ? ring_retry_ms : -1) == -1 && errno != EINTR) {
+      perror("poll");
+      exit(1);
+    }
+    uint64_t wakes;
+    if ((fds[0].revents & POLLIN) && read(wake_fd, &wakes, sizeof(wakes)) == -1 &&
+        errno != EAGAIN) {
+      perror("Failed to read the notifier wake counter");
+    }
+
+    pthread_mutex_lock(&ready_lock);
+    notif_queue *pending = ready;
+    ready = NULL;
+    pthread_mutex_unlock(&ready_lock);
+
+    // Blocked queues are retried too, those that are still full stay blocked
+    while (blocked != NULL) {
+      notif_queue *queue = blocked;
+      blocked = queue->next;
+      queue->next = pending;
+      pending = queue;
+    }
+
+    ring_full = 0;
+    int ring_progress = 0;
+    while (pending != NULL) {
+      notif_queue *queue = pending;
+      pending = queue->next;
+      if (flush(queue, &ring_full, &ring_progress)) {
+        queue->next = blocked;
+        blocked = queue;
+      }
+    }
+
+    // A ring reader that stopped taking notifications is retried less and
+    // less often, its queue meanwhile follows the policy like any other
+    if (ring_progress || !ring_full) {
+      ring_retry_ms = RING_RETRY_MS;
+    } else if (ring_retry_ms < RING_MAX_RETRY_MS) {
+      ring_retry_ms = ring_retry_ms * 2 < RING_MAX_RETRY_MS ? ring_retry_ms * 2 : RING_MAX_RETRY_MS;
+    }
+  }
+  return NULL;
+}
+
+int notifier_start(void) {
+  wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wake_fd == -1) {
+    perror("eventfd");
+    return 1;
+  }
+  if (pthread_create(&notifier_thread, NULL, notifier, NULL) != 0) {
+    fprintf(stderr, "Failed to create the notifier thread\n");
+    return 1;
+  }
+  return 0;
+}
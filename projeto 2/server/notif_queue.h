@@ -0,0 +1,92 @@
+#ifndef KVS_NOTIF_QUEUE_H
+#define KVS_NOTIF_QUEUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "../common/constants.h"
+#include "../common/notif_ring.h"
+#include "../common/wire.h"
+
+#define DEFAULT_NOTIF_QUEUE_DEPTH 4096  // enough for a full OP_RESUME replay
+#define MIN_NOTIF_QUEUE_DEPTH 2
+
+// What happens to a notification sent to a session whose queue is full
+typedef enum {
+  NOTIF_DROP_OLDEST,  // the oldest queued notification is dropped
+  NOTIF_COALESCE,     // it replaces the queued one of the same key, if any,
+                      // otherwise the oldest is dropped
+  NOTIF_DISCONNECT    // the notifications of the session are closed
+} notif_policy;
+
+typedef struct {
+  char key[MAX_STRING_SIZE + 1];
+  size_t len;
+  char data[MAX_NOTIFICATION_SIZE];  // already encoded for the session
+} queued_notification;
+
+// Notifications on their way to a session. Writers never wait for the
+// client: they only queue, and the notifier thread writes them without
+// blocking, so a client that stops reading only fills its own queue. The
+// policy applies the same whether the client reads a pipe, a socket or a
+// shared memory ring.
+typedef struct notif_queue {
+  pthread_mutex_t lock;
+  queued_notification *items;  // ring, grown on demand up to the depth
+  size_t capacity;
+  size_t head;
+  size_t count;
+  size_t written;  // bytes of the oldest notification already sent
+  int fd;  // notifications pipe, -1 while the session is closed
+  int is_socket;  // fd is the session's socket, see SOCKET_PATH_PREFIX
+  notif_ring *ring;  // used instead of fd, if set
+  int overflowed;  // closed by NOTIF_DISCONNECT
+  int scheduled;  // held by the notifier until the queue is empty
+  unsigned long dropped;
+  unsigned long coalesced;
+  struct notif_queue *next;  // in the notifier's lists
+} notif_queue;
+
+/// Sets the number of notifications a session can have queued.
+/// @param depth At least MIN_NOTIF_QUEUE_DEPTH.
+void notif_queue_set_depth(size_t depth);
+
+/// Sets what happens once a session's queue is full.
+/// @param policy Policy for every session.
+void notif_queue_set_policy(notif_policy policy);
+
+/// Initializes an unused queue, once.
+/// @param queue Queue to initialize.
+/// @return 0 on success, 1 otherwise.
+int notif_queue_init(notif_queue *queue);
+
+/// Starts sending the notifications of a new session.
+/// @param queue Queue of the session.
+/// @param fd Notifications pipe of the session, made non-blocking, or its
+///        socket, which is left as it is.
+/// @param is_socket Whether fd is a socket.
+/// @return 0 on success, 1 if fd could not be made non-blocking.
+int notif_queue_open(notif_queue *queue, int fd, int is_socket);
+
+/// Sends the notifications queued from now on through a shared memory ring.
+/// @param queue Queue of the session.
+/// @param ring Ring to write to.
+void notif_queue_set_ring(notif_queue *queue, notif_ring *ring);
+
+/// Stops sending notifications to a session, discarding those still
+/// queued. Must be called before the pipe or the ring are closed.
+/// @param queue Queue of the session.
+void notif_queue_close(notif_queue *queue);
+
+/// Queues a notification, applying the policy if the queue is full.
+/// @param queue Queue of the session.
+/// @param key Key the notification is about.
+/// @param data Encoded notification.
+/// @param len Size of the encoded notification.
+void notif_queue_push(notif_queue *queue, const char *key, const char *data, size_t len);
+
+/// Starts the thread that writes the queued notifications.
+/// @return 0 on success, 1 otherwise.
+int notifier_start(void);
+
+#endif  // KVS_NOTIF_QUEUE_H
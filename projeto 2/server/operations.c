@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,13 +7,22 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "affinity.h"
+#include "backup_stats.h"
 #include "constants.h"
+#include "hotkeys.h"
 #include "io.h"
 #include "kvs.h"
+#include "lock_profile.h"
 #include "operations.h"
+#include "stats.h"
+#include "ttl_wheel.h"
 
 static struct HashTable *kvs_table = NULL;
 
+static pthread_t expiry_thread;
+static int expiry_stop = 0;
+
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
 /// @return Timespec with the given delay.
@@ -20,6 +30,39 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
+// Deletes the keys whose TTL ran out, at most TTL_EXPIRE_BUDGET per tick so
+// many keys expiring at once are spread over several ticks rather than
+// holding the table lock in one go.
+static void *expire_keys(void *arg) {
+  (void)arg;
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR1\n");
+    exit(1);
+  }
+  affinity_apply(AFFINITY_AUX, "expiry");
+  struct timespec tick = delay_to_timespec(TTL_TICK_MS);
+  char keys[TTL_EXPIRE_BUDGET][MAX_STRING_SIZE];
+
+  while (!__atomic_load_n(&expiry_stop, __ATOMIC_ACQUIRE)) {
+    nanosleep(&tick, NULL);
+    size_t count = ttl_wheel_due(ttl_now_ms(), keys, TTL_EXPIRE_BUDGET);
+    if (count == 0) {
+      continue;
+    }
+
+    pthread_rwlock_wrlock(&kvs_table->tablelock);
+    for (size_t i = 0; i < count; i++) {
+      // Rewritten or deleted keys are not expired
+      expire_pair(kvs_table, keys[i]);
+    }
+    pthread_rwlock_unlock(&kvs_table->tablelock);
+  }
+  return NULL;
+}
+
 int kvs_init() {
   if (kvs_table != NULL) {
     fprintf(stderr, "KVS state has already been initialized\n");
@@ -27,7 +70,17 @@ int kvs_init() {
   }
 
   kvs_table = create_hash_table();
-  return kvs_table == NULL;
+  if (kvs_table == NULL) {
+    return 1;
+  }
+  LOCK_PROFILE_NAME(&kvs_table->tablelock, "tablelock", -1);
+
+  ttl_wheel_init();
+  if (pthread_create(&expiry_thread, NULL, expire_keys, NULL) != 0) {
+    fprintf(stderr, "Failed to create the expiry thread\n");
+    return 1;
+  }
+  return backup_stats_init();
 }
 
 int kvs_terminate() {
@@ -36,6 +89,10 @@ int kvs_terminate() {
     return 1;
   }
 
+  __atomic_store_n(&expiry_stop, 1, __ATOMIC_RELEASE);
+  pthread_join(expiry_thread, NULL);
+  ttl_wheel_free();
+
   free_table(kvs_table);
   kvs_table = NULL;
   return 0;
@@ -53,26 +110,56 @@ int is_last_change(char *key, char keys[][MAX_STRING_SIZE], size_t num_pairs,
 
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
               char values[][MAX_STRING_SIZE]) {
+  return kvs_write_ttl(num_pairs, keys, values, 0);
+}
+
+int kvs_write_ttl(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                  char values[][MAX_STRING_SIZE], unsigned int ttl_ms) {
+  if (num_pairs > MAX_WRITE_SIZE) {
+    fprintf(stderr, "Too many pairs to write at once\n");
+    return 1;
+  }
+
+  char failed[MAX_WRITE_SIZE];
+  if (kvs_write_keys(num_pairs, keys, values, ttl_ms, failed) != 0) {
+    return 1;
+  }
+  for (size_t i = 0; i < num_pairs; i++) {
+    if (failed[i]) {
+      fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
+    }
+  }
+  return 0;
+}
+
+int kvs_write_keys(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                   char values[][MAX_STRING_SIZE], unsigned int ttl_ms, char *failed) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
+  uint64_t expires_at = ttl_ms > 0 ? ttl_now_ms() + ttl_ms : 0;
   pthread_rwlock_wrlock(&kvs_table->tablelock);
 
   for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
+    failed[i] = write_pair(kvs_table, keys[i], values[i], expires_at) != 0;
+    if (!failed[i] && expires_at != 0 && ttl_wheel_add(keys[i], expires_at) != 0) {
+      // Still expires, but only once accessed
+      fprintf(stderr, "Failed to schedule the expiry of %s\n", keys[i]);
     }
+    hotkeys_record(HOT_WRITE, keys[i]);
   }
 
   for (size_t i = 0; i < num_pairs; i++)  {
-    int index = hash(keys[i]);
-    KeyNode *keyNode = kvs_table->table[index];
+    if (failed[i]) {
+      continue;
+    }
+    KeyNode *keyNode = kvs_table->table[hash(keys[i])];
     while (keyNode != NULL) {
       // Only notify subscribers of the last change to the key
       if (strcmp(keyNode->key, keys[i]) == 0 && is_last_change(keys[i], keys, num_pairs, values, values[i])) {
-        notify_subscribers(keyNode, values[i]);
+        notify_subscribers(kvs_table, keyNode, values[i]);
       }
       keyNode = keyNode->next;
     }
@@ -82,43 +169,94 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
   return 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+int kvs_read_values(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                    char values[][MAX_STRING_SIZE], char *found) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
-  
+  if (num_pairs > MAX_WRITE_SIZE) {
+    fprintf(stderr, "Too many keys to read at once\n");
+    return 1;
+  }
+
+  char expired[MAX_WRITE_SIZE];
+  int any_expired = 0;
   pthread_rwlock_rdlock(&kvs_table->tablelock);
+  for (size_t i = 0; i < num_pairs; i++) {
+    char *result = read_pair(kvs_table, keys[i], &expired[i]);
+    hotkeys_record(HOT_READ, keys[i]);
+    any_expired |= expired[i];
+    found[i] = result != NULL;
+    if (result != NULL) {
+      strncpy(values[i], result, MAX_STRING_SIZE - 1);
+      values[i][MAX_STRING_SIZE - 1] = '\0';
+      free(result);
+    }
+  }
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+
+  // Deleting needs the write lock, taken only when a read found expired keys
+  if (any_expired) {
+    pthread_rwlock_wrlock(&kvs_table->tablelock);
+    for (size_t i = 0; i < num_pairs; i++) {
+      if (expired[i]) {
+        expire_pair(kvs_table, keys[i]);
+      }
+    }
+    pthread_rwlock_unlock(&kvs_table->tablelock);
+  }
+  return 0;
+}
+
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char found[MAX_WRITE_SIZE];
+  if (kvs_read_values(num_pairs, keys, values, found) != 0) {
+    return 1;
+  }
 
   write_str(fd, "[");
   for (size_t i = 0; i < num_pairs; i++) {
-    char *result = read_pair(kvs_table, keys[i]);
-    char aux[MAX_STRING_SIZE];
-    if (result == NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", keys[i]);
+    char aux[2 * MAX_STRING_SIZE + 4];  // room for both strings and "(,)"
+    if (!found[i]) {
+      snprintf(aux, sizeof(aux), "(%s,KVSERROR)", keys[i]);
     } else {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,%s)", keys[i], result);
+      snprintf(aux, sizeof(aux), "(%s,%s)", keys[i], values[i]);
     }
     write_str(fd, aux);
-    free(result);
   }
   write_str(fd, "]\n");
-  
-  pthread_rwlock_unlock(&kvs_table->tablelock);
   return 0;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+int kvs_delete_keys(size_t num_pairs, char keys[][MAX_STRING_SIZE], char *missing) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
+  if (num_pairs > MAX_WRITE_SIZE) {
+    fprintf(stderr, "Too many keys to delete at once\n");
+    return 1;
+  }
 
   pthread_rwlock_wrlock(&kvs_table->tablelock);
+  for (size_t i = 0; i < num_pairs; i++) {
+    missing[i] = delete_pair(kvs_table, keys[i]) != 0;
+  }
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  return 0;
+}
+
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+  char missing[MAX_WRITE_SIZE];
+  if (kvs_delete_keys(num_pairs, keys, missing) != 0) {
+    return 1;
+  }
 
   int aux = 0;
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
+    if (missing[i]) {
       if (!aux) {
         write_str(fd, "[");
         aux = 1;
@@ -131,8 +269,6 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
   if (aux) {
     write_str(fd, "]\n");
   }
-
-  pthread_rwlock_unlock(&kvs_table->tablelock);
   return 0;
 }
 
@@ -144,10 +280,15 @@ void kvs_show(int fd) {
   
   pthread_rwlock_rdlock(&kvs_table->tablelock);
   char aux[MAX_STRING_SIZE];
+  uint64_t now = ttl_now_ms();
   
   for (int i = 0; i < TABLE_SIZE; i++) {
     KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
     while (keyNode != NULL) {
+      if (pair_expired(keyNode, now)) {
+        keyNode = keyNode->next;
+        continue;
+      }
       snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", keyNode->key, keyNode->value);
       write_str(fd, aux);
       keyNode = keyNode->next; // Move to the next node of the list
@@ -157,22 +298,110 @@ void kvs_show(int fd) {
   pthread_rwlock_unlock(&kvs_table->tablelock);
 }
 
+#define MEMORY_LINE_SIZE 128
+#define CHAIN_CLASSES 8  // chain lengths 0, 1, 2-3, 4-7, ... and the rest
+
+// Class of a chain length in the histogram of kvs_memory.
+static int chain_class(size_t length) {
+  int class = 0;
+  while (length > 0 && class < CHAIN_CLASSES - 1) {
+    length >>= 1;
+    class++;
+  }
+  return class;
+}
+
+void kvs_memory(int fd) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return;
+  }
+
+  BucketMemory memory[TABLE_SIZE];
+  pthread_rwlock_rdlock(&kvs_table->tablelock);
+  memcpy(memory, kvs_table->memory, sizeof(memory));
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+
+  BucketMemory total = {0};
+  size_t used = 0, longest = 0;
+  size_t histogram[CHAIN_CLASSES] = {0};
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    total.nodes += memory[i].nodes;
+    total.key_bytes += memory[i].key_bytes;
+    total.value_bytes += memory[i].value_bytes;
+    total.allocated += memory[i].allocated;
+    used += memory[i].nodes > 0;
+    longest = memory[i].nodes > longest ? memory[i].nodes : longest;
+    histogram[chain_class(memory[i].nodes)]++;
+  }
+
+  char line[MEMORY_LINE_SIZE];
+  size_t node_bytes = total.nodes * sizeof(KeyNode);
+  size_t requested = node_bytes + total.key_bytes + total.value_bytes;
+  snprintf(line, sizeof(line), "nodes %zu, buckets used %zu/%d, longest chain %zu\n",
+           total.nodes, used, TABLE_SIZE, longest);
+  write_str(fd, line);
+  snprintf(line, sizeof(line), "bytes: keys %zu, values %zu, nodes %zu (%zu each)\n",
+           total.key_bytes, total.value_bytes, node_bytes, sizeof(KeyNode));
+  write_str(fd, line);
+  snprintf(line, sizeof(line), "allocated %zu, allocator overhead %zu\n", total.allocated,
+           total.allocated - requested);
+  write_str(fd, line);
+
+  // A perfect spread has every chain at the mean length
+  double mean = (double)total.nodes / TABLE_SIZE;
+  snprintf(line, sizeof(line), "mean chain %.2f, longest/mean %.2f\n", mean,
+           total.nodes > 0 ? (double)longest / mean : 0.0);
+  write_str(fd, line);
+
+  write_str(fd, "chain length histogram:\n");
+  for (int class = 0; class < CHAIN_CLASSES; class++) {
+    size_t low = class == 0 ? 0 : (size_t)1 << (class - 1);
+    size_t high = ((size_t)1 << class) - 1;
+    if (class == 0 || class == 1) {
+      snprintf(line, sizeof(line), "  %zu: %zu\n", low, histogram[class]);
+    } else if (class == CHAIN_CLASSES - 1) {
+      snprintf(line, sizeof(line), "  %zu+: %zu\n", low, histogram[class]);
+    } else {
+      snprintf(line, sizeof(line), "  %zu-%zu: %zu\n", low, high, histogram[class]);
+    }
+    write_str(fd, line);
+  }
+
+  write_str(fd, "nodes per bucket:");
+  for (int i = 0; i < TABLE_SIZE; i++) {
+    snprintf(line, sizeof(line), " %zu", memory[i].nodes);
+    write_str(fd, line);
+  }
+  write_str(fd, "\n");
+}
+
 int kvs_backup(size_t num_backup,char* job_filename , char* directory) {
   pid_t pid;
   char bck_name[50];
   snprintf(bck_name, sizeof(bck_name), "%s/%s-%ld.bck", directory, strtok(job_filename, "."),
            num_backup);
 
+  int record = backup_stats_claim(bck_name);
   pthread_rwlock_rdlock(&kvs_table->tablelock);
-  pid = fork();
+  uint64_t locked = stats_now();
+  pid = backup_stats_fork(record);
+  uint64_t forked = stats_now();
   pthread_rwlock_unlock(&kvs_table->tablelock);
   if (pid == 0) {
     // functions used here have to be async signal safe, since this
     // fork happens in a multi thread context (see man fork)
+    uint64_t write_ns = 0;
+    uint64_t now = ttl_now_ms();
+    affinity_apply_process(AFFINITY_AUX);
     int fd = open(bck_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     for (int i = 0; i < TABLE_SIZE; i++) {
       KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
       while (keyNode != NULL) {
+        if (pair_expired(keyNode, now)) {
+          keyNode = keyNode->next;
+          continue;
+        }
         char aux[MAX_STRING_SIZE];
         aux[0] = '(';
         size_t num_bytes_copied = 1; // the "("
@@ -186,12 +415,17 @@ int kvs_backup(size_t num_backup,char* job_filename , char* directory) {
         num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
                                         ")\n", MAX_STRING_SIZE - num_bytes_copied - 1);
         aux[num_bytes_copied] = '\0';
+        uint64_t write_start = stats_now();
         write_str(fd, aux);
+        write_ns += stats_now() - write_start;
         keyNode = keyNode->next; // Move to the next node of the list
       }
     }
+    backup_stats_child_done(record, forked, write_ns);
     exit(1);
-  } else if (pid < 0) {
+  }
+  backup_stats_forked(record, pid, forked - locked, stats_now() - locked);
+  if (pid < 0) {
     return -1;
   }
   return 0;
@@ -202,10 +436,10 @@ void kvs_wait(unsigned int delay_ms) {
   nanosleep(&delay, NULL);
 }
 
-char kvs_subscribe(const char* key, int notif_fd) {
+char kvs_subscribe(const char* key, const Subscriber* subscriber) {
   //Para evitar que sejam feitas alterações enquanto se está a adicionar um subscriber
   pthread_rwlock_wrlock(&kvs_table->tablelock);
-  int temp = add_subscriber(kvs_table, key, notif_fd);
+  int temp = add_subscriber(kvs_table, key, subscriber);
   pthread_rwlock_unlock(&kvs_table->tablelock);
   char ret = temp == 0 ? 0 : 1;
   return ret;
@@ -220,6 +454,37 @@ char kvs_unsubscribe(const char* key, int notif_fd) {
   return ret;
 }
 
+void kvs_subscribe_batch(char keys[][MAX_STRING_SIZE + 1], size_t count,
+                         const Subscriber* subscriber, char* results) {
+  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  for (size_t i = 0; i < count; i++) {
+    results[i] = add_subscriber(kvs_table, keys[i], subscriber) == 0 ? 0 : 1;
+  }
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+}
+
+char kvs_resume(char keys[][MAX_STRING_SIZE + 1], size_t count, change_seq_t seq,
+                const Subscriber* subscriber, char* results) {
+  // No change can be made between the replay and the first live notification
+  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  for (size_t i = 0; i < count; i++) {
+    results[i] = add_subscriber(kvs_table, keys[i], subscriber) == 0 ? 0 : 1;
+  }
+  // Keys that failed to subscribe may have been deleted meanwhile
+  int mode = replay_changes(kvs_table, keys, count, seq, subscriber);
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+  return (char)mode;
+}
+
+void kvs_unsubscribe_batch(char keys[][MAX_STRING_SIZE + 1], size_t count, int notif_fd,
+                           char* results) {
+  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  for (size_t i = 0; i < count; i++) {
+    results[i] = remove_subscriber(kvs_table, keys[i], notif_fd) == 0 ? 0 : 1;
+  }
+  pthread_rwlock_unlock(&kvs_table->tablelock);
+}
+
 void kvs_disconnect_client(char keys[MAX_NUMBER_SUB][MAX_STRING_SIZE], int notif_fd) {
   // To avoid changes while removing a subscriber
   pthread_rwlock_wrlock(&kvs_table->tablelock);
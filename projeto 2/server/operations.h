@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include "constants.h"
+#include "kvs.h"
 
 /// Initializes the KVS state.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
@@ -19,6 +20,28 @@ int kvs_terminate();
 /// @return 0 if the pairs were written successfully, 1 otherwise.
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
 
+/// Writes key value pairs that expire after a while. Expired keys are
+/// deleted as by kvs_delete, when next accessed or by the expiry thread.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings.
+/// @param ttl_ms Time to live of the keys in milliseconds, 0 for forever.
+/// @return 0 if the pairs were handled, a pair that could not be written is
+///         only reported on stderr; 1 otherwise.
+int kvs_write_ttl(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                  char values[][MAX_STRING_SIZE], unsigned int ttl_ms);
+
+/// Writes key value pairs, reporting which ones could not be written, for
+/// replies in binary form.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings.
+/// @param ttl_ms Time to live of the keys in milliseconds, 0 for forever.
+/// @param failed Set to 1 for each pair that was not written, 0 otherwise.
+/// @return 0 if the pairs were handled, 1 otherwise.
+int kvs_write_keys(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                   char values[][MAX_STRING_SIZE], unsigned int ttl_ms, char *failed);
+
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
@@ -26,6 +49,22 @@ int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_
 /// @return 0 if the key reading, 1 otherwise.
 int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
 
+/// Reads values from the KVS into arrays, for replies in binary form.
+/// @param num_pairs Number of pairs to read, at most MAX_WRITE_SIZE.
+/// @param keys Array of keys' strings.
+/// @param values Set to the value of each key that exists.
+/// @param found Set to 1 for each key that exists, 0 otherwise.
+/// @return 0 if the keys were read, 1 otherwise.
+int kvs_read_values(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                    char values[][MAX_STRING_SIZE], char *found);
+
+/// Deletes keys from the KVS, reporting which ones did not exist.
+/// @param num_pairs Number of keys to delete, at most MAX_WRITE_SIZE.
+/// @param keys Array of keys' strings.
+/// @param missing Set to 1 for each key that did not exist, 0 otherwise.
+/// @return 0 if the keys were deleted, 1 otherwise.
+int kvs_delete_keys(size_t num_pairs, char keys[][MAX_STRING_SIZE], char *missing);
+
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
@@ -36,6 +75,11 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
 /// @param fd File descriptor to write the output.
 void kvs_show(int fd);
 
+/// Writes the memory held by the table and how its keys spread over the
+/// buckets: counts, bytes, allocator overhead and chain lengths.
+/// @param fd File descriptor to write the output.
+void kvs_memory(int fd);
+
 /// Creates a backup of the KVS state and stores it in the correspondent
 /// backup file
 /// @return 0 if the backup was successful, 1 otherwise.
@@ -62,14 +106,41 @@ int get_n_current_backups();
 
 /// Adds a subscriber to a key.
 /// @param key The key to subscribe to.
-/// @param notif_fd The file descriptor to write the notification.
-char kvs_subscribe(const char* key, int notif_fd);
+/// @param subscriber Where and how to send the notifications.
+char kvs_subscribe(const char* key, const Subscriber* subscriber);
 
 /// Removes a subscriber from a key.
 /// @param key The key to unsubscribe from. 
 /// @param notif_fd The file descriptor to write the notification.
 char kvs_unsubscribe(const char* key, int notif_fd);
 
+/// Adds a subscriber to several keys, taking the table lock once.
+/// @param keys The keys to subscribe to.
+/// @param count Number of keys.
+/// @param subscriber Where and how to send the notifications.
+/// @param results Set to the result of kvs_subscribe for each key.
+void kvs_subscribe_batch(char keys[][MAX_STRING_SIZE + 1], size_t count,
+                         const Subscriber* subscriber, char* results);
+
+/// Subscribes to several keys as kvs_subscribe_batch, and sends the changes
+/// to them the subscriber missed since a sequence number, see replay_changes.
+/// @param keys The keys to subscribe to.
+/// @param count Number of keys.
+/// @param seq Last sequence number the subscriber saw.
+/// @param subscriber Where and how to send the notifications.
+/// @param results Set to the result of kvs_subscribe for each key.
+/// @return RESUME_REPLAYED or RESUME_SNAPSHOT.
+char kvs_resume(char keys[][MAX_STRING_SIZE + 1], size_t count, change_seq_t seq,
+                const Subscriber* subscriber, char* results);
+
+/// Removes a subscriber from several keys, taking the table lock once.
+/// @param keys The keys to unsubscribe from.
+/// @param count Number of keys.
+/// @param notif_fd The file descriptor to write the notifications.
+/// @param results Set to the result of kvs_unsubscribe for each key.
+void kvs_unsubscribe_batch(char keys[][MAX_STRING_SIZE + 1], size_t count, int notif_fd,
+                           char* results);
+
 /// Disconnects a client from the server.
 /// @param keys The keys to unsubscribe from.
 /// @param notif_fd The file descriptor to write the notification.
@@ -130,17 +130,40 @@ enum Command get_next(int fd) {
       return CMD_DELETE;
 
     case 'S':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+      if (read(fd, buf + 1, 3) != 3) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+      if (strncmp(buf, "SHOW", 4) == 0) {
+        if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        return CMD_SHOW;
+      }
+
+      if (strncmp(buf, "STAT", 4) != 0 || read(fd, buf + 4, 1) != 1 || buf[4] != 'S') {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (read(fd, buf + 5, 1) == 0 || buf[5] == '\n') {
+        return CMD_STATS;
+      }
+
+      if (buf[5] != ' ' || read(fd, buf + 6, 6) != 6 || strncmp(buf + 6, "MEMORY", 6) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      return CMD_SHOW;
+      if (read(fd, buf + 12, 1) != 0 && buf[12] != '\n') {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_STATS_MEMORY;
 
     case 'B':
       if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
@@ -156,7 +179,26 @@ enum Command get_next(int fd) {
       return CMD_BACKUP;
 
     case 'H':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+      if (read(fd, buf + 1, 3) != 3) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (strncmp(buf, "HOTK", 4) == 0) {
+        if (read(fd, buf + 4, 3) != 3 || strncmp(buf + 4, "EYS", 3) != 0) {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        if (read(fd, buf + 7, 1) != 0 && buf[7] != '\n') {
+          cleanup(fd);
+          return CMD_INVALID;
+        }
+
+        return CMD_HOTKEYS;
+      }
+
+      if (strncmp(buf, "HELP", 4) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -200,14 +242,11 @@ int parse_pair(int fd, char *key, char *value) {
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+// Parses the pairs of a WRITE command, after its '['.
+static size_t parse_pairs(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+                          size_t max_pairs, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
-    return 0;
-  }
-
   if (read(fd, &ch, 1) != 1 || ch != '(') {
     cleanup(fd);
     return 0;
@@ -248,6 +287,51 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
   return num_pairs;
 }
 
+size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+  char ch;
+
+  if (read(fd, &ch, 1) != 1 || ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  return parse_pairs(fd, keys, values, max_pairs, max_string_size);
+}
+
+size_t parse_write_ttl(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+                       size_t max_pairs, size_t max_string_size, unsigned int *ttl_ms) {
+  char ch;
+  *ttl_ms = 0;
+
+  if (read(fd, &ch, 1) != 1) {
+    return 0;
+  }
+
+  if (ch == 'T') {
+    char buf[3];
+    if (read(fd, buf, 3) != 3 || strncmp(buf, "TL ", 3) != 0) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (read_uint(fd, ttl_ms, &ch) != 0 || ch != ' ' || *ttl_ms == 0) {
+      cleanup(fd);
+      return 0;
+    }
+
+    if (read(fd, &ch, 1) != 1) {
+      return 0;
+    }
+  }
+
+  if (ch != '[') {
+    cleanup(fd);
+    return 0;
+  }
+
+  return parse_pairs(fd, keys, values, max_pairs, max_string_size);
+}
+
 size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
   char ch;
 
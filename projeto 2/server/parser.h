@@ -12,6 +12,9 @@ enum Command {
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
+  CMD_STATS,
+  CMD_STATS_MEMORY,
+  CMD_HOTKEYS,
   CMD_EMPTY,
   CMD_INVALID,
   EOC  // End of commands
@@ -33,6 +36,19 @@ enum Command get_next(int fd);
 //          of pairs parsed.
 size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
 
+/// Parses a WRITE command, which may give the keys a time to live:
+/// "WRITE TTL <ttl_ms> [(key,value),...]".
+/// @param fd File descriptor to read from.
+/// @param keys Array to store the keys
+/// @param values Array to store the values
+/// @param max_pairs Maximum number of pairs it will write.
+/// @param max_string_size Maximum string size allowed.
+/// @param ttl_ms Set to the time to live in milliseconds, 0 if not given.
+/// @return 0 if the command was not parsed successfully, otherwise the
+///         number of pairs parsed.
+size_t parse_write_ttl(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE],
+                       size_t max_pairs, size_t max_string_size, unsigned int *ttl_ms);
+
 // Parses a READ or a DELETE command.
 // @param fd File descriptor to read from.
 // @param keys Array to store the keys
@@ -0,0 +1,183 @@
+#include "scheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Compares two timespecs.
+// @return <0 if a is earlier than b, 0 if equal, >0 otherwise.
+static int timespec_cmp(const struct timespec *a, const struct timespec *b) {
+  if (a->tv_sec != b->tv_sec) {
+    return a->tv_sec < b->tv_sec ? -1 : 1;
+  }
+  if (a->tv_nsec != b->tv_nsec) {
+    return a->tv_nsec < b->tv_nsec ? -1 : 1;
+  }
+  return 0;
+}
+
+static void heap_swap(job_t **heap, size_t i, size_t j) {
+  job_t *tmp = heap[i];
+  heap[i] = heap[j];
+  heap[j] = tmp;
+}
+
+static void heap_push(job_scheduler *sched, job_t *job) {
+  if (sched->timer_count == sched->timer_capacity) {
+    size_t capacity = sched->timer_capacity == 0 ? 8 : sched->timer_capacity * 2;
+    job_t **timers = realloc(sched->timers, capacity * sizeof(job_t *));
+    if (timers == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      exit(EXIT_FAILURE);
+    }
+    sched->timers = timers;
+    sched->timer_capacity = capacity;
+  }
+
+  size_t i = sched->timer_count++;
+  sched->timers[i] = job;
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (timespec_cmp(&sched->timers[parent]->wake_at, &sched->timers[i]->wake_at) <= 0) {
+      break;
+    }
+    heap_swap(sched->timers, parent, i);
+    i = parent;
+  }
+}
+
+static job_t *heap_pop(job_scheduler *sched) {
+  job_t *top = sched->timers[0];
+  sched->timers[0] = sched->timers[--sched->timer_count];
+
+  size_t i = 0;
+  while (1) {
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+    size_t smallest = i;
+    if (left < sched->timer_count &&
+        timespec_cmp(&sched->timers[left]->wake_at, &sched->timers[smallest]->wake_at) < 0) {
+      smallest = left;
+    }
+    if (right < sched->timer_count &&
+        timespec_cmp(&sched->timers[right]->wake_at, &sched->timers[smallest]->wake_at) < 0) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      break;
+    }
+    heap_swap(sched->timers, i, smallest);
+    i = smallest;
+  }
+  return top;
+}
+
+// Pops the earliest parked job if its deadline has expired.
+// Must be called with sched->lock held.
+static job_t *pop_due(job_scheduler *sched) {
+  if (sched->timer_count == 0) {
+    return NULL;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (timespec_cmp(&sched->timers[0]->wake_at, &now) > 0) {
+    return NULL;
+  }
+  return heap_pop(sched);
+}
+
+int sched_init(job_scheduler *sched) {
+  pthread_condattr_t attr;
+  if (pthread_condattr_init(&attr) != 0) {
+    return 1;
+  }
+  // Deadlines are monotonic so that WAITs are not affected by clock changes
+  if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+      pthread_cond_init(&sched->cond, &attr) != 0) {
+    pthread_condattr_destroy(&attr);
+    return 1;
+  }
+  pthread_condattr_destroy(&attr);
+
+  if (pthread_mutex_init(&sched->lock, NULL) != 0) {
+    pthread_cond_destroy(&sched->cond);
+    return 1;
+  }
+
+  sched->timers = NULL;
+  sched->timer_count = 0;
+  sched->timer_capacity = 0;
+  sched->live_jobs = 0;
+  return 0;
+}
+
+void sched_destroy(job_scheduler *sched) {
+  free(sched->timers);
+  pthread_cond_destroy(&sched->cond);
+  pthread_mutex_destroy(&sched->lock);
+}
+
+void sched_job_started(job_scheduler *sched) {
+  pthread_mutex_lock(&sched->lock);
+  sched->live_jobs++;
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void sched_job_finished(job_scheduler *sched) {
+  pthread_mutex_lock(&sched->lock);
+  sched->live_jobs--;
+  if (sched->live_jobs == 0) {
+    pthread_cond_broadcast(&sched->cond);
+  }
+  pthread_mutex_unlock(&sched->lock);
+}
+
+void sched_set_delay(job_t *job, unsigned int delay_ms) {
+  clock_gettime(CLOCK_MONOTONIC, &job->wake_at);
+  job->wake_at.tv_sec += delay_ms / 1000;
+  job->wake_at.tv_nsec += (long)(delay_ms % 1000) * 1000000;
+  if (job->wake_at.tv_nsec >= 1000000000) {
+    job->wake_at.tv_sec++;
+    job->wake_at.tv_nsec -= 1000000000;
+  }
+}
+
+void sched_park(job_scheduler *sched, job_t *job) {
+  pthread_mutex_lock(&sched->lock);
+  heap_push(sched, job);
+  // The new deadline may be earlier than the one idle workers are sleeping on
+  pthread_cond_broadcast(&sched->cond);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+job_t *sched_poll(job_scheduler *sched) {
+  pthread_mutex_lock(&sched->lock);
+  job_t *job = pop_due(sched);
+  pthread_mutex_unlock(&sched->lock);
+  return job;
+}
+
+job_t *sched_wait(job_scheduler *sched) {
+  job_t *job = NULL;
+
+  pthread_mutex_lock(&sched->lock);
+  while (1) {
+    if ((job = pop_due(sched)) != NULL) {
+      break;
+    }
+
+    if (sched->timer_count > 0) {
+      // Copied, the job may be resumed and freed by another worker meanwhile
+      struct timespec deadline = sched->timers[0]->wake_at;
+      pthread_cond_timedwait(&sched->cond, &sched->lock, &deadline);
+    } else if (sched->live_jobs == 0) {
+      break;
+    } else {
+      // Other workers are still running jobs that may park later
+      pthread_cond_wait(&sched->cond, &sched->lock);
+    }
+  }
+  pthread_mutex_unlock(&sched->lock);
+
+  return job;
+}
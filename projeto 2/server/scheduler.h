@@ -0,0 +1,76 @@
+#ifndef KVS_SCHEDULER_H
+#define KVS_SCHEDULER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "constants.h"
+
+// Result of running a job until it can no longer make progress.
+enum job_status {
+  JOB_FINISHED = 0,  // reached the end of the .job file
+  JOB_ABORT = 1,     // the process must terminate (backup child)
+  JOB_PARKED = 2     // stopped at a WAIT, resume once wake_at is reached
+};
+
+// A .job file being executed. Holds everything needed to resume it on any
+// worker thread after it was parked by a WAIT.
+typedef struct {
+  int in_fd;
+  int out_fd;
+  char filename[MAX_JOB_FILE_NAME_SIZE];
+  size_t file_backups;
+  struct timespec wake_at;
+} job_t;
+
+// Parked jobs are kept in a min-heap ordered by wake_at, so a WAIT never
+// holds a worker thread: the worker moves on to other jobs and whichever
+// worker is free when the deadline expires resumes the job.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  job_t **timers;
+  size_t timer_count;
+  size_t timer_capacity;
+  size_t live_jobs;  // jobs opened and not yet finished (running or parked)
+} job_scheduler;
+
+/// Initializes the scheduler.
+/// @param sched Scheduler to initialize.
+/// @return 0 on success, 1 otherwise.
+int sched_init(job_scheduler *sched);
+
+/// Destroys the scheduler. There must be no parked jobs left.
+/// @param sched Scheduler to destroy.
+void sched_destroy(job_scheduler *sched);
+
+/// Registers a newly opened job as live.
+/// @param sched Scheduler.
+void sched_job_started(job_scheduler *sched);
+
+/// Marks a live job as finished, waking idle workers if it was the last one.
+/// @param sched Scheduler.
+void sched_job_finished(job_scheduler *sched);
+
+/// Sets the deadline of a job to delay_ms milliseconds from now.
+/// @param job Job that is about to be parked.
+/// @param delay_ms Delay in milliseconds.
+void sched_set_delay(job_t *job, unsigned int delay_ms);
+
+/// Parks a job until its wake_at deadline.
+/// @param sched Scheduler.
+/// @param job Job to park.
+void sched_park(job_scheduler *sched, job_t *job);
+
+/// Takes a parked job whose deadline has already expired, without blocking.
+/// @param sched Scheduler.
+/// @return The job to resume, NULL if none is due.
+job_t *sched_poll(job_scheduler *sched);
+
+/// Blocks until a parked job is due.
+/// @param sched Scheduler.
+/// @return The job to resume, NULL once there are no live jobs left.
+job_t *sched_wait(job_scheduler *sched);
+
+#endif  // KVS_SCHEDULER_H
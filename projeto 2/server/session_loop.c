@@ -0,0 +1,177 @@
+#include "session_loop.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "../common/io.h"
+#include "affinity.h"
+#include "client_util.h"
+
+#define MAX_EVENTS 64
+
+typedef struct {
+  int epoll_fd;
+  pthread_t thread;
+} event_loop;
+
+static event_loop *loops = NULL;
+static int loop_count = 0;
+static unsigned int next_loop = 0;  // only used by the accepting thread
+
+// The slot and the request pipe of a session are both kept in the epoll
+// data, the pipe is needed to tell if the slot was reused in the meantime.
+static uint64_t pack_session(int index, int req_fd) {
+  return ((uint64_t)(uint32_t)index << 32) | (uint32_t)req_fd;
+}
+
+// Waits for the client to take its replies instead of for its requests while
+// some are left, and the other way around once it took them all. Must hold
+// the session lock.
+// @return 0 on success, 1 otherwise.
+static int watch_replies(event_loop *loop, int index, int req_fd) {
+  client_args *client = &active_clients[index];
+  int waiting = client->out_len > 0;
+  if (waiting == client->watching_replies) {
+    return 0;
+  }
+  client->watching_replies = waiting;
+
+  struct epoll_event event;
+  event.data.u64 = pack_session(index, req_fd);
+  if (client->is_socket) {
+    // Requests and replies share the socket
+    event.events = waiting ? EPOLLOUT : EPOLLIN;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, req_fd, &event) == -1;
+  }
+
+  event.events = waiting ? 0 : EPOLLIN;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, req_fd, &event) == -1) {
+    return 1;
+  }
+  event.events = EPOLLOUT;
+  return epoll_ctl(loop->epoll_fd, waiting ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                   client->resp_pipe_fd, &event) == -1;
+}
+
+// Stops watching a session that ended. Must hold the session lock.
+static void unwatch_session(event_loop *loop, int index, int req_fd) {
+  client_args *client = &active_clients[index];
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, req_fd, NULL);
+  if (client->watching_replies && !client->is_socket) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, client->resp_pipe_fd, NULL);
+  }
+  client->watching_replies = 0;
+}
+
+static void *event_loop_thread(void *arg) {
+  event_loop *loop = (event_loop *)arg;
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR1\n");
+    exit(1);
+  }
+  affinity_apply(AFFINITY_SESSIONS, "event loop");
+
+  struct epoll_event events[MAX_EVENTS];
+  while (1) {
+    int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      exit(1);
+    }
+
+    for (int i = 0; i < n; i++) {
+      int index = (int)(events[i].data.u64 >> 32);
+      int req_fd = (int)(uint32_t)events[i].data.u64;
+
+      if (session_lock(index, req_fd) != 0) {
+        // Torn down by a SIGUSR1 meanwhile, closing its pipes already took
+        // them out of epoll
+        continue;
+      }
+      int status = session_serve(index);
+      if (status == SESSION_OPEN && active_clients[index].out_len > 0 &&
+          (events[i].events & (EPOLLHUP | EPOLLERR))) {
+        // Its request pipe is closed and it will not take the replies
+        status = SESSION_LOST;
+      }
+      if (status == SESSION_OPEN && watch_replies(loop, index, req_fd) != 0) {
+        perror("epoll_ctl");
+        status = SESSION_LOST;
+      }
+      if (status != SESSION_OPEN) {
+        unwatch_session(loop, index, req_fd);
+      }
+      session_unlock(index);
+
+      if (status != SESSION_OPEN) {
+        session_end(index, req_fd);
+      }
+    }
+  }
+  return NULL;
+}
+
+int session_loop_start(int threads) {
+  loops = safe_malloc((size_t)threads * sizeof(event_loop));
+  loop_count = threads;
+
+  for (int i = 0; i < threads; i++) {
+    loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loops[i].epoll_fd == -1) {
+      perror("epoll_create1");
+      return 1;
+    }
+    if (pthread_create(&loops[i].thread, NULL, event_loop_thread, &loops[i]) != 0) {
+      fprintf(stderr, "Failed to create event loop thread %d\n", i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int session_loop_add(int index) {
+  client_args *client = &active_clients[index];
+  int req_fd = client->req_pipe_fd;
+
+  // A slow client must not stall the other sessions of its loop, so replies
+  // are left for it to take when it can. Sockets stay blocking, they are
+  // written with MSG_DONTWAIT instead.
+  if (session_lock(index, req_fd) != 0) {
+    return 0;
+  }
+  if (!client->is_socket) {
+    int flags = fcntl(client->resp_pipe_fd, F_GETFL);
+    if (flags == -1 || fcntl(client->resp_pipe_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+      perror("fcntl");
+      session_unlock(index);
+      return 1;
+    }
+  }
+  client->nonblocking = 1;
+  session_unlock(index);
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = pack_session(index, req_fd);
+
+  event_loop *loop = &loops[next_loop++ % (unsigned int)loop_count];
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, req_fd, &event) == -1) {
+    perror("epoll_ctl");
+    return 1;
+  }
+  return 0;
+}
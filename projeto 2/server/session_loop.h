@@ -0,0 +1,17 @@
+#ifndef SESSION_LOOP_H
+#define SESSION_LOOP_H
+
+/// Starts the event loop threads. Each one waits with epoll on the request
+/// pipes of its sessions, so a few threads serve every connected client.
+/// @param threads Number of event loop threads.
+/// @return 0 on success, 1 otherwise.
+int session_loop_start(int threads);
+
+/// Hands a connected session over to one of the event loops. Its response
+/// pipe is switched to non-blocking mode, replies the client does not take
+/// at once wait in the session until it does.
+/// @param index Slot of the session in active_clients.
+/// @return 0 on success, 1 otherwise.
+int session_loop_add(int index);
+
+#endif  // SESSION_LOOP_H
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include "socket_transport.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+static void socket_address(struct sockaddr_un *addr, const char *server_name) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  snprintf(addr->sun_path, sizeof(addr->sun_path), "%s%s", SOCKET_PATH_PREFIX, server_name);
+}
+
+int socket_listen(const char *server_name) {
+  struct sockaddr_un addr;
+  socket_address(&addr, server_name);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("socket");
+    return -1;
+  }
+
+  unlink(addr.sun_path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", addr.sun_path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void socket_unlink(const char *server_name) {
+  struct sockaddr_un addr;
+  socket_address(&addr, server_name);
+  unlink(addr.sun_path);
+}
+
+static uint64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+// Waits for new connections only while there is room to keep them.
+static void watch_listen_fd(socket_acceptor *acceptor) {
+  struct epoll_event event = {0};
+  event.events = acceptor->count < MAX_PENDING_CONNECTS ? EPOLLIN : 0;
+  event.data.fd = acceptor->listen_fd;
+  epoll_ctl(acceptor->epoll_fd, EPOLL_CTL_MOD, acceptor->listen_fd, &event);
+}
+
+// Stops waiting for the connect request of a connection, closing it or
+// leaving it to the session.
+static void forget_pending(socket_acceptor *acceptor, size_t i, int close_fd) {
+  epoll_ctl(acceptor->epoll_fd, EPOLL_CTL_DEL, acceptor->fds[i], NULL);
+  if (close_fd) {
+    close(acceptor->fds[i]);
+  }
+  acceptor->count--;
+  acceptor->fds[i] = acceptor->fds[acceptor->count];
+  acceptor->deadlines[i] = acceptor->deadlines[acceptor->count];
+  if (acceptor->count == MAX_PENDING_CONNECTS - 1) {
+    watch_listen_fd(acceptor);
+  }
+}
+
+int socket_acceptor_init(socket_acceptor *acceptor, int listen_fd) {
+  acceptor->listen_fd = listen_fd;
+  acceptor->count = 0;
+  acceptor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (acceptor->epoll_fd == -1) {
+    perror("epoll_create1");
+    return 1;
+  }
+
+  struct epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.fd = listen_fd;
+  if (epoll_ctl(acceptor->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+    perror("epoll_ctl");
+    close(acceptor->epoll_fd);
+    return 1;
+  }
+  return 0;
+}
+
+void socket_acceptor_destroy(socket_acceptor *acceptor) {
+  while (acceptor->count > 0) {
+    forget_pending(acceptor, 0, 1);
+  }
+  close(acceptor->epoll_fd);
+}
+
+// Accepts a connection and waits for its connect request with the others.
+// @return 1, as socket_accept when no client completed the handshake, -1
+//         if no connection could be accepted.
+static int accept_pending(socket_acceptor *acceptor) {
+  int fd = accept4(acceptor->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (epoll_ctl(acceptor->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    perror("epoll_ctl");
+    close(fd);
+    return 1;
+  }
+
+  acceptor->fds[acceptor->count] = fd;
+  acceptor->deadlines[acceptor->count] = now_ms() + CONNECT_TIMEOUT_S * 1000;
+  acceptor->count++;
+  if (acceptor->count == MAX_PENDING_CONNECTS) {
+    watch_listen_fd(acceptor);
+  }
+  return 1;
+}
+
+// Reads the connect request of a connection that has one. The socket stays
+// blocking, sessions read it with MSG_DONTWAIT.
+// @return 0 if client was set, 1 if the request was not a connect.
+static int read_connect(socket_acceptor *acceptor, size_t i, pending_session *client) {
+  int fd = acceptor->fds[i];
+  char frame[MAX_SOCKET_RECORD_SIZE];
+  ssize_t len = recv(fd, frame, sizeof(frame), MSG_DONTWAIT);
+  if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 1;
+  }
+
+  forget_pending(acceptor, i, 0);
+  if (len < CONNECT_V2_HEADER_SIZE || frame[0] != OP_CONNECT_V2) {
+    close(fd);
+    return 1;
+  }
+
+  memset(client, 0, sizeof(pending_session));
+  client->version = session_version((unsigned char)frame[1]);
+  client->is_socket = 1;
+  client->req_pipe_fd = fd;
+  client->resp_pipe_fd = fd;
+  client->notif_pipe_fd = fd;
+  return 0;
+}
+
+int socket_accept(socket_acceptor *acceptor, pending_session *client) {
+  // Sleeps until the next connection is due at most
+  uint64_t now = now_ms();
+  int timeout = -1;
+  for (size_t i = 0; i < acceptor->count; i++) {
+    uint64_t left = acceptor->deadlines[i] > now ? acceptor->deadlines[i] - now : 0;
+    if (timeout == -1 || left < (uint64_t)timeout) {
+      timeout = (int)left;
+    }
+  }
+
+  struct epoll_event event;
+  int n = epoll_wait(acceptor->epoll_fd, &event, 1, timeout);
+  if (n == -1) {
+    return -1;
+  }
+
+  int ret = 1;
+  if (n == 1) {
+    if (event.data.fd == acceptor->listen_fd) {
+      ret = accept_pending(acceptor);
+    } else {
+      for (size_t i = 0; i < acceptor->count; i++) {
+        if (acceptor->fds[i] == event.data.fd) {
+          ret = read_connect(acceptor, i, client);
+          break;
+        }
+      }
+    }
+  }
+
+  // A client that never sends its request must not keep its descriptor
+  now = now_ms();
+  for (size_t i = 0; i < acceptor->count;) {
+    if (acceptor->deadlines[i] <= now) {
+      forget_pending(acceptor, i, 1);
+    } else {
+      i++;
+    }
+  }
+  return ret;
+}
+
+int socket_receive(int fd, char records[][MAX_SOCKET_RECORD_SIZE], size_t *lens, int wait) {
+  struct mmsghdr messages[SOCKET_BATCH];
+  struct iovec iov[SOCKET_BATCH];
+
+  memset(messages, 0, sizeof(messages));
+  for (int i = 0; i < SOCKET_BATCH; i++) {
+    iov[i].iov_base = records[i];
+    iov[i].iov_len = MAX_SOCKET_RECORD_SIZE;
+    messages[i].msg_hdr.msg_iov = &iov[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  // Only the first record is waited for, the others are those already there
+  int n = recvmmsg(fd, messages, SOCKET_BATCH, wait ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+  for (int i = 0; i < n; i++) {
+    if (messages[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    // Clients never send empty records, one means the connection was closed
+    if (messages[i].msg_len == 0) {
+      return i;
+    }
+    lens[i] = messages[i].msg_len;
+  }
+  return n;
+}
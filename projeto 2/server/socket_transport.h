@@ -0,0 +1,65 @@
+#ifndef KVS_SOCKET_TRANSPORT_H
+#define KVS_SOCKET_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../common/protocol.h"
+#include "client_util.h"
+
+#define CONNECT_TIMEOUT_S 1  // to send the connect request once connected
+#define MAX_PENDING_CONNECTS 64  // connected sockets waiting for their request
+#define ACCEPT_RETRY_MS 10       // first wait after accept fails
+#define ACCEPT_MAX_RETRY_MS 1000 // while it keeps failing, e.g. on EMFILE
+
+/// Creates the listening socket of the server, see SOCKET_PATH_PREFIX.
+/// @param server_name Name of the server, as for the register pipe.
+/// @return The socket, -1 on failure.
+int socket_listen(const char *server_name);
+
+/// Removes the socket of the server, once it stops.
+/// @param server_name Name of the server, as for socket_listen.
+void socket_unlink(const char *server_name);
+
+// Connections accepted on the listening socket whose connect request did
+// not arrive yet. All of them are watched with a single epoll instance, so
+// a client that never sends its request only holds up its own session.
+typedef struct {
+    int listen_fd;
+    int epoll_fd;
+    int fds[MAX_PENDING_CONNECTS];
+    uint64_t deadlines[MAX_PENDING_CONNECTS];  // in ms, CONNECT_TIMEOUT_S after accept
+    size_t count;
+} socket_acceptor;
+
+/// Starts watching the listening socket.
+/// @param acceptor Acceptor to initialize.
+/// @param listen_fd Listening socket.
+/// @return 0 on success, 1 otherwise.
+int socket_acceptor_init(socket_acceptor *acceptor, int listen_fd);
+
+/// Closes the connections still waiting and stops watching the socket.
+/// @param acceptor The acceptor.
+void socket_acceptor_destroy(socket_acceptor *acceptor);
+
+/// Waits for the next event of the acceptor and handles it: accepts a
+/// client, reads a connect request, or drops the clients whose request is
+/// late. Never waits for a single client.
+/// @param acceptor The acceptor.
+/// @param client Set to the session once a client completed the handshake,
+///        the connection being its request, response and notification
+///        descriptor, with the version the session will use.
+/// @return 0 if client was set, 1 if no client completed the handshake,
+///         -1 if no connection could be accepted, with errno set.
+int socket_accept(socket_acceptor *acceptor, pending_session *client);
+
+/// Receives several records with a single call.
+/// @param fd Socket of a session.
+/// @param records Where to store the records.
+/// @param lens Set to the size of each record.
+/// @param wait If set, waits for the first record.
+/// @return Number of records received, 0 once the client closed the
+///         connection, -1 on failure with errno set.
+int socket_receive(int fd, char records[][MAX_SOCKET_RECORD_SIZE], size_t *lens, int wait);
+
+#endif  // KVS_SOCKET_TRANSPORT_H
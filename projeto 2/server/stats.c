@@ -0,0 +1,210 @@
+#include "stats.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/io.h"
+#include "hotkeys.h"
+#include "lock_profile.h"
+
+#define STATS_LINE_SIZE 160
+
+typedef struct {
+  uint64_t counts[STATS_BUCKETS];
+  uint64_t total;  // sum of the latencies, for the mean
+  uint64_t max;
+} histogram;
+
+static const char *const command_names[STAT_COMMANDS] = {
+    "WRITE",     "READ", "DELETE",    "SHOW",      "BACKUP",
+    "SUBSCRIBE", "FORK", "FORK_LOCK", "BCK_SERIAL", "BCK_WRITE"};
+
+// Only updated with relaxed atomics, readers may see a recording half done
+static histogram histograms[STAT_COMMANDS];
+
+// Minor faults of the server during the backups, one sample per backup
+static uint64_t fault_backups = 0;
+static uint64_t fault_total = 0;
+static uint64_t fault_max = 0;
+
+static char dump_path[PATH_MAX];
+static void (*exit_report)(void) = NULL;
+
+uint64_t stats_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * UINT64_C(1000000000) + (uint64_t)now.tv_nsec;
+}
+
+// Bucket of a latency: exact below 2 * STATS_SUB_BUCKETS, then the top
+// STATS_SUB_BITS + 1 bits of the value.
+static size_t bucket_of(uint64_t ns) {
+  if (ns < 2 * STATS_SUB_BUCKETS) {
+    return (size_t)ns;
+  }
+  unsigned int msb = 63 - (unsigned int)__builtin_clzll(ns);
+  if (msb >= STATS_MAX_BITS) {
+    return STATS_BUCKETS - 1;
+  }
+  unsigned int shift = msb - STATS_SUB_BITS;
+  return (size_t)shift * STATS_SUB_BUCKETS + (size_t)(ns >> shift);
+}
+
+// Highest latency that falls in a bucket.
+static uint64_t bucket_limit(size_t bucket) {
+  if (bucket < 2 * STATS_SUB_BUCKETS) {
+    return bucket;
+  }
+  unsigned int shift = (unsigned int)(bucket / STATS_SUB_BUCKETS) - 1;
+  uint64_t top = bucket % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS;
+  return ((top + 1) << shift) - 1;
+}
+
+static void update_max(uint64_t *max_ptr, uint64_t value) {
+  uint64_t max = __atomic_load_n(max_ptr, __ATOMIC_RELAXED);
+  while (value > max && !__atomic_compare_exchange_n(max_ptr, &max, value, 1, __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED)) {
+  }
+}
+
+void stats_record(stat_command command, uint64_t start) {
+  stats_record_ns(command, stats_now() - start);
+}
+
+void stats_record_ns(stat_command command, uint64_t ns) {
+  histogram *hist = &histograms[command];
+
+  __atomic_fetch_add(&hist->counts[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->total, ns, __ATOMIC_RELAXED);
+  update_max(&hist->max, ns);
+}
+
+void stats_record_faults(uint64_t faults) {
+  __atomic_fetch_add(&fault_backups, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&fault_total, faults, __ATOMIC_RELAXED);
+  update_max(&fault_max, faults);
+}
+
+// Latency below which a fraction of the recorded ones fall.
+static uint64_t percentile(const uint64_t *counts, uint64_t count, uint64_t max,
+                           double fraction) {
+  uint64_t rank = (uint64_t)(fraction * (double)count);
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+    seen += counts[bucket];
+    if (seen > rank) {
+      // The bucket limit may be past every latency recorded
+      uint64_t limit = bucket_limit(bucket);
+      return limit < max ? limit : max;
+    }
+  }
+  return max;
+}
+
+int stats_write(int fd) {
+  char line[STATS_LINE_SIZE];
+  snprintf(line, sizeof(line), "%-10s %10s %10s %10s %10s %10s %10s %10s\n", "command", "count",
+           "mean(us)", "p50(us)", "p90(us)", "p99(us)", "p999(us)", "max(us)");
+  if (write_all(fd, line, strlen(line)) == -1) {
+    return 1;
+  }
+
+  for (int command = 0; command < STAT_COMMANDS; command++) {
+    // A copy, so the percentiles agree with each other
+    uint64_t counts[STATS_BUCKETS];
+    uint64_t count = 0;
+    for (size_t bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+      counts[bucket] = __atomic_load_n(&histograms[command].counts[bucket], __ATOMIC_RELAXED);
+      count += counts[bucket];
+    }
+    uint64_t total = __atomic_load_n(&histograms[command].total, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&histograms[command].max, __ATOMIC_RELAXED);
+
+    snprintf(line, sizeof(line), "%-10s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+             command_names[command], (unsigned long long)count,
+             count > 0 ? (double)total / (double)count / 1e3 : 0.0,
+             (double)percentile(counts, count, max, 0.5) / 1e3,
+             (double)percentile(counts, count, max, 0.9) / 1e3,
+             (double)percentile(counts, count, max, 0.99) / 1e3,
+             (double)percentile(counts, count, max, 0.999) / 1e3, (double)max / 1e3);
+    if (write_all(fd, line, strlen(line)) == -1) {
+      return 1;
+    }
+  }
+
+  uint64_t backups = __atomic_load_n(&fault_backups, __ATOMIC_RELAXED);
+  uint64_t faults = __atomic_load_n(&fault_total, __ATOMIC_RELAXED);
+  snprintf(line, sizeof(line), "minor faults during backups: %llu, mean %.1f, max %llu\n",
+           (unsigned long long)faults, backups > 0 ? (double)faults / (double)backups : 0.0,
+           (unsigned long long)__atomic_load_n(&fault_max, __ATOMIC_RELAXED));
+  if (write_all(fd, line, strlen(line)) == -1) {
+    return 1;
+  }
+  return 0;
+}
+
+// Waits for SIGUSR2 and dumps the statistics, outside of any signal
+// handler so it can format and write freely.
+static void *stats_dumper(void *arg) {
+  sigset_t *set = (sigset_t *)arg;
+  int sig;
+
+  while (sigwait(set, &sig) == 0) {
+    if (sig != SIGUSR2) {
+      // Report, then let the signal end the server as usual
+      if (exit_report != NULL) {
+        exit_report();
+      }
+      LOCK_PROFILE_REPORT();
+      signal(sig, SIG_DFL);
+      pthread_sigmask(SIG_UNBLOCK, set, NULL);
+      raise(sig);
+    }
+    int fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      fprintf(stderr, "Failed to open %s\n", dump_path);
+      continue;
+    }
+    if (stats_write(fd) != 0 || hotkeys_write(fd) != 0) {
+      fprintf(stderr, "Failed to write %s\n", dump_path);
+    }
+    close(fd);
+  }
+  return NULL;
+}
+
+int stats_start(const char *server_name, void (*at_exit)(void)) {
+  static sigset_t set;
+  snprintf(dump_path, sizeof(dump_path), "%s%s", STATS_PATH_PREFIX, server_name);
+  exit_report = at_exit;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR2);
+  // The server only stops on these, so the reports are written then
+#ifdef LOCK_PROFILE
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+#endif
+  if (at_exit != NULL) {
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+  }
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    fprintf(stderr, "Failed to block SIGUSR2\n");
+    return 1;
+  }
+
+  pthread_t dumper;
+  if (pthread_create(&dumper, NULL, stats_dumper, &set) != 0) {
+    fprintf(stderr, "Failed to create the statistics thread\n");
+    return 1;
+  }
+  pthread_detach(dumper);
+  return 0;
+}
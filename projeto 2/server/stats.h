@@ -0,0 +1,65 @@
+#ifndef KVS_STATS_H
+#define KVS_STATS_H
+
+#include <stdint.h>
+
+// Log-linear buckets, as in HDR histograms: every power of two is split in
+// STATS_SUB_BUCKETS, so a recorded latency is off by at most 1/32 of it
+#define STATS_SUB_BITS 5
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 40  // latencies up to about 18 minutes, in ns
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+#define STATS_PATH_PREFIX "/tmp/al97_stats_"  // SIGUSR2 dumps, + server name
+
+// Commands whose latency is recorded, from the jobs or the sessions, then
+// the parts of a backup measured by backup_stats
+typedef enum {
+  STAT_WRITE,
+  STAT_READ,
+  STAT_DELETE,
+  STAT_SHOW,
+  STAT_BACKUP,
+  STAT_SUBSCRIBE,
+  STAT_FORK,
+  STAT_FORK_LOCK,
+  STAT_BCK_SERIAL,
+  STAT_BCK_WRITE,
+  STAT_COMMANDS
+} stat_command;
+
+/// Returns a timestamp to pass to stats_record once the command is done.
+/// @return Monotonic time in nanoseconds.
+uint64_t stats_now(void);
+
+/// Records the latency of a command. Safe from any thread, without locks.
+/// @param command Command that ran.
+/// @param start Timestamp taken by stats_now when the command started.
+void stats_record(stat_command command, uint64_t start);
+
+/// Records a latency measured elsewhere, such as in a backup child.
+/// @param command Command or part of a backup measured.
+/// @param ns Latency in nanoseconds.
+void stats_record_ns(stat_command command, uint64_t ns);
+
+/// Records the minor faults the server took while a backup child ran.
+/// @param faults Number of faults.
+void stats_record_faults(uint64_t faults);
+
+/// Writes the count and percentiles of every command, then the faults
+/// taken during backups.
+/// @param fd File descriptor to write to.
+/// @return 0 on success, 1 otherwise.
+int stats_write(int fd);
+
+/// Starts the thread that dumps the statistics and the hot keys to
+/// STATS_PATH_PREFIX<name> on every SIGUSR2. Must be called before any
+/// other thread is created, as they inherit the blocked SIGUSR2. Given
+/// at_exit, or built with LOCK_PROFILE, it also takes SIGINT and SIGTERM,
+/// running at_exit and writing the lock report before they stop the server.
+/// @param server_name Name of the server.
+/// @param at_exit Report to run when the server is stopped, may be NULL.
+/// @return 0 on success, 1 otherwise.
+int stats_start(const char *server_name, void (*at_exit)(void));
+
+#endif  // KVS_STATS_H
@@ -0,0 +1,187 @@
+#include "ttl_wheel.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lock_profile.h"
+
+#define TTL_NEAR_SLOTS (1 << TTL_NEAR_BITS)
+#define TTL_FAR_SLOTS (1 << TTL_FAR_BITS)
+
+typedef struct ttl_entry {
+  struct ttl_entry *next;
+  uint64_t expires_at;
+  char key[MAX_STRING_SIZE];
+} ttl_entry;
+
+// Slot i of level 0 holds the keys due at the ticks equal to i modulo
+// TTL_NEAR_SLOTS, slot i of level l those due in its turn of level l
+static ttl_entry *near[TTL_NEAR_SLOTS];
+static ttl_entry *far[TTL_LEVELS - 1][TTL_FAR_SLOTS];
+static size_t in_wheel = 0;
+
+// Expired keys not taken out yet, in the order they expired
+static ttl_entry *due_head = NULL;
+static ttl_entry **due_tail = &due_head;
+
+static uint64_t current_tick;
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t ttl_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+void ttl_wheel_init(void) {
+  current_tick = ttl_now_ms() / TTL_TICK_MS;
+  LOCK_PROFILE_NAME(&wheel_mutex, "ttl_wheel", -1);
+}
+
+// Bits of the tick the slots of a level are indexed by.
+static unsigned int level_shift(int level) {
+  return level == 0 ? 0 : TTL_NEAR_BITS + (unsigned int)(level - 1) * TTL_FAR_BITS;
+}
+
+static void push_due(ttl_entry *entry) {
+  entry->next = NULL;
+  *due_tail = entry;
+  due_tail = &entry->next;
+}
+
+// Puts an entry in the lowest level whose turn reaches its tick. Must hold
+// wheel_mutex.
+static void place(ttl_entry *entry) {
+  // Rounded up, so a key never expires early
+  uint64_t tick = (entry->expires_at + TTL_TICK_MS - 1) / TTL_TICK_MS;
+  if (tick <= current_tick) {
+    push_due(entry);
+    return;
+  }
+
+  uint64_t delta = tick - current_tick;
+  for (int level = 0; level < TTL_LEVELS; level++) {
+    uint64_t span = UINT64_C(1) << (TTL_NEAR_BITS + (unsigned int)level * TTL_FAR_BITS);
+    if (delta >= span) {
+      if (level < TTL_LEVELS - 1) {
+        continue;
+      }
+      // Too far, it waits in the last slot and is placed again from there
+      tick = current_tick + span - 1;
+    }
+
+    size_t slot = (size_t)(tick >> level_shift(level));
+    ttl_entry **list = level == 0 ? &near[slot % TTL_NEAR_SLOTS]
+                                  : &far[level - 1][slot % TTL_FAR_SLOTS];
+    entry->next = *list;
+    *list = entry;
+    in_wheel++;
+    return;
+  }
+}
+
+int ttl_wheel_add(const char *key, uint64_t expires_at) {
+  ttl_entry *entry = malloc(sizeof(ttl_entry));
+  if (entry == NULL) {
+    return 1;
+  }
+  strncpy(entry->key, key, MAX_STRING_SIZE - 1);
+  entry->key[MAX_STRING_SIZE - 1] = '\0';
+  entry->expires_at = expires_at;
+
+  pthread_mutex_lock(&wheel_mutex);
+  place(entry);
+  pthread_mutex_unlock(&wheel_mutex);
+  return 0;
+}
+
+// Takes a slot out and places its entries again, a level down or more.
+static void cascade(ttl_entry **list) {
+  ttl_entry *entry = *list;
+  *list = NULL;
+  while (entry != NULL) {
+    ttl_entry *next = entry->next;
+    in_wheel--;
+    place(entry);
+    entry = next;
+  }
+}
+
+// Moves the wheel to a tick, collecting the keys due on the way. Must hold
+// wheel_mutex.
+static void advance(uint64_t tick) {
+  if (in_wheel == 0 && tick > current_tick) {
+    current_tick = tick;
+    return;
+  }
+
+  while (current_tick < tick) {
+    current_tick++;
+    if (current_tick % TTL_NEAR_SLOTS == 0) {
+      // A turn of a level is over, bring down the next slot of the one above
+      for (int level = 1; level < TTL_LEVELS; level++) {
+        size_t slot = (size_t)(current_tick >> level_shift(level)) % TTL_FAR_SLOTS;
+        cascade(&far[level - 1][slot]);
+        if (slot != 0) {
+          break;
+        }
+      }
+    }
+
+    ttl_entry **list = &near[current_tick % TTL_NEAR_SLOTS];
+    for (ttl_entry *entry = *list; entry != NULL;) {
+      ttl_entry *next = entry->next;
+      in_wheel--;
+      push_due(entry);
+      entry = next;
+    }
+    *list = NULL;
+  }
+}
+
+size_t ttl_wheel_due(uint64_t now, char keys[][MAX_STRING_SIZE], size_t max) {
+  size_t count = 0;
+
+  pthread_mutex_lock(&wheel_mutex);
+  advance(now / TTL_TICK_MS);
+  while (count < max && due_head != NULL) {
+    ttl_entry *entry = due_head;
+    due_head = entry->next;
+    if (due_head == NULL) {
+      due_tail = &due_head;
+    }
+    memcpy(keys[count++], entry->key, MAX_STRING_SIZE);
+    free(entry);
+  }
+  pthread_mutex_unlock(&wheel_mutex);
+  return count;
+}
+
+static void free_list(ttl_entry *entry) {
+  while (entry != NULL) {
+    ttl_entry *next = entry->next;
+    free(entry);
+    entry = next;
+  }
+}
+
+void ttl_wheel_free(void) {
+  pthread_mutex_lock(&wheel_mutex);
+  for (int i = 0; i < TTL_NEAR_SLOTS; i++) {
+    free_list(near[i]);
+    near[i] = NULL;
+  }
+  for (int level = 0; level < TTL_LEVELS - 1; level++) {
+    for (int i = 0; i < TTL_FAR_SLOTS; i++) {
+      free_list(far[level][i]);
+      far[level][i] = NULL;
+    }
+  }
+  free_list(due_head);
+  due_head = NULL;
+  due_tail = &due_head;
+  in_wheel = 0;
+  pthread_mutex_unlock(&wheel_mutex);
+}
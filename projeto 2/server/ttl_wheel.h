@@ -0,0 +1,45 @@
+#ifndef KVS_TTL_WHEEL_H
+#define KVS_TTL_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Hierarchical timing wheel of the keys written with a TTL. The first level
+// has a slot per tick, each level above a slot per full turn of the one
+// below; a slot is moved down a level when its turn comes, so adding a key
+// and advancing a tick cost the same whatever the number of keys.
+
+#define TTL_TICK_MS 10
+#define TTL_NEAR_BITS 8  // slots of the first level, 2.56s
+#define TTL_FAR_BITS 6   // slots of each level above
+#define TTL_LEVELS 4     // up to about 7.7 days, later expiries wait at the top
+#define TTL_EXPIRE_BUDGET 64  // keys expired per tick at most
+
+/// Returns the clock expiry times are given in.
+/// @return Monotonic time in milliseconds.
+uint64_t ttl_now_ms(void);
+
+/// Starts the wheel at the current time.
+void ttl_wheel_init(void);
+
+/// Adds a key to expire. Stale entries, for keys since rewritten or
+/// deleted, are left in the wheel: whoever expires them checks the key.
+/// @param key Key to expire.
+/// @param expires_at Time it expires, from ttl_now_ms.
+/// @return 0 on success, 1 if there is no memory for it.
+int ttl_wheel_add(const char *key, uint64_t expires_at);
+
+/// Advances the wheel and takes out the keys that expired, oldest first.
+/// Those past max stay for the next call.
+/// @param now Current time, from ttl_now_ms.
+/// @param keys Where to copy the keys.
+/// @param max Maximum number of keys to take out.
+/// @return Number of keys taken out.
+size_t ttl_wheel_due(uint64_t now, char keys[][MAX_STRING_SIZE], size_t max);
+
+/// Frees every key left in the wheel.
+void ttl_wheel_free(void);
+
+#endif  // KVS_TTL_WHEEL_H
@@ -0,0 +1,86 @@
+#!/bin/bash
+
+# Run from "projeto 2", e.g. tests/run_tests.sh server/kvs client/client
+if [ -z "$2" ]; then
+    echo "Usage: $0 <server_executable> <client_executable>"
+    exit
+fi
+kvs_binary=$1
+client_binary=$2
+
+test_dir="tests/jobs"
+results_dir="tests/results"
+
+# The server runs until signalled, so each run is cut short once its jobs
+# (and the client scenario) had time to finish
+server_time=2
+
+# STATS and HOTKEYS report timings, sampled hot keys and allocator sizes;
+# keep only the parts that are the same on every run
+normalize() {
+    sed -E \
+        -e 's/^(command +count).*/\1/' \
+        -e 's/^([A-Z_]+ +[0-9]+) +[0-9.]+ .*/\1/' \
+        -e 's/^(bytes: keys [0-9]+, values [0-9]+), .*/\1/' \
+        -e '/^allocated /d' \
+        -e '/^  [^ ]+ {2,}[0-9]+$/d' \
+        "$1"
+}
+
+check() {
+    local name=$1
+    local output_file=$2
+    local result_file=$3
+
+    if [ -f "$output_file" ]; then
+        # Compare the output with the expected result
+        if diff <(normalize "$output_file") "$result_file"; then
+            echo -e "\e[32mTest passed for $name\e[0m"
+        else
+            echo -e "\e[31mTest failed for $name\e[0m"
+        fi
+    else
+        echo -e "\e[31mOutput file $output_file not found\e[0m"
+    fi
+}
+
+run_test() {
+    local file=$1
+    local filename
+    filename=$(basename "$file" .job)
+    local temp_dir
+    temp_dir=$(mktemp -d)
+
+    cp "$file" "$temp_dir"
+
+    timeout "$server_time" "$kvs_binary" "$temp_dir" 1 1 "test$$" &> /dev/null
+
+    check "$filename" "${temp_dir}/${filename}.out" "${results_dir}/${filename}.result"
+    rm -rf "$temp_dir"
+}
+
+# Online READ/WRITE/DELETE and subscriptions from a client, against a
+# server with no jobs
+run_client_test() {
+    local file=$1
+    local filename
+    filename=$(basename "$file" .txt)
+    local temp_dir
+    temp_dir=$(mktemp -d)
+
+    timeout "$server_time" "$kvs_binary" "$temp_dir" 1 1 "test$$" &> /dev/null &
+    sleep 0.3
+    "$client_binary" "c$$" "test$$" < "$file" > "${temp_dir}/${filename}.out" 2>&1
+    wait
+
+    # The request path holds the client id
+    sed -i "s/c$$/<id>/" "${temp_dir}/${filename}.out"
+    check "$filename" "${temp_dir}/${filename}.out" "${results_dir}/${filename}.result"
+    rm -rf "$temp_dir"
+}
+
+for file in "$test_dir"/*.job; do
+    run_test "$file"
+done
+
+run_client_test tests/client_data_tests.txt